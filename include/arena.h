@@ -0,0 +1,88 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ARENA_MAX_REGIONS  (16)
+#define ARENA_ALIGN        (128)          /* Default alignment: a cache line, and what the MFC likes best */
+#ifdef __PPU__
+#define ARENA_HUGE_PAGE    (1024*1024)    /* sysMemAllocate 1M pages */
+#define ARENA_SMALL_PAGE   (64*1024)
+#else
+#define ARENA_HUGE_PAGE    (2*1024*1024)  /* hugetlbfs, or transparent huge pages */
+#define ARENA_SMALL_PAGE   (4096)
+#endif
+
+/* Memory that is reserved once, in huge pages where the system has them,
+   and handed out by moving a pointer. Nothing is freed on its own; a frame
+   takes arena_mark() at the start and gives everything back with
+   arena_reset() at the end. */
+typedef struct
+{
+   uint8_t    *base;
+   size_t      size;
+   size_t      used;
+   int         huge;       /* Asked for in huge pages, and got them */
+} arenaregion_t;
+
+typedef struct
+{
+   arenaregion_t  region[ARENA_MAX_REGIONS];
+   uint32_t       regions;
+   uint32_t       current;    /* Region the allocations come from */
+   size_t         chunk;      /* Size of a new region */
+   size_t         peak;       /* Most bytes in use at once */
+   uint32_t       allocs;
+   uint32_t       resets;
+} arena_t;
+
+typedef struct
+{
+   uint32_t    region;
+   size_t      used;
+} arenamark_t;
+
+typedef struct
+{
+   size_t      reserved;
+   size_t      used;
+   size_t      peak;
+   size_t      hugebytes;  /* Backed by huge pages; on Linux what the kernel says in smaps */
+   uint32_t    pages;      /* Pages, so TLB entries, that map the whole arena */
+   uint32_t    regions;
+   uint32_t    allocs;
+   uint32_t    resets;
+} arenastats_t;
+
+/* Reserve the first region of @chunk bytes. More regions of that size
+   (or bigger, for a bigger allocation) are added when it is full.
+   Returns 0 on success. */
+int arena_create(arena_t *arena, size_t chunk);
+/* @bytes aligned to @align (0 is ARENA_ALIGN, at most a huge page), NULL
+   only when the system has no memory left. */
+void* arena_alloc(arena_t *arena, size_t bytes, size_t align);
+arenamark_t arena_mark(const arena_t *arena);
+/* Everything allocated after @mark is free again. */
+void arena_reset(arena_t *arena, arenamark_t mark);
+void arena_destroy(arena_t *arena);
+void arena_stats(const arena_t *arena, arenastats_t *stats);
+
+#ifndef __PPU__
+/* Count the data TLB misses of this thread, with perf events. Returns -1
+   where the kernel doesn't allow it. */
+int arena_tlb_open(void);
+/* Misses since arena_tlb_open. */
+uint64_t arena_tlb_read(int fd);
+void arena_tlb_close(int fd);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __ARENA_H__ */
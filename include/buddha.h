@@ -0,0 +1,67 @@
+#ifndef __BUDDHA_H__
+#define __BUDDHA_H__
+
+#include <stdint.h>
+
+#include "spustr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BUDDHA_MAX_ITER  (1000)
+#define BUDDHA_GRID      (64)     /* Cells per side of the importance map */
+#define BUDDHA_PROBES    (8)      /* Points per side a cell is tried with */
+#define BUDDHA_MIN_ITER  (20)     /* Orbits shorter than this hardly show */
+#define BUDDHA_ONE       (256)    /* What an orbit of an average cell adds to a pixel */
+#define BUDDHA_SPAN      (2.0f)   /* Points are taken from [-2, 2] x [-2, 2] */
+
+/* The Buddhabrot: points c are picked at random, and the orbit of every
+   one that escapes is drawn into a density image. Where c is picked from
+   follows an importance map: cells in which many points escape slowly get
+   more samples, and their orbits count for less, so the image is the
+   same as with uniform samples, only sooner. */
+typedef struct
+{
+   spucommand_t   formula;       /* formula, power, cre and cim */
+   uint32_t       width;
+   uint32_t       height;
+   float          x1, x2, y1, y2;
+   uint32_t       maxiter;
+   uint32_t       cdf[BUDDHA_GRID*BUDDHA_GRID];     /* Cell weights, summed up */
+   uint32_t       inc[BUDDHA_GRID*BUDDHA_GRID];     /* What an orbit from the cell adds */
+} buddhaplan_t;
+
+/* A worker's own density image, nobody else writes to it. */
+typedef struct
+{
+   uint32_t      *density;       /* width*height */
+   float         *orbit;
+   uint64_t       rng;
+   uint64_t       samples;
+   uint64_t       orbits;        /* Samples that escaped and were drawn */
+   uint64_t       splats;        /* Orbit points that fell in the image */
+} buddhabuf_t;
+
+/* Plan an image of width x height of the area, with the formula of
+   @formula (NULL is the Mandelbrot). Without @importance every cell is
+   sampled the same. */
+void buddha_plan(buddhaplan_t *plan, const spucommand_t *formula, uint32_t width, uint32_t height,
+                 float x1, float x2, float y1, float y2, uint32_t maxiter, int importance);
+/* A worker's buffer, drawing into @density (width*height, cleared here).
+   Workers need a different @seed each. Returns 0 on success. */
+int buddha_init(buddhabuf_t *buf, const buddhaplan_t *plan, uint32_t *density, uint64_t seed);
+void buddha_free(buddhabuf_t *buf);
+/* Pick @n points and draw their orbits. */
+void buddha_sample(const buddhaplan_t *plan, buddhabuf_t *buf, uint32_t n);
+/* Add pixels @first to @first + @n of the @count images into @dest. The
+   workers can merge a band each. */
+void buddha_merge(uint32_t *dest, uint32_t *const *density, int count, uint32_t first, uint32_t n);
+/* Grey levels of @n densities, the root of the density against the peak. */
+void buddha_image(const uint32_t *density, uint32_t *pixels, uint32_t n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __BUDDHA_H__ */
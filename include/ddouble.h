@@ -0,0 +1,125 @@
+#ifndef __DDOUBLE_H__
+#define __DDOUBLE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A number as the sum of two doubles that don't overlap: hi is the value
+   rounded to a double, lo what was left over. About 106 bits, for the
+   views that are too deep for a double. Shared with the SPU's. */
+typedef struct
+{
+   double      hi;
+   double      lo;
+} ddouble_t;
+
+#define DD_SPLIT    (134217729.0)             /* 2^27 + 1, cuts a double in halves of 26 bits */
+#define DD_EPSILON  (4.930380657631324e-32)   /* 2^-104, the last bit of a double-double */
+
+static inline ddouble_t dd_make(double hi, double lo)
+{
+   ddouble_t r;
+
+   r.hi = hi;
+   r.lo = lo;
+   return r;
+}
+
+/* a + b without rounding. */
+static inline ddouble_t dd_two_sum(double a, double b)
+{
+   ddouble_t r;
+   double    v;
+
+   r.hi = a + b;
+   v = r.hi - a;
+   r.lo = (a - (r.hi - v)) + (b - v);
+   return r;
+}
+
+/* The same when |a| >= |b|. */
+static inline ddouble_t dd_fast_two_sum(double a, double b)
+{
+   ddouble_t r;
+
+   r.hi = a + b;
+   r.lo = b - (r.hi - a);
+   return r;
+}
+
+/* a * b without rounding. With a fused multiply-add the error of the
+   product is one instruction, without it Dekker's split into halves
+   whose products are exact. */
+static inline ddouble_t dd_two_prod(double a, double b)
+{
+   ddouble_t r;
+
+   r.hi = a * b;
+#if defined(__FMA__) || defined(__SPU__) || defined(__PPU__)
+   r.lo = __builtin_fma(a, b, -r.hi);
+#else
+   {
+      double t = DD_SPLIT * a;
+      double ahi = t - (t - a);
+      double alo = a - ahi;
+      double bhi, blo;
+
+      t = DD_SPLIT * b;
+      bhi = t - (t - b);
+      blo = b - bhi;
+      r.lo = ((ahi * bhi - r.hi) + ahi * blo + alo * bhi) + alo * blo;
+   }
+#endif
+   return r;
+}
+
+static inline ddouble_t dd_add(ddouble_t a, ddouble_t b)
+{
+   ddouble_t s = dd_two_sum(a.hi, b.hi);
+   ddouble_t t = dd_two_sum(a.lo, b.lo);
+
+   s = dd_fast_two_sum(s.hi, s.lo + t.hi);
+   return dd_fast_two_sum(s.hi, s.lo + t.lo);
+}
+
+static inline ddouble_t dd_add_d(ddouble_t a, double b)
+{
+   ddouble_t s = dd_two_sum(a.hi, b);
+
+   return dd_fast_two_sum(s.hi, s.lo + a.lo);
+}
+
+static inline ddouble_t dd_neg(ddouble_t a)
+{
+   return dd_make(-a.hi, -a.lo);
+}
+
+static inline ddouble_t dd_sub(ddouble_t a, ddouble_t b)
+{
+   return dd_add(a, dd_neg(b));
+}
+
+static inline ddouble_t dd_abs(ddouble_t a)
+{
+   return a.hi < 0 ? dd_neg(a) : a;
+}
+
+static inline ddouble_t dd_mul(ddouble_t a, ddouble_t b)
+{
+   ddouble_t p = dd_two_prod(a.hi, b.hi);
+
+   return dd_fast_two_sum(p.hi, p.lo + (a.hi * b.lo + a.lo * b.hi));
+}
+
+/* 2a, exact. */
+static inline ddouble_t dd_twice(ddouble_t a)
+{
+   return dd_make(2 * a.hi, 2 * a.lo);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __DDOUBLE_H__ */
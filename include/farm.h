@@ -0,0 +1,125 @@
+#ifndef __FARM_H__
+#define __FARM_H__
+
+#include <stdint.h>
+
+#include "spustr.h"
+#include "arena.h"
+#include "farmsched.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FARM_PORT         (18195)
+#define FARM_MAGIC        (0x4d4e4433)   /* "MND3", commands with the double fields */
+#define FARM_MAX_WORKERS  (16)
+#define FARM_TILE_SIZE    (64)           /* Tiles are 64x64 pixels, less at the edges */
+#define FARM_INFLIGHT     (2)            /* Tiles queued per worker, hides the round trip */
+#define FARM_TIMEOUT_MS   (2000)         /* A worker that takes longer than this is dead */
+#define FARM_NO_TILE      (0xffffffff)
+#define FARM_SCRATCH      (2*1024*1024)  /* Per frame bookkeeping of farm_run, it grows if needed */
+#define FARM_SESSION_SHIFT (24)          /* Tile numbers on the wire are session << 24 | tile */
+#define FARM_TILE_MASK    ((1 << FARM_SESSION_SHIFT) - 1)
+#define FARM_SCHED_LAG    (20000)        /* us of worker time a session may be ahead to meet a deadline */
+#define FARM_MAX_NODES    (8)            /* NUMA nodes the tiles of a frame are split over */
+
+#define FARM_MSG_TILE     (1)            /* coordinator -> worker, payload is a spucommand_t */
+#define FARM_MSG_RESULT   (2)            /* worker -> coordinator, payload is an iterfile tile */
+#define FARM_MSG_QUIT     (3)            /* coordinator -> worker, end of session */
+#define FARM_MSG_HISTOGRAM (4)           /* both ways: the worker answers with its histogram, PALETTE_SIZE counts */
+
+/* Every message starts with this header, all fields in network byte order. */
+typedef struct
+{
+   uint32_t magic;
+   uint32_t type;
+   uint32_t tile;       /* tile number, given by the coordinator */
+   uint32_t length;     /* number of payload bytes after the header */
+} farmheader_t;
+
+typedef struct
+{
+   int      fd;                     /* -1 when the worker is dead */
+   uint32_t tile[FARM_INFLIGHT];    /* tiles handed out, FARM_NO_TILE if free */
+   uint32_t done;                   /* tiles finished in the last render */
+   uint64_t last;                   /* when its last result came in, us */
+   uint32_t node;                   /* NUMA node, for local workers; 0 for the others */
+} farmworker_t;
+
+typedef struct
+{
+   farmworker_t   worker[FARM_MAX_WORKERS];
+   int            count;
+   int            alive;
+   uint32_t       redispatched;     /* tiles that had to be handed out again */
+   uint32_t       nodes;            /* 1, or the nodes of the workers */
+   uint32_t       stolen;           /* tiles a worker took from the band of another node */
+   arena_t        scratch;          /* Tile states and buffers of a farm_sessions */
+   const uint32_t *palette;         /* farm_render colours the counts with it, NULL for grey */
+} farm_t;
+
+/* A batch of tiles. The coordinator asks for the command of a tile when it
+   hands it out, and passes the iteration counts to store() when they come
+   back, exactly once per tile. */
+typedef struct farmjob
+{
+   uint32_t   count;
+   void     (*command)(struct farmjob *job, uint32_t t, spucommand_t *command);
+   void     (*store)(struct farmjob *job, uint32_t t, const spucommand_t *command, const uint8_t *iter);
+} farmjob_t;
+
+/* A viewer with a camera of its own, for farm_sessions: it renders frame
+   after frame, each one a job. */
+typedef struct farmsession
+{
+   uint32_t     weight;     /* Share of the workers, against the other sessions */
+   uint32_t     deadline;   /* ms a frame should take, 0 for no deadline */
+   void        *ctx;
+   /* The job of the next frame, NULL when the session is over. @done is
+      the frame that just ended (NULL the first time), @ok 0 if it failed. */
+   farmjob_t* (*next)(struct farmsession *session, farmjob_t *done, int ok);
+
+   /* Filled in by farm_sessions */
+   uint32_t     frames;
+   uint32_t     late;       /* Frames that took longer than the deadline */
+   uint64_t     ms;         /* Sum of the frame times */
+   uint64_t     worst;      /* Slowest frame, ms */
+   uint64_t     work;       /* Time of the workers spent on its tiles, us */
+} farmsession_t;
+
+/* Connect to the workers in @hosts ("a.b.c.d" or "a.b.c.d:port").
+   Returns the number of workers that could be reached. */
+int farm_connect(farm_t *farm, const char *hosts[], int count);
+/* Render the area into @dest (width*height pixels, same format as the SPU's)
+   with the formula of @formula (NULL is the Mandelbrot). Tiles of failing
+   workers are handed to the others. Returns -1 if no worker is left to
+   finish the frame. */
+int farm_render(farm_t *farm, const spucommand_t *formula, uint32_t *dest,
+                uint32_t width, uint32_t height, double x1, double x2, double y1, double y2);
+/* Run all tiles of the job on the workers, -1 if they all died first. */
+int farm_run(farm_t *farm, farmjob_t *job);
+/* Serve @count sessions from the same workers until they are all over.
+   Their tiles are interleaved in the order of @mode, FARM_SCHED_FAIR or
+   FARM_SCHED_FIFO (see farmsched.h). Returns -1 if the workers all died first. */
+int farm_sessions(farm_t *farm, farmsession_t *sessions, int count, int mode);
+/* Calculate @count commands into @out, with @ctx the farm. Fits the
+   tilecache_compute_t of the tile cache. */
+int farm_compute(void *ctx, const spucommand_t *commands, uint8_t *const *out, uint32_t count);
+/* Collect the histograms of the workers, each of the iteration counts of
+   the tiles it calculated since it was last asked, and add them in a tree
+   into @hist (PALETTE_SIZE counts). Returns -1 if no worker is left. */
+int farm_histogram(farm_t *farm, uint32_t *hist);
+/* Send the workers home and close the connections. */
+void farm_close(farm_t *farm);
+
+/* Worker side: open the listening socket, returns -1 on error. */
+int farm_listen(uint16_t port);
+/* Worker side: serve coordinators, one at a time, until an error occurs. */
+int farm_serve(int listenfd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __FARM_H__ */
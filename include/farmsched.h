@@ -0,0 +1,64 @@
+#ifndef __FARMSCHED_H__
+#define __FARMSCHED_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FARM_SCHED_MAX_SESSIONS (16)
+#define FARM_SCHED_SCALE        (1024)    /* Virtual time per unit of cost, for a weight of 1 */
+#define FARM_SCHED_COST         (1000)    /* Cost of a tile before one was measured */
+
+#define FARM_SCHED_FIFO  (0)   /* Frames in the order they were started, like one queue for everybody */
+#define FARM_SCHED_FAIR  (1)   /* Weighted fair shares, deadlines within a bounded lag */
+
+/* Several sessions render frames on one pool of workers, a tile at a time.
+   Every session has a virtual time: the cost of the tiles it was given,
+   divided by its weight. The next tile goes to the session with the
+   earliest deadline among those that are no more than @lag ahead of the
+   one furthest behind, and without deadlines to the one furthest behind.
+   A session that always wants more, like a deep zoom, gets its share and
+   no more; the others never wait for more than @lag of it. */
+typedef struct
+{
+   uint32_t    weight;
+   uint32_t    pending;     /* Tiles of the frame that were not handed out */
+   uint32_t    busy;        /* Handed out, not done */
+   uint64_t    start;       /* When the frame started */
+   uint64_t    deadline;    /* When it should be done, 0 for whenever */
+   int64_t     vtime;
+   uint32_t    cost;        /* What a tile of it costs, a running average */
+   uint64_t    work;        /* Cost of all its tiles that were done */
+} schedsession_t;
+
+typedef struct
+{
+   schedsession_t session[FARM_SCHED_MAX_SESSIONS];
+   uint32_t       count;
+   int            mode;
+   int64_t        lag;
+} sched_t;
+
+/* @lag in units of cost (the caller's, time of a worker say). */
+void sched_init(sched_t *sched, int mode, uint32_t lag);
+/* Returns the number of the new session, -1 when there are too many. */
+int sched_add(sched_t *sched, uint32_t weight);
+/* Session @s starts a frame of @tiles tiles at @now. A session that was
+   idle doesn't bring credit along: it starts level with the others. */
+void sched_frame(sched_t *sched, int s, uint32_t tiles, uint64_t now, uint64_t deadline);
+/* The session the next tile is for, -1 when none has tiles left. */
+int sched_next(const sched_t *sched);
+/* A tile of @s was handed out, it is charged what it is expected to cost. */
+void sched_sent(sched_t *sched, int s);
+/* A tile of @s is done and cost @cost, the charge is corrected. */
+void sched_done(sched_t *sched, int s, uint32_t cost);
+/* A tile of @s has to be handed out again, it is not charged. */
+void sched_requeue(sched_t *sched, int s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __FARMSCHED_H__ */
@@ -0,0 +1,100 @@
+#ifndef __ITERFILE_H__
+#define __ITERFILE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "spustr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ITERFILE_MAGIC     (0x49544552)   /* "ITER" */
+#define ITERFILE_VERSION   (1)
+#define ITERFILE_HEADER    (64)           /* Bytes of the header, the tile index follows */
+#define ITERFILE_TILE      (64)           /* Tiles are 64x64 counts, less at the edges */
+#define ITERFILE_TILE_MAX  (1 + 2*ITERFILE_TILE*ITERFILE_TILE)   /* Worst case of a coded tile */
+#define ITERFILE_SLOT      (ITERFILE_TILE_MAX + 7)               /* Length and coded tile, while encoding */
+
+#define ITERFILE_RAW       (0)            /* Tile coding: 16 bit counts as they are */
+#define ITERFILE_PREDICTED (1)            /* Rows predicted from the left or from above */
+
+/* What an image of counts shows: the view and the kernel settings, so it
+   can be coloured again or continued later. */
+typedef struct
+{
+   uint32_t    width;
+   uint32_t    height;
+   uint32_t    maxiter;
+   uint32_t    formula;
+   uint32_t    power;
+   float       cre;
+   float       cim;
+   float       x1;
+   float       x2;
+   float       y1;
+   float       y2;
+} iterinfo_t;
+
+/* An image of 16 bit counts in tiles that are coded on their own, so any
+   number of workers can encode or decode ranges of them at the same time,
+   and a single tile can be had without the rest.
+   Packed it is the header, the end of every tile in the data, and the
+   data; all numbers big endian. */
+typedef struct
+{
+   iterinfo_t  info;
+   uint32_t    tilesx;
+   uint32_t    tiles;
+   uint32_t   *offset;     /* Decoding: start of every tile in @data, and the end */
+   uint8_t    *slots;      /* Encoding: ITERFILE_SLOT bytes per tile */
+   const uint8_t *data;    /* Decoding: the tiles as packed */
+   void       *own;        /* What iterfile_* allocated */
+   int         ownslots;
+} iterfile_t;
+
+/* The view and the formula settings of @formula (NULL is the Mandelbrot). */
+void iterfile_info(iterinfo_t *info, const spucommand_t *formula, uint32_t width, uint32_t height,
+                   float x1, float x2, float y1, float y2);
+
+/* Code the @width x @height counts at @counts (@stride counts a line)
+   into @out, ITERFILE_TILE_MAX bytes at most. Returns the length. */
+uint32_t iterfile_encode_tile(const uint16_t *counts, uint32_t stride, uint32_t width, uint32_t height,
+                              uint8_t *out);
+/* The other way round. Returns 0 on success, -1 if @in is not a tile of
+   that size. */
+int iterfile_decode_tile(const uint8_t *in, uint32_t len, uint16_t *counts, uint32_t stride,
+                         uint32_t width, uint32_t height);
+
+/* Bytes of the slots an image of @info needs while it is encoded. */
+size_t iterfile_slots(const iterinfo_t *info);
+/* Start encoding an image of @info, into @slots (iterfile_slots bytes,
+   shared memory for workers that are processes) or allocated when it is
+   NULL. Returns 0 on success. */
+int iterfile_init(iterfile_t *file, const iterinfo_t *info, uint8_t *slots);
+/* Encode the tiles @first to @first+@count-1 of @counts, width*height
+   counts without any stride. */
+void iterfile_encode(iterfile_t *file, const uint16_t *counts, uint32_t first, uint32_t count);
+/* Bytes iterfile_pack writes, once every tile is encoded. */
+size_t iterfile_size(const iterfile_t *file);
+/* Header, index and tiles into @out. Returns the bytes written. */
+size_t iterfile_pack(const iterfile_t *file, uint8_t *out);
+
+/* Start decoding the packed image at @data, which has to stay there.
+   Returns 0 on success, -1 if it is no image or a damaged one. */
+int iterfile_open(iterfile_t *file, const uint8_t *data, size_t size);
+/* Decode the tiles @first to @first+@count-1 into @counts, width*height
+   counts. Returns 0 on success. */
+int iterfile_decode(const iterfile_t *file, uint16_t *counts, uint32_t first, uint32_t count);
+
+/* Write an encoded image to @path, or read and open one. Return 0 on success. */
+int iterfile_save(const iterfile_t *file, const char *path);
+int iterfile_load(iterfile_t *file, const char *path);
+void iterfile_free(iterfile_t *file);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __ITERFILE_H__ */
@@ -0,0 +1,190 @@
+#ifndef __KERNEL_H__
+#define __KERNEL_H__
+
+#include <stdint.h>
+#include <math.h>
+
+#include "spustr.h"
+#include "ddouble.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define KERNEL_MAX_ITER (255)
+
+/* Instruction sets kernel_tile and kernel_points can run on. */
+#define KERNEL_ISA_SCALAR  (0)
+#define KERNEL_ISA_SSE2    (1)     /* x86, 4 points at a time */
+#define KERNEL_ISA_AVX2    (2)     /* 8 */
+#define KERNEL_ISA_AVX512  (3)     /* 16 */
+#define KERNEL_ISA_COUNT   (4)
+
+/* The precision of a kernel. Float is the vector kernels everywhere,
+   double has half the lanes, extended is a pair of doubles per number
+   and a point at a time. */
+#define KERNEL_PREC_FLOAT     (0)
+#define KERNEL_PREC_DOUBLE    (1)
+#define KERNEL_PREC_EXTENDED  (2)
+#define KERNEL_PREC_COUNT     (3)
+#define KERNEL_GUARD_BITS     (8)      /* Bits below the pixel spacing, for the error the iterations add */
+
+/* The settings a tile was calculated with, compared as they are. The
+   floats are kept as their bits, so equal means the same bits. */
+typedef struct
+{
+   uint32_t iter;       /* KERNEL_MAX_ITER */
+   uint32_t formula;
+   uint32_t power;
+   uint32_t cre;
+   uint32_t cim;
+} kernelparams_t;
+
+/* The cheapest precision that tells pixels @step apart at coordinates
+   up to @mag: log2(mag / step) bits, and the guard bits, have to fit in
+   the mantissa. Shared with the SPU's. */
+static inline int kernel_precision(double mag, double step)
+{
+   double ratio;
+
+   if (!(step > 0)) return KERNEL_PREC_EXTENDED;
+
+   ratio = mag / step;
+   if (ratio <= (double)(1ULL << (24 - KERNEL_GUARD_BITS))) return KERNEL_PREC_FLOAT;
+   if (ratio <= (double)(1ULL << (53 - KERNEL_GUARD_BITS))) return KERNEL_PREC_DOUBLE;
+   return KERNEL_PREC_EXTENDED;
+}
+
+/* The largest coordinate the pixels from @x0, @y0 to @x1, @y1 have to be
+   told apart next to. Julia adds c to the square of the pixel and the
+   orbit goes on up to the escape radius, so there it is at least 2. */
+static inline double kernel_magnitude(uint32_t formula, double x0, double y0, double x1, double y1)
+{
+   double mag = fmax(fmax(fabs(x0), fabs(x1)), fmax(fabs(y0), fabs(y1)));
+
+   return formula == FORMULA_JULIA ? fmax(mag, 2.0) : mag;
+}
+
+/* Escape time of kernel_point for a point given as double-doubles. The
+   formula is looked at every step, it is there for the few tiles of a
+   deep view that need it. Shared with the SPU's. */
+static inline uint32_t kernel_point_extended(const spucommand_t *command, ddouble_t x0, ddouble_t y0)
+{
+   ddouble_t   x = dd_make(0, 0);
+   ddouble_t   y = dd_make(0, 0);
+   ddouble_t   a = x0;
+   ddouble_t   b = y0;
+   ddouble_t   xtemp;
+   uint32_t    iteration = 0;
+   uint32_t    k;
+
+   if (command->formula == FORMULA_JULIA)
+   {
+      x = x0;
+      y = y0;
+      a = dd_make(command->cre, 0);
+      b = dd_make(command->cim, 0);
+   }
+
+   while (x.hi*x.hi + y.hi*y.hi < 2*2 && iteration < KERNEL_MAX_ITER)
+   {
+      switch (command->formula)
+      {
+      case FORMULA_BURNINGSHIP:
+         x = dd_abs(x);
+         y = dd_abs(y);
+         /* fall through */
+      default:
+         xtemp = dd_add(dd_sub(dd_mul(x, x), dd_mul(y, y)), a);
+         y = dd_add(dd_twice(dd_mul(x, y)), b);
+         x = xtemp;
+         break;
+
+      case FORMULA_TRICORN:
+         xtemp = dd_add(dd_sub(dd_mul(x, x), dd_mul(y, y)), a);
+         y = dd_sub(b, dd_twice(dd_mul(x, y)));
+         x = xtemp;
+         break;
+
+      case FORMULA_MULTIBROT:
+      {
+         ddouble_t zx = x;
+         ddouble_t zy = y;
+
+         for (k=1; k<command->power; k++)
+         {
+            xtemp = dd_sub(dd_mul(zx, x), dd_mul(zy, y));
+            zy = dd_add(dd_mul(zx, y), dd_mul(zy, x));
+            zx = xtemp;
+         }
+
+         x = dd_add(zx, a);
+         y = dd_add(zy, b);
+         break;
+      }
+      }
+
+      iteration++;
+   }
+
+   return iteration;
+}
+
+/* The escape count @count made continuous with |z|^2 @zz at the escape,
+   so bands of equal counts blend into each other. Points of the set keep
+   their count. Shared with the SPU's. */
+static inline float kernel_smooth(const spucommand_t *command, uint32_t count, float zz)
+{
+   float power = command->formula == FORMULA_MULTIBROT ? (float)command->power : 2.0f;
+
+   if (count >= KERNEL_MAX_ITER) return (float)count;
+   return count + 1 - logf(0.5f * logf(zz)) / logf(power);
+}
+
+/* Escape time of a single point with the formula of @command,
+   255 means inside the set. */
+uint32_t kernel_point(const spucommand_t *command, float x0, float y0);
+/* Same with up to @max iterations, and every z on the way stored in
+   @orbit (x, y pairs) unless it is NULL. Returns the escape time, @max
+   means inside the set. */
+uint32_t kernel_orbit(const spucommand_t *command, float x0, float y0, float *orbit, uint32_t max);
+/* Escape counts of @n points anywhere, at x[i], y[i], with the formula
+   of @command, into @count; the smooth counts go to @smooth unless it is
+   NULL. */
+void kernel_points(const spucommand_t *command, const float *x, const float *y, uint32_t n,
+                   uint8_t *count, float *smooth);
+/* Same one point at a time, whatever kernel_isa() is. */
+void kernel_points_scalar(const spucommand_t *command, const float *x, const float *y, uint32_t n,
+                          uint8_t *count, float *smooth);
+/* Calculate a tile described by @command into @out, one byte per pixel,
+   width*height pixels without any stride. The counts are those of the
+   SPU's, one less than kernel_point's: 254 is inside the set. Tiles of
+   KERNEL_PREC_DOUBLE and _EXTENDED take their coordinates from the
+   double fields. */
+void kernel_tile(const spucommand_t *command, uint8_t *out);
+
+/* Bit per KERNEL_ISA_* this CPU and build can run. */
+uint32_t kernel_isa_supported(void);
+/* The instruction set kernel_tile and kernel_points use, the widest one
+   there is unless kernel_isa_select picked another. Every one of them
+   gives the same counts to the bit. */
+int kernel_isa(void);
+/* Use @isa from now on, -1 for the widest. Returns the one in use, which
+   is the old one if @isa is not supported. */
+int kernel_isa_select(int isa);
+const char* kernel_isa_name(int isa);
+/* Copy the formula settings of @from (NULL is the Mandelbrot) into @command. */
+void kernel_formula(spucommand_t *command, const spucommand_t *from);
+/* The double fields of @command, for a first pixel at @x0, @y0 and pixels
+   @xstep, @ystep apart, and the cheapest precision that tells points @step
+   apart with its formula. The size and the formula have to be set. */
+void kernel_place(spucommand_t *command, ddouble_t x0, ddouble_t y0, double xstep, double ystep, double step);
+/* Tile cache key part that tells formulas and their settings apart:
+   the settings themselves, those the formula doesn't use are 0. */
+void kernel_params(kernelparams_t *params, const spucommand_t *command);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __KERNEL_H__ */
@@ -0,0 +1,31 @@
+#ifndef __PALETTE_H__
+#define __PALETTE_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PALETTE_SIZE    (256)
+#define PALETTE_INSIDE  (254)      /* From here on the pixel is in the set */
+
+/* Add the iteration counts of @n pixels (SPU format) to @hist. */
+void palette_count(uint32_t *hist, const uint32_t *pixels, uint32_t n);
+/* The same for @n iteration counts of a tile, a byte each. */
+void palette_count_iter(uint32_t *hist, const uint8_t *iter, uint32_t n);
+/* Add the @count histograms in pairs, then pairs of pairs, and so on.
+   The total ends up in hist[0]. */
+void palette_reduce(uint32_t *const *hist, int count);
+/* Histogram equalisation: every iteration count gets the colour of its
+   place in the cumulative distribution, so the colours spread evenly
+   over the pixels however narrow the band of counts is. */
+void palette_equalise(const uint32_t *hist, uint32_t *palette);
+/* Map @n pixels through the palette, @in and @out may be the same. */
+void palette_apply(const uint32_t *palette, const uint32_t *in, uint32_t *out, uint32_t n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __PALETTE_H__ */
@@ -0,0 +1,55 @@
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PROFILE_TOP     (8)     /* Length of the list of the worst tiles */
+
+#define PROFILE_OUTLINE (0)     /* Only draw the edges of the tiles, never reads the frame */
+#define PROFILE_BLEND   (1)     /* Mix the heat with the pixels */
+
+/* The cost of one tile of a frame. */
+typedef struct
+{
+   uint32_t    x;
+   uint32_t    y;
+   uint32_t    w;
+   uint32_t    h;
+   uint32_t    ticks;         /* Time, in whatever unit the worker counts */
+   uint32_t    iterations;    /* Sum of the iteration counts of its pixels */
+} profiletile_t;
+
+typedef struct
+{
+   profiletile_t  *tile;
+   uint32_t        count;
+   uint32_t        max;
+   uint64_t        ticks;         /* Of the whole frame */
+   uint64_t        iterations;
+   uint32_t        worst;         /* Most ticks of a single tile */
+} profile_t;
+
+/* Room for @max tiles a frame. Returns 0 on success. */
+int profile_init(profile_t *profile, uint32_t max);
+void profile_free(profile_t *profile);
+/* Start a new frame. */
+void profile_reset(profile_t *profile);
+void profile_add(profile_t *profile, uint32_t x, uint32_t y, uint32_t w, uint32_t h,
+                 uint32_t ticks, uint32_t iterations);
+/* The @n most expensive tiles, most expensive first. Returns how many
+   there were. */
+uint32_t profile_top(const profile_t *profile, profiletile_t *top, uint32_t n);
+/* Colour of a cost, black through red and yellow to white at @max. */
+uint32_t profile_heat(uint32_t ticks, uint32_t max);
+/* Draw the heat of every tile over the frame, PROFILE_OUTLINE or PROFILE_BLEND. */
+void profile_heatmap(const profile_t *profile, uint32_t *pixels, uint32_t width, uint32_t height, int mode);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __PROFILE_H__ */
@@ -0,0 +1,84 @@
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define REPLAY_MAGIC    (0x52504c59)   /* "RPLY" */
+#define REPLAY_VERSION  (3)            /* 1 had the view in floats, 2 in doubles */
+#define REPLAY_FRAME    (80)           /* Bytes per frame in the file */
+#define REPLAY_FRAME_V2 (48)
+#define REPLAY_FRAME_V1 (32)
+
+#define REPLAY_MODE_CACHED     (1)
+#define REPLAY_MODE_DE         (2)
+#define REPLAY_MODE_AA         (4)
+#define REPLAY_MODE_HISTOGRAM  (8)
+#define REPLAY_MODE_PROFILE    (16)
+
+/* One frame of a recording: the pad as it was read, and the view and
+   formula the frame was rendered with, before the pad moved them. */
+typedef struct
+{
+   uint8_t     lh;         /* ANA_L_H, ANA_L_V, ANA_R_V */
+   uint8_t     lv;
+   uint8_t     rv;
+   uint8_t     formula;
+   uint16_t    buttons;    /* Bit per button that is down, PadClass::Button order */
+   uint8_t     power;
+   uint8_t     mode;       /* REPLAY_MODE_* */
+   float       cre;
+   float       cim;
+   double      x1;         /* The view in double-doubles, a deep one needs them */
+   double      x2;
+   double      y1;
+   double      y2;
+   double      x1lo;       /* What the corners have past a double, 0 before version 3 */
+   double      x2lo;
+   double      y1lo;
+   double      y2lo;
+} replayframe_t;
+
+typedef struct
+{
+   FILE       *f;
+   uint32_t    frames;
+   uint32_t    version;
+   int         writing;
+} replay_t;
+
+/* Per frame times in us, summed up. */
+typedef struct
+{
+   uint32_t    frames;
+   uint64_t    total;
+   uint32_t    mean;
+   uint32_t    median;
+   uint32_t    p95;
+   uint32_t    max;
+} replaysummary_t;
+
+/* Start a recording in @path. Returns 0 on success. */
+int replay_create(replay_t *replay, const char *path);
+/* Add a frame to the recording. */
+int replay_write(replay_t *replay, const replayframe_t *frame);
+/* Open a recording to play it back, of this version or an older one.
+   Returns 0 on success. */
+int replay_open(replay_t *replay, const char *path);
+/* The next frame of the recording, returns 0 at the end. */
+int replay_read(replay_t *replay, replayframe_t *frame);
+/* Finish the recording (the frame count goes in the header) or the playback. */
+int replay_close(replay_t *replay);
+
+/* Sum up @n frame times, @us gets sorted. */
+void replay_summary(uint32_t *us, uint32_t n, replaysummary_t *summary);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __REPLAY_H__ */
@@ -0,0 +1,77 @@
+#ifndef __SHMFRAME_H__
+#define __SHMFRAME_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SHMFRAME_MAGIC     (0x46524d45)   /* "FRME" */
+#define SHMFRAME_VERSION   (1)
+#define SHMFRAME_ALIGN     (4096)         /* Every slot starts on a page */
+#define SHMFRAME_MAX_SLOTS (16)
+
+/* Per slot sequence: odd while the producer writes it, 2*frame+2 when
+   frame @frame (counted from 0) is complete in it. */
+typedef struct
+{
+   uint64_t    seq;
+   uint64_t    dummy[7];      /* A cache line per slot */
+} shmframe_slot_t;
+
+typedef struct
+{
+   uint32_t          magic;
+   uint32_t          version;
+   uint32_t          slots;
+   uint32_t          width;
+   uint32_t          height;
+   uint32_t          stride;     /* Pixels per line */
+   uint32_t          slotbytes;  /* Distance between slots, page aligned */
+   uint32_t          dummy;
+   uint64_t          frames;     /* Frames published so far */
+   uint64_t          dummy2[3];
+   shmframe_slot_t   slot[SHMFRAME_MAX_SLOTS];
+} shmframe_header_t;
+
+typedef struct
+{
+   uint8_t             *base;
+   size_t               size;
+   char                 name[64];
+   int                  owner;      /* The producer removes the ring at close */
+   shmframe_header_t   *header;
+   uint32_t             current;    /* Slot the producer is writing */
+} shmframe_t;
+
+/* Producer: create the ring @name (a POSIX shared memory name, "/name")
+   with @slots frames of width x height pixels (0x00RRGGBB, the SPU's
+   format). Returns 0 on success. */
+int shmframe_create(shmframe_t *ring, const char *name, uint32_t width, uint32_t height, uint32_t slots);
+/* Producer: the pixels of the next frame to render into. The slot of the
+   oldest frame is taken, whoever is still reading it; readers find out
+   with shmframe_valid. Never waits. */
+uint32_t* shmframe_begin(shmframe_t *ring);
+/* Producer: the frame of the last shmframe_begin is complete. */
+void shmframe_publish(shmframe_t *ring);
+
+/* Consumer: map the ring @name read only. Returns 0 on success. */
+int shmframe_open(shmframe_t *ring, const char *name);
+/* Consumer: the newest complete frame, or NULL when nothing was published
+   since the last look. @seen is the number of frames published then (0 the
+   first time), and is updated; the frame returned is number *@seen - 1. */
+const uint32_t* shmframe_latest(shmframe_t *ring, uint64_t *seen);
+/* Consumer: true when frame @frame has not been overwritten, check it
+   after using the pixels. */
+int shmframe_valid(shmframe_t *ring, uint64_t frame);
+
+/* Unmap, and remove the ring when it was created here. */
+void shmframe_close(shmframe_t *ring);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SHMFRAME_H__ */
@@ -1,16 +1,48 @@
+#ifndef __SPUSTR_H__
+#define __SPUSTR_H__
+
 #define CMD_QUIT (1)
 #define CMD_CALC (2)
+#define CMD_CALC_DE (3)   /* Distance estimate of a tile of at most DE_TILE x DE_TILE */
+
+#define CMD_HISTOGRAM (4)  /* Write the histogram to dest_ea and start a new one */
+#define CMD_CALC_AA (5)   /* Tile of at most DE_TILE x DE_TILE, supersampled on the edges */
+#define CMD_ACCUMULATE (6)   /* Tile of at most DE_TILE x DE_TILE, added to accum_ea, the average goes to dest_ea */
+#define CMD_PREVIEW (7)   /* Tile of at most DE_TILE x DE_TILE, one sample per PREVIEW_BLOCK x PREVIEW_BLOCK pixels */
+#define CMD_POINTS (8)   /* width points from x_ea and y_ea, escape counts to dest_ea, 1 byte each */
+#define CMD_COPY (9)   /* Tile of at most DE_TILE x DE_TILE calculated before, from src_ea to dest_ea */
+
+#define SPU_EVENT_PORT  (1)   /* Port the SPU's report an empty command ring on */
+
+#define DE_TILE  (64)
+#define AA_MAX_SAMPLES  (4)   /* Samples per row and column of an edge pixel */
+#define ACCUM_PASSES    (64)  /* Passes an accumulation buffer can hold, 64 x 255 fits in 16 bits */
+#define PREVIEW_BLOCK   (4)   /* Pixels per row and column that share a sample in CMD_PREVIEW */
+#define POINTS_CHUNK    (1024) /* Points per CMD_POINTS at most, a multiple of 16 for the DMA */
+
+#define CMDF_HISTOGRAM  (1)   /* Count the iterations of the pixels */
+#define CMDF_PROFILE    (2)   /* Add up the iterations for the spucost_t */
+#define CMDF_UNROLL     (4)   /* Kernel that does two vectors of pixels side by side */
+
+#define FORMULA_MANDEL        (0)   /* z^2 + c */
+#define FORMULA_JULIA         (1)   /* z^2 + k, k = (cre, cim), z starts at the pixel */
+#define FORMULA_MULTIBROT     (2)   /* z^power + c */
+#define FORMULA_BURNINGSHIP   (3)   /* (|x| + i|y|)^2 + c */
+#define FORMULA_TRICORN       (4)   /* conj(z)^2 + c */
+#define FORMULA_COUNT         (5)
+#define FORMULA_POWER_MIN     (2)   /* Multibrot exponents the pad goes through */
+#define FORMULA_POWER_MAX     (8)
+
+#define SPU_RING (256)    /* Commands that can wait for one SPU, a power of 2 */
 
 typedef struct
 {
    uint32_t id;         /* spu thread id */
    uint32_t rank;       /* rank in SPU thread group (0..count-1) */
    uint32_t count;      /* number of threads in group */
-   uint32_t sync;       /* sync value for response */
-   uint32_t response;   /* response value */
    uint32_t array_ea;   /* effective address of data array */
-   uint32_t command_ea; /* effective address of command */
-   uint32_t dummy[1];   /* unused data for 16-byte multible size */
+   uint32_t ring_ea;    /* effective address of the spuring_t of this SPU */
+   uint32_t dummy[3];   /* unused data for 16-byte multible size */
 } spustr_t;
 
 
@@ -22,5 +54,57 @@ typedef struct
    float    end;        /* Value at end */
    float    yvalue;     /* Value to use for Y */
    uint32_t dest_ea;    /* destination in framebuffer */
-   uint32_t dummy[2];
+   uint32_t height;     /* Number of lines in this tile */
+   float    ystep;      /* Y increment per line */
+   uint32_t stride;     /* Framebuffer line length in pixels */
+   uint32_t formula;    /* One of FORMULA_* */
+   uint32_t power;      /* Exponent for the Multibrot */
+   float    cre;        /* Constant for the Julia set */
+   float    cim;
+   uint32_t palette_ea; /* 256 colours to map the iterations with, 0 for grey */
+   uint32_t flags;      /* CMDF_* */
+   uint32_t samples;    /* CMD_CALC_AA: n x n samples for an edge pixel */
+   uint32_t threshold;  /* CMD_CALC_AA: iteration difference that makes an edge */
+   uint32_t cost_ea;    /* Where the spucost_t of the command goes (8 byte aligned), or 0 */
+   uint32_t accum_ea;   /* CMD_ACCUMULATE: sums of r, g, b and a spare, uint16_t each, per
+                           pixel; lines of stride pixels like the framebuffer */
+   uint32_t pass;       /* CMD_ACCUMULATE: passes in accum_ea already, 0 starts it over */
+   uint32_t x_ea;       /* CMD_POINTS: x of the points, floats */
+   uint32_t y_ea;       /* CMD_POINTS: y of the points, floats */
+   uint32_t smooth_ea;  /* CMD_POINTS: smooth escape counts, floats, or 0 */
+   uint32_t src_ea;     /* CMD_COPY: the tile to copy, lines of stride pixels */
+   uint32_t precision;  /* KERNEL_PREC_*, what the pixel spacing needs at these coordinates */
+   uint32_t pad[3];     /* The doubles on a 16 byte boundary */
+   double   dstart[2];  /* KERNEL_PREC_DOUBLE and _EXTENDED: start, as high and low part */
+   double   dyvalue[2]; /* yvalue the same way */
+   double   dxstep;     /* Pixel spacing in x and y */
+   double   dystep;
 } spucommand_t;
+
+/* What a command cost, written to cost_ea when it is done. */
+typedef struct
+{
+   uint32_t ticks;      /* Decrementer ticks */
+   uint32_t iterations; /* Sum of the iteration counts, with CMDF_PROFILE */
+} spucost_t;
+
+/* The commands for one SPU. Only the PPU writes head and the commands,
+   only the SPU writes the status line, so there are no locks. Both counters
+   run from the start and wrap at 2^32, command n is in command[n % SPU_RING].
+   The SPU is signalled when it may have gone to sleep on an empty ring, and
+   sends an event on SPU_EVENT_PORT every time it finds its ring empty, or
+   its tail at wake. */
+typedef struct
+{
+   uint32_t head;       /* Commands queued by the PPU */
+   uint32_t wake;       /* Tail the PPU waits for, written by the PPU */
+   uint32_t pad0[30];   /* head and the status each have their own 128 byte line */
+   uint32_t tail;       /* Commands finished by the SPU */
+   uint32_t ticks;      /* Decrementer ticks spent on them, in total */
+   uint32_t skipped;    /* Pixels filled without calculating them (CMD_CALC_DE),
+                           or supersampled (CMD_CALC_AA), in total */
+   uint32_t pad1[29];
+   spucommand_t command[SPU_RING];
+} spuring_t;
+
+#endif /* __SPUSTR_H__ */
@@ -0,0 +1,112 @@
+#ifndef __TILECACHE_H__
+#define __TILECACHE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "spustr.h"
+#include "kernel.h"
+#include "arena.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TILECACHE_MAGIC     (0x54494c45)   /* "TILE" */
+#define TILECACHE_VERSION   (4)            /* 2: settings in the key, 3: deep levels in double, 4: SPU counts */
+#define TILECACHE_TILE      (64)           /* Tiles are 64x64 iteration counts */
+#define TILECACHE_BYTES     (TILECACHE_TILE*TILECACHE_TILE)
+#define TILECACHE_ROOT_X    (-2.5)         /* Level 0 is one tile covering this square */
+#define TILECACHE_ROOT_Y    (-2.0)
+#define TILECACHE_ROOT_SIZE (4.0)
+#define TILECACHE_MAX_LEVEL (20)           /* After this a float can't tell pixels apart */
+#define TILECACHE_SCRATCH   (2*1024*1024)  /* Per frame lists of tilecache_render, it grows if needed */
+
+/* A tile of the quadtree. Level n has 2^n x 2^n tiles in the root square,
+   @params tells apart tiles calculated with different kernel settings. */
+typedef struct
+{
+   int32_t        level;
+   int32_t        tx;
+   int32_t        ty;
+   kernelparams_t params;
+} tilekey_t;
+
+/* One entry per slot in the index of the file. */
+typedef struct
+{
+   tilekey_t   key;
+   uint32_t    used;       /* LRU clock value of the last use */
+   uint32_t    valid;
+} tilecache_entry_t;
+
+typedef struct
+{
+   uint32_t magic;
+   uint32_t version;
+   uint32_t slots;
+   uint32_t tilebytes;
+   uint32_t clock;
+   uint32_t dummy[3];
+} tilecache_header_t;
+
+typedef struct
+{
+   uint8_t             *base;       /* The whole store, mapped or loaded */
+   size_t               size;
+   int                  fd;
+   char                 path[256];
+   tilecache_header_t  *header;
+   tilecache_entry_t   *entry;
+   uint8_t             *data;
+
+   int32_t             *hash;       /* key -> slot, linear probing, -1 is empty */
+   uint32_t             hashmask;
+   int32_t             *prev;       /* LRU list of slots, head is the most recent */
+   int32_t             *next;
+   int32_t              head;
+   int32_t              tail;
+
+   uint32_t             hits;
+   uint32_t             misses;
+   uint32_t             evictions;
+
+   arena_t              arena;      /* The lists of a frame; on the PS3 the store as well */
+} tilecache_t;
+
+/* Fills in the commands for the missing tiles, and the slots the results
+   go to. Returns 0 if all tiles were calculated. */
+typedef int (*tilecache_compute_t)(void *ctx, const spucommand_t *commands,
+                                   uint8_t *const *out, uint32_t count);
+
+/* Open (or create) the store in @path with room for @slots tiles.
+   Returns 0 on success. */
+int tilecache_open(tilecache_t *cache, const char *path, uint32_t slots);
+/* Write everything back and release the store. */
+void tilecache_close(tilecache_t *cache);
+/* Returns the iteration counts of the tile, or NULL when it's not there. */
+const uint8_t* tilecache_find(tilecache_t *cache, const tilekey_t *key);
+/* Make room for the tile (the least recently used one goes) and return
+   where its iteration counts have to be written. */
+uint8_t* tilecache_insert(tilecache_t *cache, const tilekey_t *key);
+/* Forget a tile, for results that never arrived. */
+void tilecache_drop(tilecache_t *cache, const tilekey_t *key);
+
+/* Command that calculates the tile with the formula of @formula (NULL is
+   the Mandelbrot), in the precision its level needs. The result has no
+   stride. */
+void tilecache_command(spucommand_t *command, const spucommand_t *formula, const tilekey_t *key);
+/* Render the area from cached tiles, @compute is called for the missing
+   ones, with the formula of @formula (NULL is the Mandelbrot). Pixels end
+   up in the same format as the SPU's. Returns the number of tiles that
+   had to be calculated, or -1 on failure. */
+int tilecache_render(tilecache_t *cache, const spucommand_t *formula, uint32_t *dest,
+                     uint32_t width, uint32_t height,
+                     double x1, double x2, double y1, double y2,
+                     tilecache_compute_t compute, void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __TILECACHE_H__ */
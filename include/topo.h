@@ -0,0 +1,60 @@
+#ifndef __TOPO_H__
+#define __TOPO_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TOPO_MAX_CPUS   (256)
+#define TOPO_MAX_NODES  (8)
+
+#define TOPO_NONE       (0)   /* Leave the workers to the scheduler */
+#define TOPO_COMPACT    (1)   /* Fill a node before the next one, SMT siblings next to each other */
+#define TOPO_SPREAD     (2)   /* A core of every node in turn, SMT siblings last */
+#define TOPO_POLICIES   (3)
+
+/* Where a CPU sits. */
+typedef struct
+{
+   int         cpu;
+   int         core;       /* core_id, within the package */
+   int         package;
+   int         node;       /* NUMA node, counted from 0 over the nodes there are */
+   int         smt;        /* 0 for the first thread of its core, 1 for its sibling.. */
+} topocpu_t;
+
+/* The CPUs this process may run on. On the PS3 the SPU's each have a
+   local store and placement doesn't matter, this is for Linux hosts. */
+typedef struct
+{
+   topocpu_t   cpu[TOPO_MAX_CPUS];
+   uint32_t    cpus;
+   uint32_t    cores;      /* Physical ones */
+   uint32_t    nodes;
+   uint32_t    packages;
+} topo_t;
+
+#ifndef __PPU__
+/* Read the topology from sysfs. Without it every CPU is a core of its
+   own on node 0. Returns 0 on success. */
+int topo_read(topo_t *topo);
+/* The CPU of each of @count workers in the order of @policy, -1 for
+   TOPO_NONE. Workers 0..n-1 are the best placement of n for every n,
+   with more workers than CPUs it starts over. */
+void topo_place(const topo_t *topo, int policy, uint32_t count, int *cpus);
+/* Node of @cpu, 0 when it is not known. */
+int topo_node(const topo_t *topo, int cpu);
+/* Keep process @pid (0 is this one) on @cpu, -1 is anywhere. Pin before
+   the buffers are first written, the pages come from the node that
+   touches them first. Returns 0 on success. */
+int topo_pin(int pid, int cpu);
+const char* topo_policy_name(int policy);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __TOPO_H__ */
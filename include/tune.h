@@ -0,0 +1,42 @@
+#ifndef __TUNE_H__
+#define __TUNE_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TUNE_MAGIC     "mandelbrot-tune 1"   /* First line of a profile file */
+#define TUNE_MAX_ROWS  (8)
+
+/* How the frames are cut up and calculated. What is fastest differs per
+   machine, so it is measured and kept in a profile file. */
+typedef struct
+{
+   uint32_t    spus;       /* Workers the frames are spread over */
+   uint32_t    rows;       /* Lines per command of the plain renderer, 1..TUNE_MAX_ROWS */
+   uint32_t    unroll;     /* Vectors of pixels the kernel calculates side by side, 1 or 2 */
+} tune_t;
+
+/* Time of a frame, or a few, with configuration @tune. Any unit, as long
+   as it is the same for every call. */
+typedef uint64_t (*tune_measure_t)(void *ctx, const tune_t *tune);
+
+/* What was compiled in before there was tuning: all @spus, a line per
+   command, a vector at a time. */
+void tune_default(tune_t *tune, uint32_t spus);
+/* Read the profile file @path. Returns 0 on success; @tune is left alone
+   when the file is missing or not valid for at most @maxspus workers. */
+int tune_load(tune_t *tune, const char *path, uint32_t maxspus);
+int tune_save(const tune_t *tune, const char *path);
+/* Find the fastest configuration, one setting at a time: every candidate
+   of a setting is measured with the others as they are and the best one
+   is kept, then on to the next. @tune is the start, and gets the result. */
+void tune_search(tune_t *tune, uint32_t maxspus, tune_measure_t measure, void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __TUNE_H__ */
@@ -0,0 +1,287 @@
+/*
+ * Arena allocator in huge pages. Big frame, iteration and tile buffers
+ * spread over many small pages cost a TLB miss every few kilobytes, and a
+ * malloc of a frame sized buffer is a fresh mmap with a page fault on
+ * every page. An arena is mapped once, in pages of a megabyte or more,
+ * and buffers are carved from it without asking the system again.
+ */
+
+#ifndef __PPU__
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include "arena.h"
+
+#ifdef __PPU__
+#include <sys/memory.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+// -----------------------------------------------------------------------
+static size_t round_up(size_t n, size_t to)
+{
+   return (n + to - 1) & ~(to - 1);
+}
+
+// -----------------------------------------------------------------------
+// Map a region of at least @size bytes, in huge pages if at all possible.
+static int region_map(arenaregion_t *r, size_t size)
+{
+   memset(r, 0, sizeof(arenaregion_t));
+
+#ifdef __PPU__
+   sys_mem_addr_t addr;
+
+   size = round_up(size, ARENA_HUGE_PAGE);
+   if (sysMemAllocate(size, SYS_MEMORY_PAGE_SIZE_1M, &addr) == 0)
+   {
+      r->huge = 1;
+   }
+   else if (sysMemAllocate(size, SYS_MEMORY_PAGE_SIZE_64K, &addr) != 0)
+   {
+      return -1;
+   }
+   r->base = (uint8_t*)(uintptr_t)addr;
+#else
+   uint8_t *p;
+
+   size = round_up(size, ARENA_HUGE_PAGE);
+   p = (uint8_t*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+   if (p != MAP_FAILED)
+   {
+      r->huge = 1;
+   }
+   else
+   {
+      // No hugetlbfs pages set aside: map a huge page more than needed,
+      // keep the part that starts on a huge page boundary, and ask for
+      // transparent huge pages there.
+      uint8_t *raw = (uint8_t*)mmap(NULL, size + ARENA_HUGE_PAGE, PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      size_t   lead;
+
+      if (raw == MAP_FAILED) return -1;
+
+      p = (uint8_t*)round_up((size_t)raw, ARENA_HUGE_PAGE);
+      lead = p - raw;
+      if (lead > 0) munmap(raw, lead);
+      munmap(p + size, ARENA_HUGE_PAGE - lead);
+
+      (void)madvise(p, size, MADV_HUGEPAGE);
+   }
+   r->base = p;
+#endif
+
+   r->size = size;
+   return 0;
+}
+
+// -----------------------------------------------------------------------
+static void region_unmap(arenaregion_t *r)
+{
+#ifdef __PPU__
+   sysMemFree((sys_mem_addr_t)(uintptr_t)r->base);
+#else
+   munmap(r->base, r->size);
+#endif
+   r->base = NULL;
+}
+
+// -----------------------------------------------------------------------
+int arena_create(arena_t *arena, size_t chunk)
+{
+   memset(arena, 0, sizeof(arena_t));
+   arena->chunk = round_up(chunk, ARENA_HUGE_PAGE);
+
+   if (region_map(&arena->region[0], arena->chunk) < 0) return -1;
+
+   arena->regions = 1;
+   return 0;
+}
+
+// -----------------------------------------------------------------------
+// From the current region, or the first one after it with room; a new
+// region when none has.
+void* arena_alloc(arena_t *arena, size_t bytes, size_t align)
+{
+   uint32_t i;
+
+   if (align == 0) align = ARENA_ALIGN;
+
+   for (i=arena->current; i<arena->regions; i++)
+   {
+      arenaregion_t *r = &arena->region[i];
+      size_t         at = round_up(r->used, align);
+
+      if (at + bytes <= r->size)
+      {
+         size_t in_use = 0;
+         uint32_t j;
+
+         r->used = at + bytes;
+         arena->current = i;
+         arena->allocs++;
+
+         for (j=0; j<=i; j++) in_use += arena->region[j].used;
+         if (in_use > arena->peak) arena->peak = in_use;
+
+         return r->base + at;
+      }
+   }
+
+   if (arena->regions == ARENA_MAX_REGIONS) return NULL;
+
+   i = arena->regions;
+   if (region_map(&arena->region[i], bytes > arena->chunk ? bytes : arena->chunk) < 0) return NULL;
+   arena->regions++;
+
+   return arena_alloc(arena, bytes, align);
+}
+
+// -----------------------------------------------------------------------
+arenamark_t arena_mark(const arena_t *arena)
+{
+   arenamark_t mark;
+
+   mark.region = arena->current;
+   mark.used = arena->region[arena->current].used;
+   return mark;
+}
+
+// -----------------------------------------------------------------------
+// The regions stay mapped, the next frame uses them again.
+void arena_reset(arena_t *arena, arenamark_t mark)
+{
+   uint32_t i;
+
+   for (i=mark.region + 1; i<arena->regions; i++)
+   {
+      arena->region[i].used = 0;
+   }
+   arena->region[mark.region].used = mark.used;
+   arena->current = mark.region;
+   arena->resets++;
+}
+
+// -----------------------------------------------------------------------
+void arena_destroy(arena_t *arena)
+{
+   uint32_t i;
+
+   for (i=0; i<arena->regions; i++)
+   {
+      region_unmap(&arena->region[i]);
+   }
+   memset(arena, 0, sizeof(arena_t));
+}
+
+#ifndef __PPU__
+// -----------------------------------------------------------------------
+// The huge page part of every mapping in /proc/self/smaps that overlaps
+// one of the regions.
+static size_t smaps_huge(const arena_t *arena)
+{
+   FILE          *f = fopen("/proc/self/smaps", "r");
+   char           line[256];
+   unsigned long  start, end;
+   int            inside = 0;
+   size_t         huge = 0;
+
+   if (f == NULL) return 0;
+
+   while (fgets(line, sizeof(line), f) != NULL)
+   {
+      unsigned long kb;
+      uint32_t      i;
+
+      if (sscanf(line, "%lx-%lx ", &start, &end) == 2)
+      {
+         inside = 0;
+         for (i=0; i<arena->regions; i++)
+         {
+            size_t b = (size_t)arena->region[i].base;
+
+            if (start < b + arena->region[i].size && end > b) inside = 1;
+         }
+      }
+      else if (inside && (sscanf(line, "AnonHugePages: %lu kB", &kb) == 1 ||
+                          sscanf(line, "Private_Hugetlb: %lu kB", &kb) == 1 ||
+                          sscanf(line, "Shared_Hugetlb: %lu kB", &kb) == 1))
+      {
+         huge += (size_t)kb * 1024;
+      }
+   }
+
+   fclose(f);
+   return huge;
+}
+#endif
+
+// -----------------------------------------------------------------------
+void arena_stats(const arena_t *arena, arenastats_t *stats)
+{
+   uint32_t i;
+
+   memset(stats, 0, sizeof(arenastats_t));
+
+   for (i=0; i<arena->regions; i++)
+   {
+      const arenaregion_t *r = &arena->region[i];
+
+      stats->reserved += r->size;
+      stats->used += r->used;
+      if (r->huge) stats->hugebytes += r->size;
+   }
+
+#ifndef __PPU__
+   // Transparent huge pages come and go, ask the kernel what is there.
+   stats->hugebytes = smaps_huge(arena);
+#endif
+
+   stats->pages = stats->hugebytes / ARENA_HUGE_PAGE +
+                  (stats->reserved - stats->hugebytes) / ARENA_SMALL_PAGE;
+   stats->peak = arena->peak;
+   stats->regions = arena->regions;
+   stats->allocs = arena->allocs;
+   stats->resets = arena->resets;
+}
+
+#ifndef __PPU__
+// -----------------------------------------------------------------------
+int arena_tlb_open(void)
+{
+   struct perf_event_attr attr;
+
+   memset(&attr, 0, sizeof(attr));
+   attr.size = sizeof(attr);
+   attr.type = PERF_TYPE_HW_CACHE;
+   attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+   attr.exclude_kernel = 1;
+   attr.exclude_hv = 1;
+
+   return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// -----------------------------------------------------------------------
+uint64_t arena_tlb_read(int fd)
+{
+   uint64_t count = 0;
+
+   if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count)) return 0;
+   return count;
+}
+
+// -----------------------------------------------------------------------
+void arena_tlb_close(int fd)
+{
+   if (fd >= 0) close(fd);
+}
+#endif
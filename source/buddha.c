@@ -0,0 +1,212 @@
+/*
+ * Buddhabrot, see buddha.h. The orbits come from the same iteration as
+ * the escape time kernel, kernel_orbit. Every worker draws into an image
+ * of its own, so there are no shared writes while sampling; the images
+ * are added up at the end.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "buddha.h"
+#include "kernel.h"
+
+// -----------------------------------------------------------------------
+// xorshift64*, one per worker.
+static uint32_t buddha_random(uint64_t *state)
+{
+   uint64_t x = *state;
+
+   x ^= x >> 12;
+   x ^= x << 25;
+   x ^= x >> 27;
+   *state = x;
+
+   return (uint32_t)((x * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+// -----------------------------------------------------------------------
+static float buddha_uniform(uint64_t *state)
+{
+   return (buddha_random(state) >> 8) * (1.0f / 16777216.0f);
+}
+
+// -----------------------------------------------------------------------
+// Points in the main cardioid or the bulb left of it never escape.
+static int buddha_inside(const spucommand_t *formula, float x, float y)
+{
+   float q;
+
+   if (formula->formula != FORMULA_MANDEL) return 0;
+
+   q = (x - 0.25f) * (x - 0.25f) + y * y;
+   if (q * (q + (x - 0.25f)) < 0.25f * y * y) return 1;
+
+   return (x + 1) * (x + 1) + y * y < 0.0625f;
+}
+
+// -----------------------------------------------------------------------
+void buddha_plan(buddhaplan_t *plan, const spucommand_t *formula, uint32_t width, uint32_t height,
+                 float x1, float x2, float y1, float y2, uint32_t maxiter, int importance)
+{
+   const float cell = 2 * BUDDHA_SPAN / BUDDHA_GRID;
+   uint32_t    weight[BUDDHA_GRID*BUDDHA_GRID];
+   uint32_t    total = 0;
+   uint32_t    i, j, p, q;
+
+   memset(plan, 0, sizeof(buddhaplan_t));
+   kernel_formula(&plan->formula, formula);
+   plan->width = width;
+   plan->height = height;
+   plan->x1 = x1;
+   plan->x2 = x2;
+   plan->y1 = y1;
+   plan->y2 = y2;
+   plan->maxiter = maxiter;
+
+   // A cell weighs a quarter of all probes, and one more for every probe
+   // that escapes late enough to be seen: no cell is left out, so nothing
+   // is missing, and the orbits of the unlikely ones don't weigh so much
+   // that they show as noise.
+   for (j=0; j<BUDDHA_GRID; j++)
+   {
+      for (i=0; i<BUDDHA_GRID; i++)
+      {
+         uint32_t w = BUDDHA_PROBES * BUDDHA_PROBES / 4;
+
+         for (q=0; q<BUDDHA_PROBES && importance; q++)
+         {
+            for (p=0; p<BUDDHA_PROBES; p++)
+            {
+               float    x = -BUDDHA_SPAN + cell * (i + (p + 0.5f) / BUDDHA_PROBES);
+               float    y = -BUDDHA_SPAN + cell * (j + (q + 0.5f) / BUDDHA_PROBES);
+               uint32_t n;
+
+               if (buddha_inside(&plan->formula, x, y)) continue;
+
+               n = kernel_orbit(&plan->formula, x, y, NULL, maxiter);
+               if (n >= BUDDHA_MIN_ITER && n < maxiter) w++;
+            }
+         }
+
+         weight[j * BUDDHA_GRID + i] = w;
+         total += w;
+         plan->cdf[j * BUDDHA_GRID + i] = total;
+      }
+   }
+
+   // The cells are picked in proportion to their weight, so an orbit
+   // counts for the average weight over its own.
+   for (i=0; i<BUDDHA_GRID*BUDDHA_GRID; i++)
+   {
+      plan->inc[i] = (uint32_t)(((uint64_t)total * BUDDHA_ONE) / ((uint64_t)weight[i] * BUDDHA_GRID * BUDDHA_GRID));
+   }
+}
+
+// -----------------------------------------------------------------------
+int buddha_init(buddhabuf_t *buf, const buddhaplan_t *plan, uint32_t *density, uint64_t seed)
+{
+   memset(buf, 0, sizeof(buddhabuf_t));
+
+   buf->orbit = (float*)malloc(plan->maxiter * 2 * sizeof(float));
+   if (buf->orbit == NULL) return -1;
+
+   buf->density = density;
+   memset(density, 0, (size_t)plan->width * plan->height * sizeof(uint32_t));
+
+   // Never zero, or xorshift stays there.
+   buf->rng = (seed + 1) * 0x9e3779b97f4a7c15ULL;
+   if (buf->rng == 0) buf->rng = 1;
+
+   return 0;
+}
+
+// -----------------------------------------------------------------------
+void buddha_free(buddhabuf_t *buf)
+{
+   free(buf->orbit);
+   buf->orbit = NULL;
+}
+
+// -----------------------------------------------------------------------
+void buddha_sample(const buddhaplan_t *plan, buddhabuf_t *buf, uint32_t n)
+{
+   const float    cell = 2 * BUDDHA_SPAN / BUDDHA_GRID;
+   const uint32_t total = plan->cdf[BUDDHA_GRID*BUDDHA_GRID - 1];
+   const float    sx = plan->width / (plan->x2 - plan->x1);
+   const float    sy = plan->height / (plan->y2 - plan->y1);
+   uint32_t       s, k;
+
+   for (s=0; s<n; s++)
+   {
+      uint32_t r = buddha_random(&buf->rng) % total;
+      uint32_t lo = 0, hi = BUDDHA_GRID*BUDDHA_GRID - 1;
+
+      // First cell whose sum is past r.
+      while (lo < hi)
+      {
+         uint32_t mid = (lo + hi) / 2;
+         if (plan->cdf[mid] > r) hi = mid;
+         else lo = mid + 1;
+      }
+
+      float    x = -BUDDHA_SPAN + cell * ((lo % BUDDHA_GRID) + buddha_uniform(&buf->rng));
+      float    y = -BUDDHA_SPAN + cell * ((lo / BUDDHA_GRID) + buddha_uniform(&buf->rng));
+      uint32_t inc = plan->inc[lo];
+
+      buf->samples++;
+      if (buddha_inside(&plan->formula, x, y)) continue;
+
+      uint32_t iterations = kernel_orbit(&plan->formula, x, y, buf->orbit, plan->maxiter);
+      if (iterations >= plan->maxiter) continue;
+
+      buf->orbits++;
+
+      // The last point is the one that escaped.
+      for (k=0; k+1<iterations; k++)
+      {
+         float px = (buf->orbit[2*k] - plan->x1) * sx;
+         float py = (buf->orbit[2*k+1] - plan->y1) * sy;
+
+         if (px < 0 || py < 0 || px >= plan->width || py >= plan->height) continue;
+
+         buf->density[(uint32_t)py * plan->width + (uint32_t)px] += inc;
+         buf->splats++;
+      }
+   }
+}
+
+// -----------------------------------------------------------------------
+void buddha_merge(uint32_t *dest, uint32_t *const *density, int count, uint32_t first, uint32_t n)
+{
+   uint32_t i;
+   int      w;
+
+   memcpy(&dest[first], &density[0][first], n * sizeof(uint32_t));
+
+   for (w=1; w<count; w++)
+   {
+      const uint32_t *src = &density[w][first];
+
+      for (i=0; i<n; i++) dest[first + i] += src[i];
+   }
+}
+
+// -----------------------------------------------------------------------
+void buddha_image(const uint32_t *density, uint32_t *pixels, uint32_t n)
+{
+   uint32_t peak = 0;
+   uint32_t i;
+
+   for (i=0; i<n; i++)
+   {
+      if (density[i] > peak) peak = density[i];
+   }
+
+   for (i=0; i<n; i++)
+   {
+      uint32_t v = peak ? (uint32_t)(255.0f * sqrtf((float)density[i] / peak)) : 0;
+      pixels[i] = (v << 16) | (v << 8) | v;
+   }
+}
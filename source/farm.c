@@ -0,0 +1,2515 @@
+/*
+ * Render farm: a coordinator hands out tiles (a spucommand_t each) to
+ * workers on other machines over TCP, and gets the iteration counts back as
+ * iterfile tiles. The same file builds on the PS3 and on a Linux host, where
+ * it is also a stand alone tool:
+ *
+ *   cc -O2 -std=gnu99 -Iinclude -DFARM_MAIN source/farm.c source/kernel.c \
+ *      source/kernel_x86.c source/tilecache.c source/palette.c source/shmframe.c \
+ *      source/replay.c source/profile.c source/arena.c source/farmsched.c \
+ *      source/buddha.c source/iterfile.c source/topo.c -o farm -lm
+ *
+ *   ./farm worker [port [cpu]]
+ *   ./farm render <width> <height> <x1> <x2> <y1> <y2> <out.ppm> <host[:port]>...
+ *   ./farm cached <cache> <width> <height> <x1> <x2> <y1> <y2> <out.ppm> [host[:port]]...
+ *   ./farm loopback <workers> [frames] [none|compact|spread]
+ *   ./farm sessions <workers> [frames]
+ *   ./farm bench [frames]
+ *   ./farm histogram <workers> [frames]
+ *   ./farm stream <name> <width> <height> <frames> [host[:port]]...
+ *   ./farm view <name> [seconds] [out.ppm]
+ *   ./farm replay <recording> [width height] [host[:port]]...
+ *   ./farm path <recording> [frames]
+ *   ./farm profile <width> <height> <x1> <x2> <y1> <y2> <heat.ppm>
+ *   ./farm arena [width height [frames]]
+ *   ./farm buddha <width> <height> <workers> <Msamples> <out.ppm>
+ *   ./farm iterfile <width> <height> <workers> [frames] [out.itf]
+ *
+ * "loopback" starts the workers as local processes, measures how the frame
+ * time scales with every added worker, unpinned and pinned compact or
+ * spread over the cores and nodes, and kills one of them to check the
+ * tiles are handed out again. "sessions" puts two small views and a deep
+ * zoom on the same local workers, first in the order the frames come in,
+ * then with fair shares, and prints how late the small ones are. "cached"
+ * renders through the tile cache, tiles that are not in it go to the
+ * workers, or are calculated here without any.
+ * "bench" prints the pixel rate of every formula of the local kernel, the
+ * rate of every instruction set it can use here (and whether their counts
+ * are those of the scalar one, and a tile's those of the SPU's) and the
+ * same pixels as loose points.
+ * "histogram" renders 1080p frames on local workers, grey and with
+ * histogram colouring, and prints what the colouring adds. "stream" renders a zoom
+ * straight into a ring of frames in shared memory (/dev/shm/<name>), and
+ * "view" is an example consumer of it that doesn't copy the frames.
+ * "replay" renders the views of a pad recording made on the PS3 (L3) as
+ * fast as it can and prints the time of every frame; "path" writes a
+ * recording of a fixed zoom, for when there is no PS3 at hand. "profile"
+ * times every tile of a frame, writes the frame with the heat mixed in and
+ * prints the most expensive tiles. "arena" compares frame buffers from
+ * malloc with buffers from a huge page arena. "buddha" renders a
+ * Buddhabrot on local processes and prints how the samples per second
+ * scale, with importance sampling and without. "iterfile" codes a zoom
+ * as iterfile images on local processes, prints the size and the frame
+ * rates of encoding and decoding, and writes the last frame.
+ */
+
+#ifndef __PPU__
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "farm.h"
+#include "kernel.h"
+#include "iterfile.h"
+#include "palette.h"
+
+#ifdef __PPU__
+#include <net/net.h>
+#include <net/poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/systime.h>
+
+#define FARM_SEND_FLAGS    (0)
+#else
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define netInitialize()    ((void)0)
+#define netSocket          socket
+#define netConnect         connect
+#define netBind            bind
+#define netListen          listen
+#define netAccept          accept
+#define netSend            send
+#define netRecv            recv
+#define netClose           close
+#define netPoll            poll
+#define netSetSockOpt      setsockopt
+
+#define FARM_SEND_FLAGS    (MSG_NOSIGNAL)
+#endif
+
+#define FARM_POLL_MS       (100)
+#define FARM_TILE_PIXELS   (FARM_TILE_SIZE*FARM_TILE_SIZE)
+#define FARM_RESULT_MAX    (ITERFILE_TILE_MAX)
+
+#define TILE_PENDING       (0)
+#define TILE_BUSY          (1)
+#define TILE_DONE          (2)
+
+typedef struct
+{
+   uint8_t     state;
+   uint8_t     worker;
+   uint64_t    sent;       /* time it was handed out, in us */
+} farmtile_t;
+
+// -----------------------------------------------------------------------
+static uint64_t farm_now_us(void)
+{
+#ifdef __PPU__
+   return sysGetSystemTime();
+#else
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+// -----------------------------------------------------------------------
+static uint64_t farm_now_ms(void)
+{
+   return farm_now_us() / 1000;
+}
+
+// -----------------------------------------------------------------------
+static int send_all(int fd, const void *buf, uint32_t len)
+{
+   const uint8_t *p = (const uint8_t*)buf;
+
+   while (len > 0)
+   {
+      int r = netSend(fd, p, len, FARM_SEND_FLAGS);
+      if (r <= 0) return -1;
+      p += r;
+      len -= r;
+   }
+
+   return 0;
+}
+
+// -----------------------------------------------------------------------
+static int recv_all(int fd, void *buf, uint32_t len)
+{
+   uint8_t *p = (uint8_t*)buf;
+
+   while (len > 0)
+   {
+      int r = netRecv(fd, p, len, 0);
+      if (r <= 0) return -1;
+      p += r;
+      len -= r;
+   }
+
+   return 0;
+}
+
+// -----------------------------------------------------------------------
+// Small messages go out as soon as they are written, otherwise the
+// second tile in flight waits for the ack of the first one.
+static void set_nodelay(int fd)
+{
+#ifdef TCP_NODELAY
+   int one = 1;
+   netSetSockOpt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+#endif
+}
+
+// -----------------------------------------------------------------------
+// The fields of the command are 32 bit words, floats included, up to the
+// doubles at the end.
+static void command_swap(spucommand_t *command)
+{
+   uint32_t *w = (uint32_t*)command;
+   uint32_t  words = offsetof(spucommand_t, dstart) / sizeof(uint32_t);
+   uint32_t  i;
+
+   for (i=0; i<sizeof(spucommand_t)/sizeof(uint32_t); i++)
+   {
+      w[i] = htonl(w[i]);
+   }
+
+   // A little endian host has the halves of a double the other way round.
+   for (i=words; htonl(1) != 1 && i<sizeof(spucommand_t)/sizeof(uint32_t); i+=2)
+   {
+      uint32_t t = w[i];
+
+      w[i] = w[i+1];
+      w[i+1] = t;
+   }
+}
+
+// -----------------------------------------------------------------------
+static void header_swap(farmheader_t *header)
+{
+   header->magic = htonl(header->magic);
+   header->type = htonl(header->type);
+   header->tile = htonl(header->tile);
+   header->length = htonl(header->length);
+}
+
+// -----------------------------------------------------------------------
+// Results travel as iterfile tiles: 16 bit counts, rows predicted from the
+// left or from above and the runs of equal counts packed.
+static uint32_t result_encode(const uint8_t *iter, uint32_t width, uint32_t height,
+                              uint16_t *counts, uint8_t *out)
+{
+   uint32_t i;
+
+   for (i=0; i<width*height; i++) counts[i] = iter[i];
+   return iterfile_encode_tile(counts, width, width, height, out);
+}
+
+// -----------------------------------------------------------------------
+static int result_decode(const uint8_t *in, uint32_t len, uint16_t *counts, uint8_t *iter,
+                         uint32_t width, uint32_t height)
+{
+   uint32_t i;
+
+   if (iterfile_decode_tile(in, len, counts, width, width, height) < 0) return -1;
+
+   for (i=0; i<width*height; i++)
+   {
+      if (counts[i] > KERNEL_MAX_ITER) return -1;
+      iter[i] = counts[i];
+   }
+   return 0;
+}
+
+// -----------------------------------------------------------------------
+static uint32_t tile_count(uint32_t width, uint32_t height, uint32_t *tilesx)
+{
+   *tilesx = (width + FARM_TILE_SIZE - 1) / FARM_TILE_SIZE;
+   return *tilesx * ((height + FARM_TILE_SIZE - 1) / FARM_TILE_SIZE);
+}
+
+// -----------------------------------------------------------------------
+// Fill in the command for tile @t, and return where it starts in the frame.
+// The precision is picked per tile, as on the PS3.
+static uint32_t tile_command(spucommand_t *command, const spucommand_t *formula,
+                             uint32_t t, uint32_t tilesx, uint32_t width, uint32_t height,
+                             double x1, double x2, double y1, double y2)
+{
+   double   xstep = (x2 - x1) / width;
+   double   ystep = (y2 - y1) / height;
+   uint32_t x = (t % tilesx) * FARM_TILE_SIZE;
+   uint32_t y = (t / tilesx) * FARM_TILE_SIZE;
+
+   memset(command, 0, sizeof(spucommand_t));
+   command->cmd = CMD_CALC;
+   command->width = (width - x < FARM_TILE_SIZE) ? width - x : FARM_TILE_SIZE;
+   command->height = (height - y < FARM_TILE_SIZE) ? height - y : FARM_TILE_SIZE;
+   command->start = x1 + xstep * x;
+   command->end = command->start + xstep * command->width;
+   command->yvalue = y1 + ystep * y;
+   command->ystep = ystep;
+   command->stride = command->width;
+   kernel_formula(command, formula);
+   kernel_place(command, dd_two_sum(x1, xstep * x), dd_two_sum(y1, ystep * y), xstep, ystep,
+                fmin(fabs(xstep), fabs(ystep)));
+
+   return y * width + x;
+}
+
+// -----------------------------------------------------------------------
+// Same format as the SPU's write into the framebuffer.
+static void tile_store(uint32_t *dest, uint32_t stride, const uint8_t *iter,
+                       uint32_t width, uint32_t height)
+{
+   uint32_t i, j;
+
+   for (j=0; j<height; j++)
+   {
+      for (i=0; i<width; i++)
+      {
+         dest[i] = *iter++ * 0x00010101;
+      }
+      dest += stride;
+   }
+}
+
+// -----------------------------------------------------------------------
+// The same with the colours of histogram colouring, as the SPU's do it.
+static void tile_colour(uint32_t *dest, uint32_t stride, const uint8_t *iter,
+                        uint32_t width, uint32_t height, const uint32_t *palette)
+{
+   uint32_t i, j;
+
+   for (j=0; j<height; j++)
+   {
+      for (i=0; i<width; i++)
+      {
+         dest[i] = palette[*iter++];
+      }
+      dest += stride;
+   }
+}
+
+// -----------------------------------------------------------------------
+// A session of farm_sessions: the frame it is on and the state of its tiles.
+typedef struct
+{
+   farmjob_t     *job;
+   farmtile_t    *tiles;
+   uint32_t       capacity;
+   uint32_t       next[FARM_MAX_NODES];   /* Cursor for the next pending tile in the band of a node */
+   uint32_t       remaining;
+   uint64_t       start;       /* ms */
+} farmstate_t;
+
+// -----------------------------------------------------------------------
+// With workers on several NUMA nodes every node has a band of the frame,
+// rows of tiles next to each other, and the cursors start at the bands.
+static void tile_rewind(const farm_t *farm, farmstate_t *state)
+{
+   uint32_t ntiles = state->job ? state->job->count : 0;
+   uint32_t n;
+
+   for (n=0; n<farm->nodes; n++) state->next[n] = (uint32_t)((uint64_t)ntiles * n / farm->nodes);
+}
+
+// -----------------------------------------------------------------------
+// The next pending tile for a worker on @node: from its own band, and
+// from the bands of the other nodes only when that one is done.
+static uint32_t tile_next(farm_t *farm, farmstate_t *state, uint32_t node)
+{
+   uint32_t ntiles = state->job->count;
+   uint32_t k;
+
+   for (k=0; k<farm->nodes; k++)
+   {
+      uint32_t n = (node + k) % farm->nodes;
+      uint32_t end = (uint32_t)((uint64_t)ntiles * (n + 1) / farm->nodes);
+
+      while (state->next[n] < end && state->tiles[state->next[n]].state != TILE_PENDING) state->next[n]++;
+      if (state->next[n] < end)
+      {
+         if (k > 0) farm->stolen++;
+         return state->next[n];
+      }
+   }
+
+   return FARM_NO_TILE;
+}
+
+// -----------------------------------------------------------------------
+static void worker_fail(farm_t *farm, int w, farmstate_t *state, sched_t *sched)
+{
+   farmworker_t *worker = &farm->worker[w];
+   int           i;
+
+   netClose(worker->fd);
+   worker->fd = -1;
+   farm->alive--;
+
+   for (i=0; i<FARM_INFLIGHT; i++)
+   {
+      if (worker->tile[i] != FARM_NO_TILE)
+      {
+         uint32_t s = worker->tile[i] >> FARM_SESSION_SHIFT;
+
+         state[s].tiles[worker->tile[i] & FARM_TILE_MASK].state = TILE_PENDING;
+         tile_rewind(farm, &state[s]);
+         sched_requeue(sched, s);
+         worker->tile[i] = FARM_NO_TILE;
+         farm->redispatched++;
+      }
+   }
+}
+
+// -----------------------------------------------------------------------
+static int worker_send(farmworker_t *worker, uint32_t t, const spucommand_t *command)
+{
+   struct
+   {
+      farmheader_t   header;
+      spucommand_t   command;
+   } msg;
+
+   msg.header.magic = FARM_MAGIC;
+   msg.header.type = FARM_MSG_TILE;
+   msg.header.tile = t;
+   msg.header.length = sizeof(spucommand_t);
+   header_swap(&msg.header);
+
+   msg.command = *command;
+   command_swap(&msg.command);
+
+   return send_all(worker->fd, &msg, sizeof(msg));
+}
+
+// -----------------------------------------------------------------------
+int farm_connect(farm_t *farm, const char *hosts[], int count)
+{
+   int i;
+
+   memset(farm, 0, sizeof(farm_t));
+   netInitialize();
+
+   farm->nodes = 1;
+   if (arena_create(&farm->scratch, FARM_SCRATCH) < 0) return 0;
+
+   for (i=0; i<count && farm->count < FARM_MAX_WORKERS; i++)
+   {
+      struct sockaddr_in addr;
+      char               ip[32];
+      const char        *port = strchr(hosts[i], ':');
+      size_t             len = port ? (size_t)(port - hosts[i]) : strlen(hosts[i]);
+
+      if (len >= sizeof(ip)) continue;
+      memcpy(ip, hosts[i], len);
+      ip[len] = 0;
+
+      memset(&addr, 0, sizeof(addr));
+      addr.sin_family = AF_INET;
+      addr.sin_port = htons(port ? atoi(port + 1) : FARM_PORT);
+      if (inet_pton(AF_INET, ip, &addr.sin_addr) != 1) continue;
+
+      int fd = netSocket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+      if (fd < 0) continue;
+
+      if (netConnect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+      {
+         netClose(fd);
+         continue;
+      }
+      set_nodelay(fd);
+
+      farmworker_t *worker = &farm->worker[farm->count++];
+      worker->fd = fd;
+      memset(worker->tile, 0xff, sizeof(worker->tile));
+   }
+
+   farm->alive = farm->count;
+   return farm->count;
+}
+
+// -----------------------------------------------------------------------
+// The next frame of session @s, once the one in @state is over. Jobs
+// without tiles are over straight away.
+static void session_next(farm_t *farm, farmsession_t *session, farmstate_t *state,
+                         sched_t *sched, int s, int ok)
+{
+   uint64_t now = farm_now_ms();
+
+   if (state->job)
+   {
+      uint64_t ms = now - state->start;
+
+      session->frames++;
+      session->ms += ms;
+      if (ms > session->worst) session->worst = ms;
+      if (session->deadline && ms > session->deadline) session->late++;
+   }
+
+   for (;;)
+   {
+      state->job = session->next(session, state->job, ok);
+      if (state->job == NULL) return;
+
+      if (state->job->count > state->capacity)
+      {
+         // Not given back before farm_sessions ends, a session seldom grows.
+         state->tiles = (farmtile_t*)arena_alloc(&farm->scratch, state->job->count * sizeof(farmtile_t), 0);
+         state->capacity = state->tiles ? state->job->count : 0;
+         if (state->tiles == NULL)
+         {
+            ok = 0;
+            continue;
+         }
+      }
+      memset(state->tiles, 0, state->job->count * sizeof(farmtile_t));
+
+      tile_rewind(farm, state);
+      state->remaining = state->job->count;
+      state->start = now;
+      sched_frame(sched, s, state->job->count, now, session->deadline ? now + session->deadline : 0);
+
+      if (state->remaining > 0) return;
+      session->frames++;
+      ok = 1;
+   }
+}
+
+// -----------------------------------------------------------------------
+int farm_sessions(farm_t *farm, farmsession_t *sessions, int count, int mode)
+{
+   arenamark_t    mark = arena_mark(&farm->scratch);
+   farmstate_t   *state = (farmstate_t*)arena_alloc(&farm->scratch, count * sizeof(farmstate_t), 0);
+   uint8_t       *result = (uint8_t*)arena_alloc(&farm->scratch, FARM_RESULT_MAX, 0);
+   uint8_t       *iter = (uint8_t*)arena_alloc(&farm->scratch, FARM_TILE_PIXELS, 0);
+   uint16_t      *counts = (uint16_t*)arena_alloc(&farm->scratch, FARM_TILE_PIXELS * sizeof(uint16_t), 0);
+   sched_t        sched;
+   struct pollfd  fds[FARM_MAX_WORKERS];
+   int            fdworker[FARM_MAX_WORKERS];
+   int            active = 0;
+   int            w, i, s;
+
+   if (!state || !result || !iter || !counts || count > FARM_SCHED_MAX_SESSIONS)
+   {
+      arena_reset(&farm->scratch, mark);
+      return -1;
+   }
+   memset(state, 0, count * sizeof(farmstate_t));
+
+   sched_init(&sched, mode, FARM_SCHED_LAG);
+   for (w=0; w<farm->count; w++)
+   {
+      farm->worker[w].done = 0;
+      farm->worker[w].last = 0;
+   }
+
+   for (s=0; s<count; s++)
+   {
+      farmsession_t *session = &sessions[s];
+
+      session->frames = 0;
+      session->late = 0;
+      session->ms = 0;
+      session->worst = 0;
+      session->work = 0;
+
+      sched_add(&sched, session->weight);
+      session_next(farm, session, &state[s], &sched, s, 1);
+      if (state[s].job) active++;
+   }
+
+   while (active > 0 && farm->alive > 0)
+   {
+      // Hand out tiles to every worker with a free slot, of the session
+      // whose turn it is.
+      for (w=0; w<farm->count; w++)
+      {
+         farmworker_t *worker = &farm->worker[w];
+
+         for (i=0; i<FARM_INFLIGHT && worker->fd >= 0; i++)
+         {
+            if (worker->tile[i] != FARM_NO_TILE) continue;
+
+            s = sched_next(&sched);
+            if (s < 0) break;
+
+            // Failed tiles are put back as pending and the cursors back to
+            // the start, the scheduler knows there is one.
+            farmstate_t *st = &state[s];
+            uint32_t     t = tile_next(farm, st, worker->node < farm->nodes ? worker->node : 0);
+
+            if (t == FARM_NO_TILE) break;
+
+            spucommand_t command;
+            st->job->command(st->job, t, &command);
+
+            st->tiles[t].state = TILE_BUSY;
+            st->tiles[t].worker = w;
+            st->tiles[t].sent = farm_now_us();
+            worker->tile[i] = ((uint32_t)s << FARM_SESSION_SHIFT) | t;
+            sched_sent(&sched, s);
+
+            if (worker_send(worker, worker->tile[i], &command) < 0)
+            {
+               worker_fail(farm, w, state, &sched);
+            }
+         }
+      }
+
+      // Wait for results.
+      int n = 0;
+      for (w=0; w<farm->count; w++)
+      {
+         if (farm->worker[w].fd < 0) continue;
+         fds[n].fd = farm->worker[w].fd;
+         fds[n].events = POLLIN;
+         fds[n].revents = 0;
+         fdworker[n++] = w;
+      }
+      if (n == 0) break;
+
+      if (netPoll(fds, n, FARM_POLL_MS) > 0)
+      {
+         for (i=0; i<n; i++)
+         {
+            farmworker_t  *worker = &farm->worker[fdworker[i]];
+            farmheader_t   header;
+            int            slot;
+
+            if (fds[i].revents == 0) continue;
+
+            if (recv_all(worker->fd, &header, sizeof(header)) < 0)
+            {
+               worker_fail(farm, fdworker[i], state, &sched);
+               continue;
+            }
+            header_swap(&header);
+
+            for (slot=0; slot<FARM_INFLIGHT && worker->tile[slot] != header.tile; slot++);
+
+            if (header.magic != FARM_MAGIC || header.type != FARM_MSG_RESULT ||
+                header.length > FARM_RESULT_MAX || slot == FARM_INFLIGHT ||
+                recv_all(worker->fd, result, header.length) < 0)
+            {
+               worker_fail(farm, fdworker[i], state, &sched);
+               continue;
+            }
+
+            farmstate_t   *st = &state[header.tile >> FARM_SESSION_SHIFT];
+            uint32_t       t = header.tile & FARM_TILE_MASK;
+            spucommand_t   command;
+            st->job->command(st->job, t, &command);
+
+            if (result_decode(result, header.length, counts, iter, command.width, command.height) < 0)
+            {
+               worker_fail(farm, fdworker[i], state, &sched);
+               continue;
+            }
+
+            st->job->store(st->job, t, &command, iter);
+
+            // A worker does one tile at a time, so the cost of this one
+            // started when it was sent or when the one before it was back.
+            uint64_t now = farm_now_us();
+            uint64_t begin = worker->last > st->tiles[t].sent ? worker->last : st->tiles[t].sent;
+
+            s = header.tile >> FARM_SESSION_SHIFT;
+            sched_done(&sched, s, (uint32_t)(now - begin));
+            sessions[s].work += now - begin;
+            worker->last = now;
+
+            st->tiles[t].state = TILE_DONE;
+            worker->tile[slot] = FARM_NO_TILE;
+            worker->done++;
+
+            if (--st->remaining == 0)
+            {
+               session_next(farm, &sessions[s], st, &sched, s, 1);
+               if (st->job == NULL) active--;
+            }
+         }
+      }
+
+      // A worker that sits on a tile for too long is given up on.
+      uint64_t now = farm_now_us();
+      for (w=0; w<farm->count; w++)
+      {
+         farmworker_t *worker = &farm->worker[w];
+
+         for (i=0; i<FARM_INFLIGHT && worker->fd >= 0; i++)
+         {
+            uint32_t id = worker->tile[i];
+
+            if (id != FARM_NO_TILE &&
+                now - state[id >> FARM_SESSION_SHIFT].tiles[id & FARM_TILE_MASK].sent > FARM_TIMEOUT_MS * 1000)
+            {
+               worker_fail(farm, w, state, &sched);
+            }
+         }
+      }
+   }
+
+   // Without workers the frames that were going are lost.
+   for (s=0; s<count; s++)
+   {
+      if (state[s].job) sessions[s].next(&sessions[s], state[s].job, 0);
+   }
+
+   arena_reset(&farm->scratch, mark);
+
+   return active == 0 ? 0 : -1;
+}
+
+// -----------------------------------------------------------------------
+// farm_run is a session of one frame.
+static farmjob_t* run_next(farmsession_t *session, farmjob_t *done, int ok)
+{
+   (void)ok;
+   return done ? NULL : (farmjob_t*)session->ctx;
+}
+
+// -----------------------------------------------------------------------
+int farm_run(farm_t *farm, farmjob_t *job)
+{
+   farmsession_t session;
+
+   memset(&session, 0, sizeof(session));
+   session.weight = 1;
+   session.next = run_next;
+   session.ctx = job;
+
+   return farm_sessions(farm, &session, 1, FARM_SCHED_FAIR);
+}
+
+// -----------------------------------------------------------------------
+// A frame on screen, cut in tiles of FARM_TILE_SIZE.
+typedef struct
+{
+   farmjob_t            job;
+   const spucommand_t  *formula;
+   const uint32_t      *palette;
+   uint32_t            *dest;
+   uint32_t             width;
+   uint32_t             height;
+   uint32_t             tilesx;
+   double               x1, x2, y1, y2;
+} framejob_t;
+
+static void frame_command(farmjob_t *job, uint32_t t, spucommand_t *command)
+{
+   framejob_t *frame = (framejob_t*)job;
+
+   tile_command(command, frame->formula, t, frame->tilesx, frame->width, frame->height,
+                frame->x1, frame->x2, frame->y1, frame->y2);
+}
+
+static void frame_store(farmjob_t *job, uint32_t t, const spucommand_t *command, const uint8_t *iter)
+{
+   framejob_t    *frame = (framejob_t*)job;
+   spucommand_t   c;
+   uint32_t       offset = tile_command(&c, frame->formula, t, frame->tilesx, frame->width, frame->height,
+                                        frame->x1, frame->x2, frame->y1, frame->y2);
+
+   if (frame->palette)
+   {
+      tile_colour(&frame->dest[offset], frame->width, iter, command->width, command->height, frame->palette);
+   }
+   else
+   {
+      tile_store(&frame->dest[offset], frame->width, iter, command->width, command->height);
+   }
+}
+
+// -----------------------------------------------------------------------
+int farm_render(farm_t *farm, const spucommand_t *formula, uint32_t *dest,
+                uint32_t width, uint32_t height, double x1, double x2, double y1, double y2)
+{
+   framejob_t frame;
+
+   frame.job.count = tile_count(width, height, &frame.tilesx);
+   frame.job.command = frame_command;
+   frame.job.store = frame_store;
+   frame.formula = formula;
+   frame.palette = farm->palette;
+   frame.dest = dest;
+   frame.width = width;
+   frame.height = height;
+   frame.x1 = x1;
+   frame.x2 = x2;
+   frame.y1 = y1;
+   frame.y2 = y2;
+
+   return farm_run(farm, &frame.job);
+}
+
+// -----------------------------------------------------------------------
+// A list of ready made commands, results go to their own buffer each.
+typedef struct
+{
+   farmjob_t            job;
+   const spucommand_t  *commands;
+   uint8_t *const      *out;
+} listjob_t;
+
+static void list_command(farmjob_t *job, uint32_t t, spucommand_t *command)
+{
+   *command = ((listjob_t*)job)->commands[t];
+}
+
+static void list_store(farmjob_t *job, uint32_t t, const spucommand_t *command, const uint8_t *iter)
+{
+   memcpy(((listjob_t*)job)->out[t], iter, command->width * command->height);
+}
+
+// -----------------------------------------------------------------------
+int farm_compute(void *ctx, const spucommand_t *commands, uint8_t *const *out, uint32_t count)
+{
+   listjob_t list;
+
+   list.job.count = count;
+   list.job.command = list_command;
+   list.job.store = list_store;
+   list.commands = commands;
+   list.out = out;
+
+   return farm_run((farm_t*)ctx, &list.job);
+}
+
+// -----------------------------------------------------------------------
+// All workers are asked at once, so they answer side by side.
+int farm_histogram(farm_t *farm, uint32_t *hist)
+{
+   arenamark_t    mark = arena_mark(&farm->scratch);
+   uint32_t      *counts = (uint32_t*)arena_alloc(&farm->scratch, farm->count * PALETTE_SIZE * sizeof(uint32_t), 0);
+   uint32_t      *list[FARM_MAX_WORKERS + 1];
+   farmheader_t   header;
+   int            n = 0;
+   int            w, i;
+
+   if (counts == NULL) return -1;
+
+   header.magic = FARM_MAGIC;
+   header.type = FARM_MSG_HISTOGRAM;
+   header.tile = 0;
+   header.length = 0;
+   header_swap(&header);
+
+   for (w=0; w<farm->count; w++)
+   {
+      if (farm->worker[w].fd >= 0 && send_all(farm->worker[w].fd, &header, sizeof(header)) < 0)
+      {
+         netClose(farm->worker[w].fd);
+         farm->worker[w].fd = -1;
+         farm->alive--;
+      }
+   }
+
+   // hist is the first of the list, the tree ends there.
+   list[n++] = hist;
+   memset(hist, 0, PALETTE_SIZE * sizeof(uint32_t));
+
+   for (w=0; w<farm->count; w++)
+   {
+      farmworker_t *worker = &farm->worker[w];
+      uint32_t     *h = &counts[w * PALETTE_SIZE];
+      farmheader_t  reply;
+
+      if (worker->fd < 0) continue;
+
+      if (recv_all(worker->fd, &reply, sizeof(reply)) == 0) header_swap(&reply);
+      else reply.magic = 0;
+
+      if (reply.magic != FARM_MAGIC || reply.type != FARM_MSG_HISTOGRAM ||
+          reply.length != PALETTE_SIZE * sizeof(uint32_t) ||
+          recv_all(worker->fd, h, reply.length) < 0)
+      {
+         netClose(worker->fd);
+         worker->fd = -1;
+         farm->alive--;
+         continue;
+      }
+
+      for (i=0; i<PALETTE_SIZE; i++) h[i] = ntohl(h[i]);
+      list[n++] = h;
+   }
+
+   palette_reduce(list, n);
+   arena_reset(&farm->scratch, mark);
+
+   return farm->alive > 0 ? 0 : -1;
+}
+
+// -----------------------------------------------------------------------
+void farm_close(farm_t *farm)
+{
+   farmheader_t header;
+   int          w;
+
+   header.magic = FARM_MAGIC;
+   header.type = FARM_MSG_QUIT;
+   header.tile = 0;
+   header.length = 0;
+   header_swap(&header);
+
+   for (w=0; w<farm->count; w++)
+   {
+      if (farm->worker[w].fd < 0) continue;
+
+      send_all(farm->worker[w].fd, &header, sizeof(header));
+      netClose(farm->worker[w].fd);
+      farm->worker[w].fd = -1;
+   }
+
+   farm->alive = 0;
+   arena_destroy(&farm->scratch);
+}
+
+// -----------------------------------------------------------------------
+int farm_listen(uint16_t port)
+{
+   struct sockaddr_in addr;
+   int                one = 1;
+   int                fd;
+
+   netInitialize();
+
+   fd = netSocket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+   if (fd < 0) return -1;
+
+   netSetSockOpt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons(port);
+   addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+   if (netBind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+       netListen(fd, 4) < 0)
+   {
+      netClose(fd);
+      return -1;
+   }
+
+   return fd;
+}
+
+// -----------------------------------------------------------------------
+int farm_serve(int listenfd)
+{
+   uint8_t  *iter = (uint8_t*)malloc(FARM_TILE_PIXELS);
+   uint16_t *counts = (uint16_t*)malloc(FARM_TILE_PIXELS * sizeof(uint16_t));
+   uint8_t  *msg = (uint8_t*)malloc(sizeof(farmheader_t) + FARM_RESULT_MAX);
+
+   // Each worker counts its own tiles, nobody else writes to it.
+   uint32_t  hist[PALETTE_SIZE];
+
+   if (!iter || !counts || !msg)
+   {
+      free(msg);
+      free(counts);
+      free(iter);
+      return -1;
+   }
+
+   while (1)
+   {
+      int fd = netAccept(listenfd, NULL, NULL);
+      if (fd < 0) break;
+      set_nodelay(fd);
+      memset(hist, 0, sizeof(hist));
+
+      while (1)
+      {
+         farmheader_t   header;
+         spucommand_t   command;
+
+         if (recv_all(fd, &header, sizeof(header)) < 0) break;
+         header_swap(&header);
+
+         if (header.magic == FARM_MAGIC && header.type == FARM_MSG_HISTOGRAM)
+         {
+            farmheader_t *reply = (farmheader_t*)msg;
+            uint32_t     *h = (uint32_t*)(msg + sizeof(farmheader_t));
+            int           i;
+
+            reply->magic = FARM_MAGIC;
+            reply->type = FARM_MSG_HISTOGRAM;
+            reply->tile = 0;
+            reply->length = sizeof(hist);
+            header_swap(reply);
+
+            for (i=0; i<PALETTE_SIZE; i++) h[i] = htonl(hist[i]);
+            memset(hist, 0, sizeof(hist));
+
+            if (send_all(fd, msg, sizeof(farmheader_t) + sizeof(hist)) < 0) break;
+            continue;
+         }
+
+         if (header.magic != FARM_MAGIC || header.type != FARM_MSG_TILE) break;
+         if (header.length != sizeof(spucommand_t)) break;
+         if (recv_all(fd, &command, sizeof(command)) < 0) break;
+         command_swap(&command);
+
+         // Nothing the kernel loops on is taken on trust: a Multibrot power
+         // of a million hangs the worker as surely as a wrong formula.
+         if (command.width > FARM_TILE_SIZE || command.height > FARM_TILE_SIZE) break;
+         if (command.formula >= FORMULA_COUNT || command.precision >= KERNEL_PREC_COUNT) break;
+         if (command.formula == FORMULA_MULTIBROT &&
+             (command.power < FORMULA_POWER_MIN || command.power > FORMULA_POWER_MAX)) break;
+
+         kernel_tile(&command, iter);
+         palette_count_iter(hist, iter, command.width * command.height);
+
+         farmheader_t *reply = (farmheader_t*)msg;
+         reply->magic = FARM_MAGIC;
+         reply->type = FARM_MSG_RESULT;
+         reply->tile = header.tile;
+         reply->length = result_encode(iter, command.width, command.height, counts, msg + sizeof(farmheader_t));
+
+         uint32_t len = sizeof(farmheader_t) + reply->length;
+         header_swap(reply);
+
+         if (send_all(fd, msg, len) < 0) break;
+      }
+
+      netClose(fd);
+   }
+
+   free(msg);
+   free(counts);
+   free(iter);
+
+   return -1;
+}
+
+#ifdef FARM_MAIN
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+
+#include "tilecache.h"
+#include "shmframe.h"
+#include "replay.h"
+#include "profile.h"
+#include "buddha.h"
+#include "topo.h"
+
+// -----------------------------------------------------------------------
+// Tile cache misses without any workers.
+static int local_compute(void *ctx, const spucommand_t *commands, uint8_t *const *out, uint32_t count)
+{
+   uint32_t i;
+
+   (void)ctx;
+   for (i=0; i<count; i++) kernel_tile(&commands[i], out[i]);
+
+   return 0;
+}
+
+// -----------------------------------------------------------------------
+static void local_render(const spucommand_t *formula, uint32_t *dest,
+                         uint32_t width, uint32_t height,
+                         double x1, double x2, double y1, double y2)
+{
+   uint8_t  iter[FARM_TILE_PIXELS];
+   uint32_t tilesx;
+   uint32_t ntiles = tile_count(width, height, &tilesx);
+   uint32_t t;
+
+   for (t=0; t<ntiles; t++)
+   {
+      spucommand_t command;
+      uint32_t     offset = tile_command(&command, formula, t, tilesx, width, height, x1, x2, y1, y2);
+
+      kernel_tile(&command, iter);
+      tile_store(&dest[offset], width, iter, command.width, command.height);
+   }
+}
+
+// -----------------------------------------------------------------------
+static int write_ppm(const char *name, const uint32_t *frame, uint32_t width, uint32_t height)
+{
+   FILE     *f = fopen(name, "wb");
+   uint32_t  i;
+
+   if (f == NULL) return -1;
+
+   fprintf(f, "P6\n%u %u\n255\n", width, height);
+   for (i=0; i<width*height; i++)
+   {
+      uint8_t rgb[3] = { frame[i] >> 16, frame[i] >> 8, frame[i] };
+      fwrite(rgb, 1, 3, f);
+   }
+
+   return fclose(f);
+}
+
+// -----------------------------------------------------------------------
+static void loopback_stop(int count, pid_t *pid)
+{
+   int i;
+
+   for (i=0; i<count; i++)
+   {
+      if (pid[i] <= 0) continue;
+      kill(pid[i], SIGTERM);
+      waitpid(pid[i], NULL, 0);
+      pid[i] = -1;
+   }
+}
+
+// -----------------------------------------------------------------------
+// @count workers on local ports, each pinned to cpus[i] (-1 is not at all)
+// before it allocates anything, so its buffers are on its own node. When
+// one can't be started the others are stopped again.
+static int loopback_start(int count, const int *cpus, pid_t *pid)
+{
+   int i;
+
+   for (i=0; i<count; i++) pid[i] = -1;
+
+   for (i=0; i<count; i++)
+   {
+      int fd = farm_listen(FARM_PORT + i);
+      if (fd < 0)
+      {
+         fprintf(stderr, "port %d in use\n", FARM_PORT + i);
+         loopback_stop(i, pid);
+         return -1;
+      }
+
+      pid[i] = fork();
+      if (pid[i] == 0)
+      {
+         if (cpus[i] >= 0) topo_pin(0, cpus[i]);
+         farm_serve(fd);
+         _exit(0);
+      }
+      close(fd);
+   }
+
+   return 0;
+}
+
+
+// -----------------------------------------------------------------------
+// Histogram colouring of 1080p frames on @count local workers, the way the
+// SPU's do it: every worker counts the tiles it calculates, the histograms
+// are collected and added in a tree, and the palette colours the tiles of
+// the next frame as they come in. The same view is rendered grey and in
+// colour, which has to match colouring the grey frame afterwards.
+static int histogram_bench(int count, int frames)
+{
+   const uint32_t width = 1920;
+   const uint32_t height = 1080;
+   const float    x1 = -0.75, x2 = -0.73, y1 = 0.10, y2 = 0.11125;
+
+   pid_t          pid[FARM_MAX_WORKERS];
+   int            cpus[FARM_MAX_WORKERS];
+   char           name[FARM_MAX_WORKERS][32];
+   const char    *hosts[FARM_MAX_WORKERS];
+   uint32_t      *grey = (uint32_t*)malloc(width * height * sizeof(uint32_t));
+   uint32_t      *colour = (uint32_t*)malloc(width * height * sizeof(uint32_t));
+   uint32_t      *check = (uint32_t*)malloc(width * height * sizeof(uint32_t));
+   uint32_t       hist[PALETTE_SIZE];
+   uint32_t       expect[PALETTE_SIZE];
+   uint32_t       palette[PALETTE_SIZE];
+   uint64_t       tgrey = 0, tcolour = 0, tpass = 0;
+   farm_t         farm;
+   int            failed = 0;
+   int            i, f;
+
+   for (i=0; i<FARM_MAX_WORKERS; i++) pid[i] = -1;
+
+   if (count < 1 || count > FARM_MAX_WORKERS || frames < 1 || !grey || !colour || !check)
+   {
+      free(check);
+      free(colour);
+      free(grey);
+      return 1;
+   }
+
+   for (i=0; i<count; i++)
+   {
+      cpus[i] = -1;
+      snprintf(name[i], sizeof(name[i]), "127.0.0.1:%d", FARM_PORT + i);
+      hosts[i] = name[i];
+   }
+
+   if (loopback_start(count, cpus, pid) < 0)
+   {
+      failed = 1;
+   }
+   else if (farm_connect(&farm, hosts, count) != count)
+   {
+      farm_close(&farm);
+      failed = 1;
+   }
+   if (failed)
+   {
+      loopback_stop(count, pid);
+      free(check);
+      free(colour);
+      free(grey);
+      return 1;
+   }
+
+   for (f=0; f<frames && !failed; f++)
+   {
+      uint64_t t = farm_now_us();
+
+      farm.palette = NULL;
+      if (farm_render(&farm, NULL, grey, width, height, x1, x2, y1, y2) < 0) failed = 1;
+      tgrey += farm_now_us() - t;
+
+      // This is all the coordinator adds to a frame.
+      t = farm_now_us();
+      if (farm_histogram(&farm, hist) < 0) failed = 1;
+      palette_equalise(hist, palette);
+      tpass += farm_now_us() - t;
+
+      t = farm_now_us();
+      farm.palette = palette;
+      if (farm_render(&farm, NULL, colour, width, height, x1, x2, y1, y2) < 0) failed = 1;
+      tcolour += farm_now_us() - t;
+
+      // The counts of the coloured frame are not wanted.
+      if (farm_histogram(&farm, expect) < 0) failed = 1;
+
+      memset(expect, 0, sizeof(expect));
+      palette_count(expect, grey, width * height);
+      palette_apply(palette, grey, check, width * height);
+      if (memcmp(hist, expect, sizeof(hist)) != 0 ||
+          memcmp(colour, check, width * height * sizeof(uint32_t)) != 0)
+      {
+         failed = 1;
+      }
+   }
+
+   farm_close(&farm);
+   loopback_stop(count, pid);
+
+   printf("%ux%u on %d workers: grey %.2f ms/frame, coloured %.2f ms/frame, "
+          "histograms collected, added and equalised in %.3f ms/frame\n",
+          width, height, count, tgrey / 1000.0 / frames, tcolour / 1000.0 / frames,
+          tpass / 1000.0 / frames);
+   printf("%s\n", failed ? "FAILED" : "passed");
+
+   free(check);
+   free(colour);
+   free(grey);
+   return failed;
+}
+
+// -----------------------------------------------------------------------
+// Start @count workers on local ports and render with 1, 2, .. of them,
+// placed as @policy says, or every way there is for -1.
+static int loopback(int count, int frames, int policy)
+{
+   const uint32_t width = 720;
+   const uint32_t height = 480;
+   const float    x1 = -2.0, x2 = 1.0, y1 = -1.5, y2 = 1.5;
+
+   pid_t          pid[FARM_MAX_WORKERS];
+   int            cpus[FARM_MAX_WORKERS];
+   char           name[FARM_MAX_WORKERS][32];
+   const char    *hosts[FARM_MAX_WORKERS];
+   uint32_t      *reference = (uint32_t*)malloc(width * height * sizeof(uint32_t));
+   uint32_t      *frame = (uint32_t*)malloc(width * height * sizeof(uint32_t));
+   double         single = 0;
+   farm_t         farm;
+   topo_t         topo;
+   int            i, n, f, p;
+   int            failed = 0;
+
+   if (count < 1 || count > FARM_MAX_WORKERS || policy >= TOPO_POLICIES) return 1;
+
+   for (i=0; i<count; i++)
+   {
+      snprintf(name[i], sizeof(name[i]), "127.0.0.1:%d", FARM_PORT + i);
+      hosts[i] = name[i];
+      pid[i] = -1;
+   }
+
+   topo_read(&topo);
+   printf("%u cpus, %u cores, %u nodes\n", topo.cpus, topo.cores, topo.nodes);
+
+   uint64_t t = farm_now_ms();
+   local_render(NULL, reference, width, height, x1, x2, y1, y2);
+   printf("local       %4u ms/frame\n", (unsigned)(farm_now_ms() - t));
+
+   for (p=(policy < 0 ? 0 : policy); p<=(policy < 0 ? TOPO_POLICIES - 1 : policy) && !failed; p++)
+   {
+      topo_place(&topo, p, count, cpus);
+      loopback_stop(count, pid);
+      if (loopback_start(count, cpus, pid) < 0)
+      {
+         failed = 1;
+         break;
+      }
+
+      printf("%s:", topo_policy_name(p));
+      for (i=0; i<count; i++) printf(cpus[i] < 0 ? " -" : " %d", cpus[i]);
+      printf("\n");
+
+      printf("workers  ms/frame  speedup  nodes  stolen  tiles/worker\n");
+      for (n=1; n<=count; n++)
+      {
+         if (farm_connect(&farm, hosts, n) != n)
+         {
+            fprintf(stderr, "could not reach %d workers\n", n);
+            failed = 1;
+            break;
+         }
+
+         // The nodes of the first n, which come one node after the other.
+         for (i=0; i<n; i++)
+         {
+            uint32_t node = cpus[i] < 0 ? 0 : (uint32_t)topo_node(&topo, cpus[i]);
+
+            farm.worker[i].node = node < FARM_MAX_NODES ? node : 0;
+            if (farm.worker[i].node >= farm.nodes) farm.nodes = farm.worker[i].node + 1;
+         }
+
+         t = farm_now_ms();
+         for (f=0; f<frames; f++)
+         {
+            memset(frame, 0, width * height * sizeof(uint32_t));
+            if (farm_render(&farm, NULL, frame, width, height, x1, x2, y1, y2) < 0 ||
+                memcmp(frame, reference, width * height * sizeof(uint32_t)) != 0)
+            {
+               failed = 1;
+            }
+         }
+         double ms = (double)(farm_now_ms() - t) / frames;
+         if (n == 1) single = ms;
+
+         printf("%7d  %8.1f  %7.2f  %5u  %6u ", n, ms, ms > 0 ? single / ms : 0.0, farm.nodes,
+                farm.stolen);
+         for (i=0; i<n; i++) printf(" %u", farm.worker[i].done);
+         printf("\n");
+
+         farm_close(&farm);
+      }
+   }
+
+   // Kill a worker, its tiles have to go to the others.
+   if (!failed && count > 1 && farm_connect(&farm, hosts, count) == count)
+   {
+      kill(pid[0], SIGKILL);
+      waitpid(pid[0], NULL, 0);
+      pid[0] = -1;
+
+      memset(frame, 0, width * height * sizeof(uint32_t));
+      if (farm_render(&farm, NULL, frame, width, height, x1, x2, y1, y2) < 0 ||
+          memcmp(frame, reference, width * height * sizeof(uint32_t)) != 0)
+      {
+         failed = 1;
+      }
+      printf("worker killed: %d alive, %u tiles redispatched, frame %s\n",
+             farm.alive, farm.redispatched, failed ? "wrong" : "ok");
+
+      farm_close(&farm);
+   }
+
+   // The second time around the same view comes from the cache.
+   if (!failed && farm_connect(&farm, &hosts[count - 1], 1) == 1)
+   {
+      char        path[] = "/tmp/farmcacheXXXXXX";
+      int         fd = mkstemp(path);
+      tilecache_t cache;
+
+      if (fd < 0 || tilecache_open(&cache, path, 1024) < 0)
+      {
+         failed = 1;
+      }
+      else
+      {
+         uint32_t *again = (uint32_t*)malloc(width * height * sizeof(uint32_t));
+
+         t = farm_now_ms();
+         int first = tilecache_render(&cache, NULL, frame, width, height,
+                                      x1, x2, y1, y2, farm_compute, &farm);
+         uint64_t cold = farm_now_ms() - t;
+
+         t = farm_now_ms();
+         int second = tilecache_render(&cache, NULL, again, width, height,
+                                       x1, x2, y1, y2, farm_compute, &farm);
+         uint64_t warm = farm_now_ms() - t;
+
+         if (first <= 0 || second != 0 || memcmp(frame, again, width * height * sizeof(uint32_t)) != 0)
+         {
+            failed = 1;
+         }
+         printf("tile cache: %d tiles calculated in %u ms, %d the second time in %u ms\n",
+                first, (unsigned)cold, second, (unsigned)warm);
+
+         tilecache_close(&cache);
+
+         // A frame of more tiles than half the store is calculated in batches.
+         uint32_t slots = first > 4 ? (uint32_t)first / 4 : 1;
+
+         memset(again, 0, width * height * sizeof(uint32_t));
+         if (tilecache_open(&cache, path, slots) < 0)
+         {
+            failed = 1;
+         }
+         else
+         {
+            int small = tilecache_render(&cache, NULL, again, width, height,
+                                         x1, x2, y1, y2, farm_compute, &farm);
+
+            if (small != first || memcmp(frame, again, width * height * sizeof(uint32_t)) != 0)
+            {
+               failed = 1;
+            }
+            printf("small tile cache: %d tiles calculated with %u slots, frame %s\n",
+                   small, slots, failed ? "wrong" : "ok");
+
+            tilecache_close(&cache);
+         }
+
+         free(again);
+      }
+      if (fd >= 0)
+      {
+         close(fd);
+         unlink(path);
+      }
+
+      farm_close(&farm);
+   }
+
+   loopback_stop(count, pid);
+
+   free(frame);
+   free(reference);
+
+   printf("%s\n", failed ? "FAILED" : "passed");
+   return failed;
+}
+
+// -----------------------------------------------------------------------
+// A viewer of "sessions". The heavy one zooms in on a point, the light
+// ones pan and keep going for as long as the heavy one does.
+typedef struct
+{
+   framejob_t  frame;
+   const char *name;
+   uint32_t    frames;     /* To go, for the heavy one */
+   float       cx, cy, size;
+   int        *over;       /* Set by the heavy one at the end, seen by the others */
+} viewer_t;
+
+static farmjob_t* viewer_next(farmsession_t *session, farmjob_t *done, int ok)
+{
+   viewer_t *v = (viewer_t*)session->ctx;
+   float     aspect = (float)v->frame.height / v->frame.width;
+
+   if (!ok || *v->over) return NULL;
+   if (v->frames && --v->frames == 0) *v->over = 1;
+
+   if (done && v->frames) v->size *= 0.97f;
+   else if (done) v->cx += v->size * 0.01f;
+   v->frame.x1 = v->cx - v->size;
+   v->frame.x2 = v->cx + v->size;
+   v->frame.y1 = v->cy - v->size * aspect;
+   v->frame.y2 = v->cy + v->size * aspect;
+   return &v->frame.job;
+}
+
+// -----------------------------------------------------------------------
+// Two small views and a deep zoom on the same workers, first in the order
+// the frames come in, then with fair shares and deadlines.
+static int sessions(int count, int frames)
+{
+   static const struct
+   {
+      const char *name;
+      uint32_t    width, height, weight;
+      float       cx, cy, size;
+   } setup[3] =
+   {
+      { "light a",  320,  240, 1, -0.5f,         0.0f,        1.5f },
+      { "light b",  320,  240, 1, -0.1f,         0.9f,        0.3f },
+      { "deep",    1280,  720, 1, -0.743643887f, 0.131825904f, 0.002f },
+   };
+
+   pid_t          pid[FARM_MAX_WORKERS];
+   int            cpus[FARM_MAX_WORKERS];
+   char           name[FARM_MAX_WORKERS][32];
+   const char    *hosts[FARM_MAX_WORKERS];
+   uint32_t      *dest[3];
+   viewer_t       viewer[3];
+   farmsession_t  session[3];
+   uint32_t       deadline[3];
+   farm_t         farm;
+   int            over;
+   int            failed = 0;
+   int            i, m;
+
+   if (count < 1 || count > FARM_MAX_WORKERS || frames < 1) return 1;
+
+   for (i=0; i<count; i++)
+   {
+      cpus[i] = -1;
+      snprintf(name[i], sizeof(name[i]), "127.0.0.1:%d", FARM_PORT + i);
+      hosts[i] = name[i];
+   }
+
+   for (i=0; i<3; i++)
+   {
+      dest[i] = (uint32_t*)malloc(setup[i].width * setup[i].height * sizeof(uint32_t));
+   }
+
+   if (!dest[0] || !dest[1] || !dest[2] || loopback_start(count, cpus, pid) < 0)
+   {
+      for (i=0; i<3; i++) free(dest[i]);
+      return 1;
+   }
+
+   // Every mode starts from the same views. A light frame has to be done
+   // in the time it takes on a third of the workers, and a bit.
+   for (m=-1; m<2 && !failed; m++)
+   {
+      if (farm_connect(&farm, hosts, count) != count)
+      {
+         fprintf(stderr, "could not reach %d workers\n", count);
+         farm_close(&farm);
+         failed = 1;
+         break;
+      }
+
+      for (i=0; i<3; i++)
+      {
+         viewer_t *v = &viewer[i];
+
+         memset(v, 0, sizeof(viewer_t));
+         v->frame.job.count = tile_count(setup[i].width, setup[i].height, &v->frame.tilesx);
+         v->frame.job.command = frame_command;
+         v->frame.job.store = frame_store;
+         v->frame.dest = dest[i];
+         v->frame.width = setup[i].width;
+         v->frame.height = setup[i].height;
+         v->name = setup[i].name;
+         v->frames = i == 2 ? frames : 0;
+         v->cx = setup[i].cx;
+         v->cy = setup[i].cy;
+         v->size = setup[i].size;
+         v->over = &over;
+
+         memset(&session[i], 0, sizeof(farmsession_t));
+         session[i].weight = setup[i].weight;
+         session[i].deadline = m < 0 || i == 2 ? 0 : deadline[i];
+         session[i].ctx = v;
+         session[i].next = viewer_next;
+      }
+
+      if (m < 0)
+      {
+         // The light ones alone, one frame each.
+         for (i=0; i<2; i++)
+         {
+            over = 0;
+            viewer[i].frames = 1;
+            if (farm_sessions(&farm, &session[i], 1, FARM_SCHED_FAIR) < 0) failed = 1;
+            deadline[i] = 3 * session[i].ms + session[i].ms / 2 + 1;
+         }
+         farm_close(&farm);
+         continue;
+      }
+
+      over = 0;
+      uint64_t t = farm_now_ms();
+      if (farm_sessions(&farm, session, 3, m) < 0) failed = 1;
+      uint64_t total = farm_now_ms() - t;
+
+      uint64_t work = 0;
+      for (i=0; i<3; i++) work += session[i].work;
+
+      printf("%s, %u ms\n", m == FARM_SCHED_FAIR ? "fair" : "fifo", (unsigned)total);
+      printf("  session   frames  ms/frame  worst  deadline  late  share\n");
+      for (i=0; i<3; i++)
+      {
+         farmsession_t *s = &session[i];
+
+         printf("  %-8s  %6u  %8.1f  %5u  %8u  %4u  %4.0f%%\n", viewer[i].name, s->frames,
+                s->frames ? (double)s->ms / s->frames : 0.0, (unsigned)s->worst, s->deadline, s->late,
+                work ? 100.0 * s->work / work : 0.0);
+      }
+
+      farm_close(&farm);
+   }
+
+   loopback_stop(count, pid);
+   for (i=0; i<3; i++) free(dest[i]);
+
+   return failed;
+}
+
+// -----------------------------------------------------------------------
+static int bench(int frames)
+{
+   static const char *name[FORMULA_COUNT] = { "mandel", "julia", "multibrot", "burningship", "tricorn" };
+   const uint32_t     width = 720;
+   const uint32_t     height = 480;
+   uint32_t          *frame = (uint32_t*)malloc(width * height * sizeof(uint32_t));
+   spucommand_t       formula;
+   int                f, i;
+
+   for (f=0; f<FORMULA_COUNT; f++)
+   {
+      kernel_formula(&formula, NULL);
+      formula.formula = f;
+      formula.power = 3;
+      formula.cre = -0.8;
+      formula.cim = 0.156;
+
+      uint64_t t = farm_now_ms();
+      for (i=0; i<frames; i++)
+      {
+         local_render(&formula, frame, width, height, -2.0, 1.0, -1.5, 1.5);
+      }
+      t = farm_now_ms() - t;
+
+      printf("%-12s %6.1f ms/frame %6.1f Mpixel/s\n", name[f], (double)t / frames,
+             t ? (double)width * height * frames / (t * 1000.0) : 0.0);
+   }
+
+   // The Mandelbrot frame and points on every instruction set the kernel
+   // can use here; all of them must give the counts of the scalar one.
+   uint32_t  pixels = width * height;
+   uint32_t *want = (uint32_t*)malloc(FORMULA_COUNT * pixels * sizeof(uint32_t));
+   float    *ix = (float*)malloc(pixels * sizeof(float));
+   float    *iy = (float*)malloc(pixels * sizeof(float));
+   uint8_t  *icount = (uint8_t*)malloc(2 * pixels);
+   float    *ismooth = (float*)malloc(2 * pixels * sizeof(float));
+   uint32_t  isas = kernel_isa_supported();
+   int       best = kernel_isa();
+   int       isa;
+   int       differ = 0;
+
+   if (!frame || !want || !ix || !iy || !icount || !ismooth) return 1;
+
+   for (i=0; i<(int)pixels; i++)
+   {
+      ix[i] = -2.0 + 3.0 * (i % width) / width;
+      iy[i] = -1.5 + 3.0 * (i / width) / height;
+   }
+
+   printf("isa          Mpixel/s  Mpoint/s  counts\n");
+   for (isa=0; isa<KERNEL_ISA_COUNT; isa++)
+   {
+      int same = 1;
+
+      if (!(isas & (1 << isa))) continue;
+      kernel_isa_select(isa);
+
+      for (f=0; f<FORMULA_COUNT; f++)
+      {
+         uint32_t *check = isa == KERNEL_ISA_SCALAR ? &want[f * pixels] : frame;
+
+         kernel_formula(&formula, NULL);
+         formula.formula = f;
+         formula.power = 3;
+         formula.cre = -0.8;
+         formula.cim = 0.156;
+         local_render(&formula, check, width, height, -2.0, 1.0, -1.5, 1.5);
+         if (memcmp(check, &want[f * pixels], pixels * sizeof(uint32_t)) != 0) same = 0;
+      }
+
+      kernel_formula(&formula, NULL);
+      uint64_t t = farm_now_ms();
+      for (i=0; i<frames; i++)
+      {
+         local_render(&formula, frame, width, height, -2.0, 1.0, -1.5, 1.5);
+      }
+      t = farm_now_ms() - t;
+
+      uint64_t tp = farm_now_ms();
+      for (i=0; i<frames; i++)
+      {
+         kernel_points(&formula, ix, iy, pixels, &icount[pixels], &ismooth[pixels]);
+      }
+      tp = farm_now_ms() - tp;
+
+      if (isa == KERNEL_ISA_SCALAR)
+      {
+         memcpy(icount, &icount[pixels], pixels);
+         memcpy(ismooth, &ismooth[pixels], pixels * sizeof(float));
+      }
+      else if (memcmp(icount, &icount[pixels], pixels) != 0 ||
+               memcmp(ismooth, &ismooth[pixels], pixels * sizeof(float)) != 0)
+      {
+         same = 0;
+      }
+      if (!same) differ = 1;
+
+      printf("%-12s %8.1f  %8.1f  %s\n", kernel_isa_name(isa),
+             t ? (double)pixels * frames / (t * 1000.0) : 0.0,
+             tp ? (double)pixels * frames / (tp * 1000.0) : 0.0, same ? "same" : "DIFFER");
+   }
+
+   // A tile has the counts of the SPU's, one less than kernel_point's.
+   spucommand_t   command;
+   uint8_t        iter[FARM_TILE_PIXELS];
+   uint32_t       tilesx;
+   uint32_t       spu = 1;
+
+   kernel_isa_select(KERNEL_ISA_SCALAR);
+   tile_count(width, height, &tilesx);
+   tile_command(&command, NULL, tilesx / 2, tilesx, width, height, -2.0, 1.0, -1.5, 1.5);
+   kernel_tile(&command, iter);
+
+   float    xstep = (command.end - command.start) / command.width;
+   float    y = command.yvalue;
+   uint8_t *p = iter;
+   uint32_t j;
+
+   for (j=0; j<command.height; j++, y += command.ystep)
+   {
+      for (i=0; i<(int)command.width; i++)
+      {
+         uint32_t c = kernel_point(&command, command.start + xstep * i, y);
+
+         if (*p++ != (c ? c - 1 : 0)) spu = 0;
+      }
+   }
+   printf("tile counts  %s\n", spu ? "as the SPU's" : "DIFFER from the SPU's");
+   if (!spu) differ = 1;
+   kernel_isa_select(best);
+
+   free(want);
+   free(ix);
+   free(iy);
+   free(icount);
+   free(ismooth);
+   free(frame);
+
+   // The Mandelbrot pixels once more as loose points in a scrambled
+   // order, with smooth counts: the same work through kernel_points.
+   uint32_t  n = width * height;
+   float    *px = (float*)malloc(n * sizeof(float));
+   float    *py = (float*)malloc(n * sizeof(float));
+   uint8_t  *count = (uint8_t*)malloc(n);
+   float    *smooth = (float*)malloc(n * sizeof(float));
+
+   if (!px || !py || !count || !smooth) return 1;
+
+   for (i=0; i<(int)n; i++)
+   {
+      uint32_t p = (uint32_t)(((uint64_t)i * 7919) % n);
+
+      px[i] = -2.0 + 3.0 * (p % width) / width;
+      py[i] = -1.5 + 3.0 * (p / width) / height;
+   }
+
+   kernel_formula(&formula, NULL);
+   for (f=0; f<2; f++)
+   {
+      uint64_t t = farm_now_ms();
+      for (i=0; i<frames; i++)
+      {
+         kernel_points(&formula, px, py, n, count, f ? smooth : NULL);
+      }
+      t = farm_now_ms() - t;
+
+      printf("%-12s %6.1f ms/frame %6.1f Mpoint/s\n", f ? "smooth" : "points", (double)t / frames,
+             t ? (double)n * frames / (t * 1000.0) : 0.0);
+   }
+
+   free(px);
+   free(py);
+   free(count);
+   free(smooth);
+
+   return differ;
+}
+
+// -----------------------------------------------------------------------
+// Zoom into the seahorse valley, every frame is rendered in its slot of
+// the ring and published. A slow viewer only misses frames.
+static int stream(const char *name, uint32_t width, uint32_t height, int frames,
+                  const char *hosts[], int count)
+{
+   const float    cx = -0.743643, cy = 0.131825;
+   float          size = 3.0;
+   shmframe_t     ring;
+   farm_t         farm;
+   int            f;
+
+   if (count > 0 && farm_connect(&farm, hosts, count) == 0) return 1;
+   if (shmframe_create(&ring, name, width, height, 4) < 0)
+   {
+      fprintf(stderr, "could not create %s\n", name);
+      return 1;
+   }
+
+   uint64_t t = farm_now_ms();
+   for (f=0; f<frames; f++)
+   {
+      uint32_t *dest = shmframe_begin(&ring);
+      float     x1 = cx - size / 2, x2 = cx + size / 2;
+      float     y1 = cy - size * height / width / 2, y2 = cy + size * height / width / 2;
+
+      if (count > 0)
+      {
+         if (farm_render(&farm, NULL, dest, width, height, x1, x2, y1, y2) < 0) break;
+      }
+      else
+      {
+         local_render(NULL, dest, width, height, x1, x2, y1, y2);
+      }
+
+      shmframe_publish(&ring);
+      size *= 0.95;
+   }
+   t = farm_now_ms() - t;
+
+   printf("%d frames in %u ms, %.1f frames/s\n", f, (unsigned)t, t ? f * 1000.0 / t : 0.0);
+
+   if (count > 0) farm_close(&farm);
+   shmframe_close(&ring);
+
+   return f < frames;
+}
+
+// -----------------------------------------------------------------------
+// Follow a ring for @seconds, counting the frames seen and the ones the
+// producer overwrote while they were being read. The last good frame is
+// written from the shared memory itself.
+static int view(const char *name, int seconds, const char *out)
+{
+   shmframe_t        ring;
+   uint64_t          seen = 0;
+   uint32_t          shown = 0, torn = 0, sum = 0;
+   uint64_t          end;
+
+   end = farm_now_ms() + seconds * 1000;
+   while (shmframe_open(&ring, name) < 0)
+   {
+      if (farm_now_ms() > end) return 1;
+      usleep(10000);
+   }
+
+   uint32_t width = ring.header->width;
+   uint32_t height = ring.header->height;
+
+   while (farm_now_ms() < end)
+   {
+      const uint32_t *frame = shmframe_latest(&ring, &seen);
+      uint32_t        i;
+
+      if (frame == NULL)
+      {
+         usleep(1000);
+         continue;
+      }
+
+      // Stands in for the work of a viewer or encoder.
+      for (i=0; i<width*height; i++) sum += frame[i];
+
+      if (!shmframe_valid(&ring, seen - 1))
+      {
+         torn++;
+         continue;
+      }
+
+      shown++;
+
+      if (out != NULL && write_ppm(out, frame, width, height) == 0 && shmframe_valid(&ring, seen - 1))
+      {
+         out = NULL;
+      }
+   }
+
+   printf("%ux%u: %u frames shown, %u overwritten while read, %u skipped (checksum %08x)\n",
+          width, height, shown, torn, (uint32_t)(seen - shown - torn), sum);
+
+   shmframe_close(&ring);
+   return shown == 0;
+}
+
+// -----------------------------------------------------------------------
+// Render every view of a recording, without waiting for anything, and
+// print how long each frame took.
+static int replay(const char *path, uint32_t width, uint32_t height, const char *hosts[], int count)
+{
+   replay_t          rec;
+   replayframe_t     frame;
+   replaysummary_t   sum;
+   spucommand_t      formula;
+   farm_t            farm;
+   uint32_t         *dest = (uint32_t*)malloc((size_t)width * height * sizeof(uint32_t));
+   uint32_t         *us;
+   uint32_t          n = 0;
+   int               deep = 0;
+
+   if (dest == NULL || replay_open(&rec, path) < 0)
+   {
+      fprintf(stderr, "could not open %s\n", path);
+      return 1;
+   }
+   if (count > 0 && farm_connect(&farm, hosts, count) == 0) return 1;
+
+   us = (uint32_t*)malloc((rec.frames + 1) * sizeof(uint32_t));
+
+   while (n < rec.frames && replay_read(&rec, &frame))
+   {
+      kernel_formula(&formula, NULL);
+      formula.formula = frame.formula;
+      formula.power = frame.power;
+      formula.cre = frame.cre;
+      formula.cim = frame.cim;
+
+      // The farm gets the corners as doubles, the low parts of a view that
+      // needs the double-double kernel would be lost.
+      double mag = kernel_magnitude(formula.formula, frame.x1, frame.y1, frame.x2, frame.y2);
+      double step = fmin(fabs(frame.x2 - frame.x1) / width, fabs(frame.y2 - frame.y1) / height);
+
+      if (kernel_precision(mag, step) > KERNEL_PREC_DOUBLE)
+      {
+         fprintf(stderr, "frame %u is too deep to replay here, it needs the double-double kernel\n", n);
+         deep = 1;
+         break;
+      }
+
+      uint64_t t = farm_now_us();
+      if (count > 0)
+      {
+         if (farm_render(&farm, &formula, dest, width, height, frame.x1, frame.x2, frame.y1, frame.y2) < 0) break;
+      }
+      else
+      {
+         local_render(&formula, dest, width, height, frame.x1, frame.x2, frame.y1, frame.y2);
+      }
+      us[n] = farm_now_us() - t;
+
+      printf("frame %4u %8u us  x %g..%g y %g..%g\n", n, us[n], frame.x1, frame.x2, frame.y1, frame.y2);
+      n++;
+   }
+
+   replay_summary(us, n, &sum);
+   printf("%u frames, %.1f ms total, mean %u us, median %u us, 95%% %u us, max %u us\n",
+          sum.frames, sum.total / 1000.0, sum.mean, sum.median, sum.p95, sum.max);
+
+   if (count > 0) farm_close(&farm);
+   replay_close(&rec);
+   free(us);
+   free(dest);
+
+   return n == 0 || deep;
+}
+
+// -----------------------------------------------------------------------
+// A recording of the right stick held forward, zooming in on the seahorse
+// valley the way MandelBrot::Zoom does it.
+static int path(const char *name, int frames)
+{
+   const float    cx = -0.743643, cy = 0.131825;
+   replay_t       rec;
+   replayframe_t  frame;
+   int            f;
+
+   if (replay_create(&rec, name) < 0) return 1;
+
+   memset(&frame, 0, sizeof(frame));
+   frame.lh = 128;
+   frame.lv = 128;
+   frame.rv = 96;
+   frame.formula = FORMULA_MANDEL;
+   frame.power = 2;
+   frame.x1 = cx - 1.5;
+   frame.x2 = cx + 1.5;
+   frame.y1 = cy - 1.5;
+   frame.y2 = cy + 1.5;
+
+   for (f=0; f<frames; f++)
+   {
+      float p = 1.0 + (frame.rv / 128.0 - 1.0) * 0.05;
+      float dx = (frame.x2 - frame.x1) * (1.0 - p) * 0.5;
+      float dy = (frame.y2 - frame.y1) * (1.0 - p) * 0.5;
+
+      if (replay_write(&rec, &frame) < 0) break;
+
+      frame.x1 += dx;
+      frame.x2 -= dx;
+      frame.y1 += dy;
+      frame.y2 -= dy;
+   }
+
+   return replay_close(&rec) < 0 || f < frames;
+}
+
+// -----------------------------------------------------------------------
+static int profile(uint32_t width, uint32_t height, float x1, float x2, float y1, float y2, const char *out)
+{
+   uint8_t        iter[FARM_TILE_PIXELS];
+   uint32_t      *frame = (uint32_t*)malloc((size_t)width * height * sizeof(uint32_t));
+   uint32_t       tilesx;
+   uint32_t       ntiles = tile_count(width, height, &tilesx);
+   profiletile_t  top[PROFILE_TOP];
+   profile_t      prof;
+   uint32_t       t, i;
+
+   if (frame == NULL || profile_init(&prof, ntiles) < 0) return 1;
+
+   for (t=0; t<ntiles; t++)
+   {
+      spucommand_t command;
+      uint32_t     offset = tile_command(&command, NULL, t, tilesx, width, height, x1, x2, y1, y2);
+      uint32_t     iterations = 0;
+
+      uint64_t start = farm_now_us();
+      kernel_tile(&command, iter);
+      uint32_t us = farm_now_us() - start;
+
+      for (i=0; i<command.width*command.height; i++) iterations += iter[i];
+
+      tile_store(&frame[offset], width, iter, command.width, command.height);
+      profile_add(&prof, offset % width, offset / width, command.width, command.height, us, iterations);
+   }
+
+   profile_heatmap(&prof, frame, width, height, PROFILE_BLEND);
+
+   printf("%u tiles, %.1f ms, %.1f Miterations, %.1f ns/iteration\n", prof.count, prof.ticks / 1000.0,
+          prof.iterations / 1e6, prof.iterations ? prof.ticks * 1000.0 / prof.iterations : 0.0);
+   printf("   x     y      us  iterations  re           im\n");
+
+   uint32_t n = profile_top(&prof, top, PROFILE_TOP);
+   for (i=0; i<n; i++)
+   {
+      printf("%4u  %4u  %6u  %10u  %-11g  %g\n", top[i].x, top[i].y, top[i].ticks, top[i].iterations,
+             x1 + (x2 - x1) * (top[i].x + top[i].w / 2) / width,
+             y1 + (y2 - y1) * (top[i].y + top[i].h / 2) / height);
+   }
+
+   int r = write_ppm(out, frame, width, height) < 0;
+
+   profile_free(&prof);
+   free(frame);
+   return r;
+}
+
+// -----------------------------------------------------------------------
+static long page_faults(void)
+{
+   struct rusage usage;
+
+   getrusage(RUSAGE_SELF, &usage);
+   return usage.ru_minflt + usage.ru_majflt;
+}
+
+// -----------------------------------------------------------------------
+// The buffers of an animation, from malloc every frame and from an arena.
+// Every frame colours a rendered frame with its histogram into one
+// buffer and keeps the iteration counts in another, a pass over a lot of
+// memory; the time, the page faults and the data TLB misses of both ways
+// are printed.
+static int arena_bench(uint32_t width, uint32_t height, int frames)
+{
+   size_t         n = (size_t)width * height;
+   uint32_t      *src = (uint32_t*)malloc(n * sizeof(uint32_t));
+   uint32_t       hist[PALETTE_SIZE];
+   uint32_t       palette[PALETTE_SIZE];
+   arena_t        arena;
+   arenastats_t   stats;
+   int            tlb = arena_tlb_open();
+   int            pass, f;
+   size_t         i;
+
+   if (src == NULL || arena_create(&arena, n * (sizeof(uint32_t) + 1)) < 0) return 1;
+
+   local_render(NULL, src, width, height, -2.0, 1.0, -1.5, 1.5);
+
+   printf("%ux%u, %d frames%s\n", width, height, frames, tlb < 0 ? ", no TLB counter here" : "");
+   for (pass=0; pass<2; pass++)
+   {
+      uint64_t  t = farm_now_ms();
+      uint64_t  misses = arena_tlb_read(tlb);
+      long      faults = page_faults();
+
+      for (f=0; f<frames; f++)
+      {
+         arenamark_t  mark = arena_mark(&arena);
+         uint32_t    *out;
+         uint8_t     *iter;
+
+         if (pass == 0)
+         {
+            out = (uint32_t*)malloc(n * sizeof(uint32_t));
+            iter = (uint8_t*)malloc(n);
+         }
+         else
+         {
+            out = (uint32_t*)arena_alloc(&arena, n * sizeof(uint32_t), 0);
+            iter = (uint8_t*)arena_alloc(&arena, n, 0);
+         }
+         if (out == NULL || iter == NULL) return 1;
+
+         memset(hist, 0, sizeof(hist));
+         palette_count(hist, src, n);
+         palette_equalise(hist, palette);
+         palette_apply(palette, src, out, n);
+         for (i=0; i<n; i++) iter[i] = src[i] & 0xff;
+
+         if (pass == 0)
+         {
+            free(iter);
+            free(out);
+         }
+         else
+         {
+            arena_reset(&arena, mark);
+         }
+      }
+
+      printf("%-7s %7.2f ms/frame %8ld page faults/frame", pass ? "arena" : "malloc",
+             (double)(farm_now_ms() - t) / frames, (page_faults() - faults) / frames);
+      if (tlb >= 0)
+      {
+         printf(" %10llu dTLB misses/frame", (unsigned long long)((arena_tlb_read(tlb) - misses) / frames));
+      }
+      printf("\n");
+   }
+
+   arena_stats(&arena, &stats);
+   printf("arena: %zu kB in %u regions, peak %zu kB, %zu kB in huge pages, %u pages, %u allocations, %u resets\n",
+          stats.reserved / 1024, stats.regions, stats.peak / 1024, stats.hugebytes / 1024,
+          stats.pages, stats.allocs, stats.resets);
+
+   arena_tlb_close(tlb);
+   arena_destroy(&arena);
+   free(src);
+   return 0;
+}
+
+// -----------------------------------------------------------------------
+// Buddhabrot on @n local processes: each samples into its own image in
+// shared memory, then each adds up a band of all of them into @dest.
+// Returns the sampling time in ms, the merge time goes to @merge.
+static uint64_t buddha_run(const buddhaplan_t *plan, int n, uint32_t samples, uint32_t **density,
+                           uint32_t *dest, uint64_t *counts, uint64_t *merge)
+{
+   uint32_t pixels = plan->width * plan->height;
+   pid_t    pid[FARM_MAX_WORKERS];
+   int      i, phase;
+   uint64_t ms[2];
+
+   for (phase=0; phase<2; phase++)
+   {
+      uint64_t t = farm_now_ms();
+
+      for (i=0; i<n; i++)
+      {
+         pid[i] = fork();
+         if (pid[i] != 0) continue;
+
+         if (phase == 0)
+         {
+            buddhabuf_t buf;
+
+            if (buddha_init(&buf, plan, density[i], i) < 0) _exit(1);
+            buddha_sample(plan, &buf, samples / n);
+            counts[3*i] = buf.samples;
+            counts[3*i+1] = buf.orbits;
+            counts[3*i+2] = buf.splats;
+            buddha_free(&buf);
+         }
+         else
+         {
+            uint32_t band = (pixels + n - 1) / n;
+            uint32_t first = band * i;
+
+            if (first < pixels) buddha_merge(dest, density, n, first, first + band > pixels ? pixels - first : band);
+         }
+         _exit(0);
+      }
+
+      for (i=0; i<n; i++)
+      {
+         if (pid[i] > 0) waitpid(pid[i], NULL, 0);
+      }
+      ms[phase] = farm_now_ms() - t;
+   }
+
+   *merge = ms[1];
+   return ms[0];
+}
+
+// -----------------------------------------------------------------------
+// Samples per second on 1 to @workers processes, with importance sampling
+// and then without; the image of the last run with importance goes to @out.
+static int buddha(uint32_t width, uint32_t height, int workers, uint32_t millions, const char *out)
+{
+   uint32_t       pixels = width * height;
+   uint32_t       samples = millions * 1000000;
+   size_t         bytes = ((size_t)(workers + 1) * pixels + 3 * FARM_MAX_WORKERS * 2) * sizeof(uint32_t);
+   uint32_t      *map;
+   uint32_t      *density[FARM_MAX_WORKERS];
+   uint64_t      *counts;
+   uint32_t      *image;
+   buddhaplan_t   plan;
+   double         single = 0;
+   int            n, i, pass;
+
+   if (workers < 1 || workers > FARM_MAX_WORKERS || samples == 0) return 1;
+
+   map = (uint32_t*)mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   if (map == MAP_FAILED) return 1;
+
+   for (i=0; i<workers; i++) density[i] = &map[(size_t)i * pixels];
+   image = &map[(size_t)workers * pixels];
+   counts = (uint64_t*)&map[(size_t)(workers + 1) * pixels];
+
+   for (pass=1; pass>=0; pass--)
+   {
+      uint64_t t = farm_now_ms();
+      buddha_plan(&plan, NULL, width, height, -2.0, 1.0, -1.5, 1.5, BUDDHA_MAX_ITER, pass);
+      printf("%s, planned in %u ms\n", pass ? "importance sampling" : "uniform sampling",
+             (unsigned)(farm_now_ms() - t));
+      printf("workers  Msamples/s  speedup  escaped  Msplats/s  merge ms\n");
+
+      for (n=1; n<=workers; n++)
+      {
+         uint64_t merge;
+         uint64_t ms = buddha_run(&plan, n, samples, density, image, counts, &merge);
+         uint64_t sum[3] = { 0, 0, 0 };
+
+         for (i=0; i<3*n; i++) sum[i % 3] += counts[i];
+
+         double rate = ms ? sum[0] / (ms * 1000.0) : 0.0;
+         if (n == 1) single = rate;
+
+         printf("%7d  %10.2f  %7.2f  %6.1f%%  %9.2f  %8u\n", n, rate, single > 0 ? rate / single : 0.0,
+                sum[0] ? 100.0 * sum[1] / sum[0] : 0.0, ms ? sum[2] / (ms * 1000.0) : 0.0, (unsigned)merge);
+      }
+
+      if (pass)
+      {
+         uint32_t *frame = (uint32_t*)malloc(pixels * sizeof(uint32_t));
+
+         if (frame == NULL) return 1;
+         buddha_image(image, frame, pixels);
+         if (write_ppm(out, frame, width, height) < 0) return 1;
+         free(frame);
+      }
+   }
+
+   munmap(map, bytes);
+   return 0;
+}
+
+// -----------------------------------------------------------------------
+// Fork @n processes that each do their share of the tiles of every frame,
+// encoding (@decode 0) or decoding. Returns the ms it took.
+static uint64_t iterfile_run(iterfile_t *files, int frames, int n, int decode,
+                             uint16_t *counts, uint32_t pixels)
+{
+   pid_t    pid[FARM_MAX_WORKERS];
+   uint64_t t = farm_now_ms();
+   int      i, f;
+
+   for (i=0; i<n; i++)
+   {
+      pid[i] = fork();
+      if (pid[i] != 0) continue;
+
+      for (f=0; f<frames; f++)
+      {
+         uint32_t band = (files[f].tiles + n - 1) / n;
+
+         if (decode)
+         {
+            if (iterfile_decode(&files[f], &counts[(size_t)f * pixels], band * i, band) < 0) _exit(1);
+         }
+         else
+         {
+            iterfile_encode(&files[f], &counts[(size_t)f * pixels], band * i, band);
+         }
+      }
+      _exit(0);
+   }
+
+   for (i=0; i<n; i++)
+   {
+      if (pid[i] > 0) waitpid(pid[i], NULL, 0);
+   }
+   return farm_now_ms() - t;
+}
+
+// -----------------------------------------------------------------------
+// A zoom of @frames frames coded as iterfile images on 1 to @workers
+// processes and decoded again: the size against raw frames, and the frame
+// rates both ways, which have to stay above 30 to keep up with a live
+// view. The last frame goes to @out.
+static int iterfile_bench(uint32_t width, uint32_t height, int workers, int frames, const char *out)
+{
+   uint32_t     pixels = width * height;
+   iterinfo_t   info;
+   iterfile_t   enc[64];
+   iterfile_t   dec[64];
+   uint8_t     *packed[64];
+   size_t       slots, bytes, total = 0;
+   uint16_t    *counts, *decoded;
+   uint8_t     *map;
+   uint32_t    *frame = (uint32_t*)malloc(pixels * sizeof(uint32_t));
+   int          n, i, f;
+   int          failed = 0;
+
+   if (workers < 1 || workers > FARM_MAX_WORKERS || frames < 1 || frames > 64 || frame == NULL) return 1;
+
+   iterfile_info(&info, NULL, width, height, 0, 0, 0, 0);
+   slots = iterfile_slots(&info);
+   bytes = (size_t)frames * (2 * pixels * sizeof(uint16_t) + slots);
+
+   map = (uint8_t*)mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   if (map == MAP_FAILED) return 1;
+
+   counts = (uint16_t*)map;
+   decoded = &counts[(size_t)frames * pixels];
+
+   // A zoom into the seahorse valley, a little deeper every frame.
+   for (f=0; f<frames; f++)
+   {
+      float size = 3.0f * powf(0.8f, f);
+      float x1 = -0.7436f - size / 2, x2 = -0.7436f + size / 2;
+      float y1 = 0.1318f - size * height / width / 2, y2 = 0.1318f + size * height / width / 2;
+
+      local_render(NULL, frame, width, height, x1, x2, y1, y2);
+      for (i=0; i<(int)pixels; i++) counts[(size_t)f * pixels + i] = frame[i] & 0xff;
+
+      iterfile_info(&info, NULL, width, height, x1, x2, y1, y2);
+      iterfile_init(&enc[f], &info, (uint8_t*)&decoded[(size_t)frames * pixels] + (size_t)f * slots);
+   }
+   free(frame);
+
+   printf("workers  encode fps  decode fps\n");
+   for (n=1; n<=workers; n++)
+   {
+      uint64_t tenc = iterfile_run(enc, frames, n, 0, counts, pixels);
+      uint64_t t = farm_now_ms();
+
+      total = 0;
+      for (f=0; f<frames; f++)
+      {
+         packed[f] = (uint8_t*)malloc(iterfile_size(&enc[f]));
+         if (packed[f] == NULL) return 1;
+         total += iterfile_pack(&enc[f], packed[f]);
+         if (iterfile_open(&dec[f], packed[f], iterfile_size(&enc[f])) < 0) failed = 1;
+      }
+      tenc += farm_now_ms() - t;
+
+      memset(decoded, 0, (size_t)frames * pixels * sizeof(uint16_t));
+      uint64_t tdec = iterfile_run(dec, frames, n, 1, decoded, pixels);
+
+      if (memcmp(counts, decoded, (size_t)frames * pixels * sizeof(uint16_t)) != 0) failed = 1;
+
+      printf("%7d  %10.1f  %10.1f\n", n, tenc ? frames * 1000.0 / tenc : 0.0,
+             tdec ? frames * 1000.0 / tdec : 0.0);
+
+      for (f=0; f<frames; f++)
+      {
+         iterfile_free(&dec[f]);
+         free(packed[f]);
+      }
+   }
+
+   // Any single tile, without the others.
+   uint64_t t = farm_now_ms();
+   size_t   size = iterfile_size(&enc[0]);
+   uint8_t *one = (uint8_t*)malloc(size);
+
+   if (one == NULL) return 1;
+   iterfile_pack(&enc[0], one);
+   iterfile_open(&dec[0], one, size);
+   for (i=0; i<(int)dec[0].tiles; i++)
+   {
+      if (iterfile_decode(&dec[0], decoded, dec[0].tiles - 1 - i, 1) < 0) failed = 1;
+   }
+   t = farm_now_ms() - t;
+   iterfile_free(&dec[0]);
+   free(one);
+
+   printf("%ux%u: %.0f KB a frame, %.1f:1 against 32 bit pixels, %.1f:1 against 16 bit counts\n",
+          width, height, total / 1024.0 / frames, 4.0 * pixels * frames / total,
+          2.0 * pixels * frames / total);
+   printf("one tile at a time: %.1f us a tile\n", 1000.0 * t / enc[0].tiles);
+   printf("round trip %s\n", failed ? "FAILED" : "exact");
+
+   if (out != NULL && iterfile_save(&enc[frames - 1], out) < 0) failed = 1;
+
+   for (f=0; f<frames; f++) iterfile_free(&enc[f]);
+   munmap(map, bytes);
+   return failed;
+}
+
+// -----------------------------------------------------------------------
+int main(int argc, const char* argv[])
+{
+   if (argc >= 2 && strcmp(argv[1], "worker") == 0)
+   {
+      if (argc > 3 && topo_pin(0, atoi(argv[3])) < 0) return 1;
+
+      int fd = farm_listen(argc > 2 ? atoi(argv[2]) : FARM_PORT);
+      if (fd < 0) return 1;
+      return farm_serve(fd) < 0;
+   }
+
+   if (argc >= 10 && strcmp(argv[1], "render") == 0)
+   {
+      uint32_t  width = atoi(argv[2]);
+      uint32_t  height = atoi(argv[3]);
+      uint32_t *frame = (uint32_t*)malloc((size_t)width * height * sizeof(uint32_t));
+      farm_t    farm;
+
+      if (frame == NULL || farm_connect(&farm, &argv[9], argc - 9) == 0) return 1;
+
+      uint64_t t = farm_now_ms();
+      int r = farm_render(&farm, NULL, frame, width, height,
+                          atof(argv[4]), atof(argv[5]), atof(argv[6]), atof(argv[7]));
+      printf("%u ms, %d of %d workers alive, %u tiles redispatched\n",
+             (unsigned)(farm_now_ms() - t), farm.alive, farm.count, farm.redispatched);
+      farm_close(&farm);
+
+      if (r < 0 || write_ppm(argv[8], frame, width, height) < 0) return 1;
+      free(frame);
+      return 0;
+   }
+
+   if (argc >= 10 && strcmp(argv[1], "cached") == 0)
+   {
+      uint32_t     width = atoi(argv[3]);
+      uint32_t     height = atoi(argv[4]);
+      uint32_t    *frame = (uint32_t*)malloc((size_t)width * height * sizeof(uint32_t));
+      tilecache_t  cache;
+      farm_t       farm;
+
+      if (frame == NULL || tilecache_open(&cache, argv[2], 65536) < 0) return 1;
+      if (argc > 10 && farm_connect(&farm, &argv[10], argc - 10) == 0) return 1;
+
+      uint64_t t = farm_now_ms();
+      int r = tilecache_render(&cache, NULL, frame, width, height,
+                               atof(argv[5]), atof(argv[6]), atof(argv[7]), atof(argv[8]),
+                               argc > 10 ? farm_compute : local_compute, &farm);
+      printf("%u ms, %u tiles from the cache, %u calculated, %u evicted\n",
+             (unsigned)(farm_now_ms() - t), cache.hits, cache.misses, cache.evictions);
+
+      if (argc > 10) farm_close(&farm);
+      tilecache_close(&cache);
+
+      if (r < 0 || write_ppm(argv[9], frame, width, height) < 0) return 1;
+      free(frame);
+      return 0;
+   }
+
+   if (argc >= 2 && strcmp(argv[1], "bench") == 0)
+   {
+      return bench(argc > 2 ? atoi(argv[2]) : 10);
+   }
+
+   if (argc >= 3 && strcmp(argv[1], "histogram") == 0)
+   {
+      return histogram_bench(atoi(argv[2]), argc > 3 ? atoi(argv[3]) : 10);
+   }
+
+   if (argc >= 3 && strcmp(argv[1], "loopback") == 0)
+   {
+      int policy = -1;
+      int i;
+
+      for (i=0; argc > 4 && i<TOPO_POLICIES; i++)
+      {
+         if (strcmp(argv[4], topo_policy_name(i)) == 0) policy = i;
+      }
+      return loopback(atoi(argv[2]), argc > 3 ? atoi(argv[3]) : 10, policy);
+   }
+
+   if (argc >= 3 && strcmp(argv[1], "sessions") == 0)
+   {
+      return sessions(atoi(argv[2]), argc > 3 ? atoi(argv[3]) : 20);
+   }
+
+   if (argc >= 6 && strcmp(argv[1], "stream") == 0)
+   {
+      return stream(argv[2], atoi(argv[3]), atoi(argv[4]), atoi(argv[5]), &argv[6], argc - 6);
+   }
+
+   if (argc >= 3 && strcmp(argv[1], "replay") == 0)
+   {
+      int sized = argc >= 5;
+      return replay(argv[2], sized ? atoi(argv[3]) : 720, sized ? atoi(argv[4]) : 480,
+                    &argv[sized ? 5 : 3], argc - (sized ? 5 : 3));
+   }
+
+   if (argc >= 9 && strcmp(argv[1], "profile") == 0)
+   {
+      return profile(atoi(argv[2]), atoi(argv[3]), atof(argv[4]), atof(argv[5]),
+                     atof(argv[6]), atof(argv[7]), argv[8]);
+   }
+
+   if (argc >= 2 && strcmp(argv[1], "arena") == 0)
+   {
+      int sized = argc >= 4;
+      return arena_bench(sized ? atoi(argv[2]) : 3840, sized ? atoi(argv[3]) : 2160,
+                         argc > 4 ? atoi(argv[4]) : 20);
+   }
+
+   if (argc >= 7 && strcmp(argv[1], "buddha") == 0)
+   {
+      return buddha(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]), atoi(argv[5]), argv[6]);
+   }
+
+   if (argc >= 5 && strcmp(argv[1], "iterfile") == 0)
+   {
+      return iterfile_bench(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]), argc > 5 ? atoi(argv[5]) : 10,
+                            argc > 6 ? argv[6] : NULL);
+   }
+
+   if (argc >= 3 && strcmp(argv[1], "path") == 0)
+   {
+      return path(argv[2], argc > 3 ? atoi(argv[3]) : 100);
+   }
+
+   if (argc >= 3 && strcmp(argv[1], "view") == 0)
+   {
+      return view(argv[2], argc > 3 ? atoi(argv[3]) : 10, argc > 4 ? argv[4] : NULL);
+   }
+
+   fprintf(stderr, "usage: %s worker [port [cpu]]\n"
+                   "       %s render <width> <height> <x1> <x2> <y1> <y2> <out.ppm> <host[:port]>...\n"
+                   "       %s cached <cache> <width> <height> <x1> <x2> <y1> <y2> <out.ppm> [host[:port]]...\n"
+                   "       %s loopback <workers> [frames] [none|compact|spread]\n"
+                   "       %s sessions <workers> [frames]\n"
+                   "       %s bench [frames]\n"
+                   "       %s histogram <workers> [frames]\n"
+                   "       %s stream <name> <width> <height> <frames> [host[:port]]...\n"
+                   "       %s view <name> [seconds] [out.ppm]\n"
+                   "       %s replay <recording> [width height] [host[:port]]...\n"
+                   "       %s path <recording> [frames]\n"
+                   "       %s profile <width> <height> <x1> <x2> <y1> <y2> <heat.ppm>\n"
+                   "       %s arena [width height [frames]]\n"
+                   "       %s buddha <width> <height> <workers> <Msamples> <out.ppm>\n"
+                   "       %s iterfile <width> <height> <workers> [frames] [out.itf]\n",
+                   argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0],
+                   argv[0], argv[0], argv[0], argv[0], argv[0]);
+   return 1;
+}
+#endif
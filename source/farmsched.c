@@ -0,0 +1,144 @@
+/*
+ * Fair sharing of one pool of workers by several sessions, see farmsched.h.
+ * The charge for a tile is made when it is handed out, with the running
+ * average of the session, so a session can't take all the workers before
+ * any of its tiles is back; it is put right when the real cost is known.
+ */
+
+#include <string.h>
+
+#include "farmsched.h"
+
+// -----------------------------------------------------------------------
+void sched_init(sched_t *sched, int mode, uint32_t lag)
+{
+   memset(sched, 0, sizeof(sched_t));
+   sched->mode = mode;
+   sched->lag = (int64_t)lag * FARM_SCHED_SCALE;
+}
+
+// -----------------------------------------------------------------------
+int sched_add(sched_t *sched, uint32_t weight)
+{
+   schedsession_t *session;
+
+   if (sched->count == FARM_SCHED_MAX_SESSIONS) return -1;
+
+   session = &sched->session[sched->count];
+   memset(session, 0, sizeof(schedsession_t));
+   session->weight = weight ? weight : 1;
+   session->cost = FARM_SCHED_COST;
+
+   return sched->count++;
+}
+
+// -----------------------------------------------------------------------
+// Lowest virtual time of the sessions that have work, or @fallback.
+static int64_t min_vtime(const sched_t *sched, int64_t fallback)
+{
+   int64_t  v = fallback;
+   int      found = 0;
+   uint32_t i;
+
+   for (i=0; i<sched->count; i++)
+   {
+      const schedsession_t *s = &sched->session[i];
+
+      if (s->pending == 0 && s->busy == 0) continue;
+      if (!found || s->vtime < v) v = s->vtime;
+      found = 1;
+   }
+
+   return v;
+}
+
+// -----------------------------------------------------------------------
+void sched_frame(sched_t *sched, int s, uint32_t tiles, uint64_t now, uint64_t deadline)
+{
+   schedsession_t *session = &sched->session[s];
+
+   if (session->busy == 0)
+   {
+      int64_t v = min_vtime(sched, session->vtime);
+      if (v > session->vtime) session->vtime = v;
+   }
+
+   session->pending = tiles;
+   session->start = now;
+   session->deadline = deadline;
+}
+
+// -----------------------------------------------------------------------
+int sched_next(const sched_t *sched)
+{
+   int64_t  floor = 0;
+   int      best = -1;
+   int      found = 0;
+   uint32_t i;
+
+   for (i=0; i<sched->count; i++)
+   {
+      const schedsession_t *s = &sched->session[i];
+
+      if (s->pending == 0) continue;
+      if (!found || s->vtime < floor) floor = s->vtime;
+      found = 1;
+   }
+
+   for (i=0; i<sched->count; i++)
+   {
+      const schedsession_t *s = &sched->session[i];
+      const schedsession_t *b = best < 0 ? NULL : &sched->session[best];
+
+      if (s->pending == 0) continue;
+
+      if (sched->mode == FARM_SCHED_FIFO)
+      {
+         if (b == NULL || s->start < b->start) best = i;
+         continue;
+      }
+
+      if (s->vtime > floor + sched->lag) continue;
+
+      // Earliest deadline first, no deadline is last; then fair share.
+      if (b == NULL ||
+          (s->deadline && (!b->deadline || s->deadline < b->deadline)) ||
+          (s->deadline == b->deadline && s->vtime < b->vtime))
+      {
+         best = i;
+      }
+   }
+
+   return best;
+}
+
+// -----------------------------------------------------------------------
+void sched_sent(sched_t *sched, int s)
+{
+   schedsession_t *session = &sched->session[s];
+
+   session->pending--;
+   session->busy++;
+   session->vtime += (int64_t)session->cost * FARM_SCHED_SCALE / session->weight;
+}
+
+// -----------------------------------------------------------------------
+void sched_done(sched_t *sched, int s, uint32_t cost)
+{
+   schedsession_t *session = &sched->session[s];
+
+   session->busy--;
+   session->vtime += ((int64_t)cost - session->cost) * FARM_SCHED_SCALE / session->weight;
+   session->cost = (7 * session->cost + cost) / 8;
+   session->work += cost;
+}
+
+// -----------------------------------------------------------------------
+void sched_requeue(sched_t *sched, int s)
+{
+   schedsession_t *session = &sched->session[s];
+
+   session->busy--;
+   session->pending++;
+   session->vtime -= (int64_t)session->cost * FARM_SCHED_SCALE / session->weight;
+}
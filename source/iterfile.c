@@ -0,0 +1,547 @@
+/*
+ * Iteration counts in a file or on the wire, for colouring them again
+ * later, caching them or shipping them to another machine. Counts are
+ * 16 bit, in tiles of 64x64 that are coded on their own. Every row of a
+ * tile is predicted from its left neighbours or from the row above,
+ * whichever leaves fewer differences, and what is left is mostly zeros:
+ * a byte holds a run of zeros and the small difference that ends it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "iterfile.h"
+#include "kernel.h"
+
+#define RUN_LONG     (15)     /* Token run nibble: 15 or more, the rest follows */
+#define LITERAL_LONG (0)      /* Token literal nibble: the difference follows */
+#define TOKEN_MAX    (7)      /* Token byte, and two varints of 3 bytes */
+
+// -----------------------------------------------------------------------
+static void put32(uint8_t *p, uint32_t v)
+{
+   p[0] = v >> 24;
+   p[1] = v >> 16;
+   p[2] = v >> 8;
+   p[3] = v;
+}
+
+// -----------------------------------------------------------------------
+static uint32_t get32(const uint8_t *p)
+{
+   return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// -----------------------------------------------------------------------
+static void putf(uint8_t *p, float f)
+{
+   uint32_t v;
+
+   memcpy(&v, &f, sizeof(v));
+   put32(p, v);
+}
+
+// -----------------------------------------------------------------------
+static float getf(const uint8_t *p)
+{
+   uint32_t v = get32(p);
+   float    f;
+
+   memcpy(&f, &v, sizeof(f));
+   return f;
+}
+
+// -----------------------------------------------------------------------
+static uint8_t* put_varint(uint8_t *p, uint32_t v)
+{
+   while (v >= 0x80)
+   {
+      *p++ = v | 0x80;
+      v >>= 7;
+   }
+   *p++ = v;
+   return p;
+}
+
+// -----------------------------------------------------------------------
+static const uint8_t* get_varint(const uint8_t *p, const uint8_t *end, uint32_t *v)
+{
+   uint32_t shift = 0;
+
+   *v = 0;
+   while (p < end && shift < 21)
+   {
+      *v |= (uint32_t)(*p & 0x7f) << shift;
+      if (!(*p++ & 0x80)) return p;
+      shift += 7;
+   }
+
+   return NULL;
+}
+
+// -----------------------------------------------------------------------
+// Differences are taken modulo 2^16, small ones of either sign become
+// small numbers: 0, -1, 1, -2, ... is 0, 1, 2, 3, ...
+static uint32_t zigzag(uint16_t d)
+{
+   return (uint16_t)(d << 1) ^ (d & 0x8000 ? 0xffff : 0);
+}
+
+// -----------------------------------------------------------------------
+static uint16_t unzigzag(uint32_t z)
+{
+   return (uint16_t)((z >> 1) ^ -(z & 1));
+}
+
+// -----------------------------------------------------------------------
+void iterfile_info(iterinfo_t *info, const spucommand_t *formula, uint32_t width, uint32_t height,
+                   float x1, float x2, float y1, float y2)
+{
+   spucommand_t command;
+
+   kernel_formula(&command, formula);
+
+   memset(info, 0, sizeof(iterinfo_t));
+   info->width = width;
+   info->height = height;
+   info->maxiter = KERNEL_MAX_ITER;
+   info->formula = command.formula;
+   info->power = command.power;
+   info->cre = command.cre;
+   info->cim = command.cim;
+   info->x1 = x1;
+   info->x2 = x2;
+   info->y1 = y1;
+   info->y2 = y2;
+}
+
+// -----------------------------------------------------------------------
+// Prediction of count @i of a row, from the left or from above.
+static inline uint16_t predict(const uint16_t *row, const uint16_t *above, uint32_t i, int up)
+{
+   if (up) return above[i];
+   if (i > 0) return row[i - 1];
+   return above ? above[0] : 0;
+}
+
+// -----------------------------------------------------------------------
+uint32_t iterfile_encode_tile(const uint16_t *counts, uint32_t stride, uint32_t width, uint32_t height,
+                              uint8_t *out)
+{
+   uint32_t  rowbytes = (height + 7) / 8;
+   uint8_t  *p = out + 1 + rowbytes;
+   uint8_t  *end = out + 1 + 2 * width * height;
+   uint32_t  run = 0;
+   uint32_t  i, j;
+
+   out[0] = ITERFILE_PREDICTED;
+   memset(&out[1], 0, rowbytes);
+
+   for (j=0; j<height && p!=NULL; j++)
+   {
+      const uint16_t *row = &counts[j * stride];
+      const uint16_t *above = j > 0 ? row - stride : NULL;
+      int             up = 0;
+
+      // Above wins the row if it leaves fewer differences.
+      if (above)
+      {
+         uint32_t left = 0, vertical = 0;
+
+         for (i=0; i<width; i++)
+         {
+            left += row[i] != predict(row, above, i, 0);
+            vertical += row[i] != above[i];
+         }
+         up = vertical < left;
+         if (up) out[1 + j / 8] |= 1 << (j % 8);
+      }
+
+      for (i=0; i<width; i++)
+      {
+         uint16_t d = row[i] - predict(row, above, i, up);
+         uint32_t z;
+
+         if (d == 0)
+         {
+            run++;
+            continue;
+         }
+         if (p + TOKEN_MAX > end)
+         {
+            p = NULL;
+            break;
+         }
+
+         z = zigzag(d);
+         *p++ = (run < RUN_LONG ? run : RUN_LONG) << 4 | (z < 16 ? z : LITERAL_LONG);
+         if (run >= RUN_LONG) p = put_varint(p, run - RUN_LONG);
+         if (z >= 16) p = put_varint(p, z);
+         run = 0;
+      }
+   }
+
+   // The zeros at the end, without a difference after them.
+   if (p != NULL && run > 0)
+   {
+      if (p + TOKEN_MAX > end) p = NULL;
+      else
+      {
+         *p++ = (run < RUN_LONG ? run : RUN_LONG) << 4;
+         if (run >= RUN_LONG) p = put_varint(p, run - RUN_LONG);
+      }
+   }
+   if (p != NULL) return p - out;
+
+   // Noise, the counts as they are.
+   out[0] = ITERFILE_RAW;
+   p = out + 1;
+   for (j=0; j<height; j++)
+   {
+      for (i=0; i<width; i++)
+      {
+         *p++ = counts[j * stride + i] >> 8;
+         *p++ = counts[j * stride + i];
+      }
+   }
+
+   return p - out;
+}
+
+// -----------------------------------------------------------------------
+int iterfile_decode_tile(const uint8_t *in, uint32_t len, uint16_t *counts, uint32_t stride,
+                         uint32_t width, uint32_t height)
+{
+   const uint8_t *end = in + len;
+   const uint8_t *p;
+   const uint8_t *rows;
+   uint32_t       n = width * height;
+   uint32_t       run = 0;
+   uint32_t       z = 0;
+   uint32_t       i, j, k;
+
+   if (len < 1) return -1;
+
+   if (in[0] == ITERFILE_RAW)
+   {
+      if (len != 1 + 2 * n) return -1;
+
+      p = in + 1;
+      for (j=0; j<height; j++)
+      {
+         for (i=0; i<width; i++, p+=2) counts[j * stride + i] = (p[0] << 8) | p[1];
+      }
+      return 0;
+   }
+
+   rows = in + 1;
+   p = rows + (height + 7) / 8;
+   if (in[0] != ITERFILE_PREDICTED || p > end) return -1;
+
+   // @run zeros to go, then the difference @z unless it is the end.
+   for (j=0, k=0; j<height; j++)
+   {
+      uint16_t       *row = &counts[j * stride];
+      const uint16_t *above = j > 0 ? row - stride : NULL;
+      int             up = above && (rows[j / 8] & (1 << (j % 8)));
+
+      for (i=0; i<width; i++, k++)
+      {
+         uint16_t d = 0;
+
+         if (run == 0 && z == 0)
+         {
+            if (p >= end) return -1;
+
+            run = *p >> 4;
+            z = *p++ & 15;
+            if (run == RUN_LONG)
+            {
+               uint32_t more;
+
+               if ((p = get_varint(p, end, &more)) == NULL) return -1;
+               run += more;
+            }
+            if (run > n - k) return -1;
+            if (z == LITERAL_LONG && k + run < n)
+            {
+               if ((p = get_varint(p, end, &z)) == NULL || z == 0) return -1;
+            }
+         }
+
+         if (run > 0) run--;
+         else
+         {
+            d = unzigzag(z);
+            z = 0;
+         }
+
+         row[i] = predict(row, above, i, up) + d;
+      }
+   }
+
+   return p == end && run == 0 && z == 0 ? 0 : -1;
+}
+
+// -----------------------------------------------------------------------
+static void tile_rect(const iterfile_t *file, uint32_t t, uint32_t *x, uint32_t *y, uint32_t *w, uint32_t *h)
+{
+   *x = (t % file->tilesx) * ITERFILE_TILE;
+   *y = (t / file->tilesx) * ITERFILE_TILE;
+   *w = file->info.width - *x < ITERFILE_TILE ? file->info.width - *x : ITERFILE_TILE;
+   *h = file->info.height - *y < ITERFILE_TILE ? file->info.height - *y : ITERFILE_TILE;
+}
+
+// -----------------------------------------------------------------------
+static void tile_layout(iterfile_t *file)
+{
+   file->tilesx = (file->info.width + ITERFILE_TILE - 1) / ITERFILE_TILE;
+   file->tiles = file->tilesx * ((file->info.height + ITERFILE_TILE - 1) / ITERFILE_TILE);
+}
+
+// -----------------------------------------------------------------------
+size_t iterfile_slots(const iterinfo_t *info)
+{
+   size_t tiles = ((info->width + ITERFILE_TILE - 1) / ITERFILE_TILE) *
+                  ((info->height + ITERFILE_TILE - 1) / ITERFILE_TILE);
+
+   return tiles * ITERFILE_SLOT;
+}
+
+// -----------------------------------------------------------------------
+int iterfile_init(iterfile_t *file, const iterinfo_t *info, uint8_t *slots)
+{
+   memset(file, 0, sizeof(iterfile_t));
+   file->info = *info;
+   tile_layout(file);
+
+   if (slots == NULL)
+   {
+      slots = (uint8_t*)malloc(iterfile_slots(info));
+      if (slots == NULL) return -1;
+      file->ownslots = 1;
+   }
+
+   file->slots = slots;
+   return 0;
+}
+
+// -----------------------------------------------------------------------
+// A slot is the length of the tile, then the tile.
+void iterfile_encode(iterfile_t *file, const uint16_t *counts, uint32_t first, uint32_t count)
+{
+   uint32_t t;
+
+   for (t=first; t<first+count && t<file->tiles; t++)
+   {
+      uint8_t  *slot = &file->slots[(size_t)t * ITERFILE_SLOT];
+      uint32_t  x, y, w, h;
+      uint32_t  len;
+
+      tile_rect(file, t, &x, &y, &w, &h);
+      len = iterfile_encode_tile(&counts[y * file->info.width + x], file->info.width, w, h, slot + 4);
+      memcpy(slot, &len, sizeof(len));
+   }
+}
+
+// -----------------------------------------------------------------------
+static uint32_t slot_length(const iterfile_t *file, uint32_t t)
+{
+   uint32_t len;
+
+   memcpy(&len, &file->slots[(size_t)t * ITERFILE_SLOT], sizeof(len));
+   return len;
+}
+
+// -----------------------------------------------------------------------
+size_t iterfile_size(const iterfile_t *file)
+{
+   size_t   size = ITERFILE_HEADER + 4 * file->tiles;
+   uint32_t t;
+
+   for (t=0; t<file->tiles; t++) size += slot_length(file, t);
+   return size;
+}
+
+// -----------------------------------------------------------------------
+size_t iterfile_pack(const iterfile_t *file, uint8_t *out)
+{
+   const iterinfo_t *info = &file->info;
+   uint8_t          *index = out + ITERFILE_HEADER;
+   uint8_t          *data = index + 4 * file->tiles;
+   uint32_t          used = 0;
+   uint32_t          t;
+
+   for (t=0; t<file->tiles; t++)
+   {
+      uint32_t len = slot_length(file, t);
+
+      memcpy(&data[used], &file->slots[(size_t)t * ITERFILE_SLOT + 4], len);
+      used += len;
+      put32(&index[4 * t], used);
+   }
+
+   memset(out, 0, ITERFILE_HEADER);
+   put32(&out[0], ITERFILE_MAGIC);
+   put32(&out[4], ITERFILE_VERSION);
+   put32(&out[8], info->width);
+   put32(&out[12], info->height);
+   put32(&out[16], ITERFILE_TILE);
+   put32(&out[20], info->maxiter);
+   put32(&out[24], info->formula);
+   put32(&out[28], info->power);
+   putf(&out[32], info->cre);
+   putf(&out[36], info->cim);
+   putf(&out[40], info->x1);
+   putf(&out[44], info->x2);
+   putf(&out[48], info->y1);
+   putf(&out[52], info->y2);
+   put32(&out[56], used);
+
+   return data + used - out;
+}
+
+// -----------------------------------------------------------------------
+int iterfile_open(iterfile_t *file, const uint8_t *data, size_t size)
+{
+   iterinfo_t *info = &file->info;
+   uint32_t    used;
+   uint32_t    t;
+
+   memset(file, 0, sizeof(iterfile_t));
+
+   if (size < ITERFILE_HEADER || get32(&data[0]) != ITERFILE_MAGIC ||
+       get32(&data[4]) != ITERFILE_VERSION || get32(&data[16]) != ITERFILE_TILE)
+   {
+      return -1;
+   }
+
+   info->width = get32(&data[8]);
+   info->height = get32(&data[12]);
+   info->maxiter = get32(&data[20]);
+   info->formula = get32(&data[24]);
+   info->power = get32(&data[28]);
+   info->cre = getf(&data[32]);
+   info->cim = getf(&data[36]);
+   info->x1 = getf(&data[40]);
+   info->x2 = getf(&data[44]);
+   info->y1 = getf(&data[48]);
+   info->y2 = getf(&data[52]);
+   used = get32(&data[56]);
+
+   if (info->width == 0 || info->height == 0 || info->width > 65536 || info->height > 65536) return -1;
+   tile_layout(file);
+
+   if ((size - ITERFILE_HEADER) / 4 < file->tiles ||
+       size - ITERFILE_HEADER - 4 * file->tiles != used)
+   {
+      return -1;
+   }
+
+   file->offset = (uint32_t*)malloc((file->tiles + 1) * sizeof(uint32_t));
+   if (file->offset == NULL) return -1;
+   file->data = data + ITERFILE_HEADER + 4 * file->tiles;
+
+   file->offset[0] = 0;
+   for (t=0; t<file->tiles; t++)
+   {
+      file->offset[t + 1] = get32(&data[ITERFILE_HEADER + 4 * t]);
+      if (file->offset[t + 1] < file->offset[t] || file->offset[t + 1] > used)
+      {
+         iterfile_free(file);
+         return -1;
+      }
+   }
+
+   if (file->offset[file->tiles] != used)
+   {
+      iterfile_free(file);
+      return -1;
+   }
+
+   return 0;
+}
+
+// -----------------------------------------------------------------------
+int iterfile_decode(const iterfile_t *file, uint16_t *counts, uint32_t first, uint32_t count)
+{
+   uint32_t t;
+
+   for (t=first; t<first+count && t<file->tiles; t++)
+   {
+      uint32_t x, y, w, h;
+
+      tile_rect(file, t, &x, &y, &w, &h);
+      if (iterfile_decode_tile(&file->data[file->offset[t]], file->offset[t + 1] - file->offset[t],
+                               &counts[y * file->info.width + x], file->info.width, w, h) < 0)
+      {
+         return -1;
+      }
+   }
+
+   return 0;
+}
+
+// -----------------------------------------------------------------------
+int iterfile_save(const iterfile_t *file, const char *path)
+{
+   size_t   size = iterfile_size(file);
+   uint8_t *out = (uint8_t*)malloc(size);
+   FILE    *f;
+   int      r = -1;
+
+   if (out == NULL) return -1;
+
+   iterfile_pack(file, out);
+
+   f = fopen(path, "wb");
+   if (f != NULL)
+   {
+      r = fwrite(out, size, 1, f) == 1 ? 0 : -1;
+      if (fclose(f) != 0) r = -1;
+   }
+
+   free(out);
+   return r;
+}
+
+// -----------------------------------------------------------------------
+int iterfile_load(iterfile_t *file, const char *path)
+{
+   FILE    *f = fopen(path, "rb");
+   uint8_t *data = NULL;
+   long     size;
+
+   memset(file, 0, sizeof(iterfile_t));
+   if (f == NULL) return -1;
+
+   if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0)
+   {
+      data = (uint8_t*)malloc(size);
+      if (data != NULL && fread(data, size, 1, f) != 1)
+      {
+         free(data);
+         data = NULL;
+      }
+   }
+   fclose(f);
+
+   if (data == NULL || iterfile_open(file, data, size) < 0)
+   {
+      free(data);
+      return -1;
+   }
+
+   file->own = data;
+   return 0;
+}
+
+// -----------------------------------------------------------------------
+void iterfile_free(iterfile_t *file)
+{
+   if (file->ownslots) free(file->slots);
+   free(file->offset);
+   free(file->own);
+   memset(file, 0, sizeof(iterfile_t));
+}
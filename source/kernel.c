@@ -0,0 +1,396 @@
+/*
+ * Plain C version of the SPU kernel, used where there are no SPU's to
+ * hand the work to (the farm workers on a Linux host). On x86 the tiles
+ * and points go to the vector versions in kernel_x86.c, the widest the
+ * CPU has, picked at the first call. Tiles of views too deep for a float
+ * go to the double and double-double versions here, a point at a time.
+ */
+
+#include <string.h>
+#include <math.h>
+
+#include "kernel.h"
+
+// One iteration of the formula, z = f(z) + c.
+static inline void kernel_step(const spucommand_t *command, float *px, float *py, float a, float b)
+{
+   float x = *px;
+   float y = *py;
+   float xtemp;
+   uint32_t k;
+
+   switch (command->formula)
+   {
+   case FORMULA_BURNINGSHIP:
+      x = fabsf(x);
+      y = fabsf(y);
+      /* fall through */
+   default:
+      xtemp = x*x - y*y + a;
+      y = 2*x*y + b;
+      x = xtemp;
+      break;
+
+   case FORMULA_TRICORN:
+      xtemp = x*x - y*y + a;
+      y = b - 2*x*y;
+      x = xtemp;
+      break;
+
+   case FORMULA_MULTIBROT:
+   {
+      float zx = x;
+      float zy = y;
+
+      for (k=1; k<command->power; k++)
+      {
+         xtemp = zx*x - zy*y;
+         zy = zx*y + zy*x;
+         zx = xtemp;
+      }
+
+      x = zx + a;
+      y = zy + b;
+      break;
+   }
+   }
+
+   *px = x;
+   *py = y;
+}
+
+// The escape loop, with |z|^2 at the end in @zz unless it is NULL.
+static uint32_t kernel_escape(const spucommand_t *command, float x0, float y0, float *orbit, uint32_t max,
+                              float *zz)
+{
+   float x=0;
+   float y=0;
+   float a=x0;
+   float b=y0;
+
+   uint32_t iteration = 0;
+
+   if (command->formula == FORMULA_JULIA)
+   {
+      x = x0;
+      y = y0;
+      a = command->cre;
+      b = command->cim;
+   }
+
+   while ( x*x + y*y < 2*2  &&  iteration < max )
+   {
+      kernel_step(command, &x, &y, a, b);
+
+      if (orbit)
+      {
+         *orbit++ = x;
+         *orbit++ = y;
+      }
+      iteration = iteration + 1;
+   }
+
+   if (zz) *zz = x*x + y*y;
+   return iteration;
+}
+
+uint32_t kernel_point(const spucommand_t *command, float x0, float y0)
+{
+   return kernel_orbit(command, x0, y0, NULL, KERNEL_MAX_ITER);
+}
+
+uint32_t kernel_orbit(const spucommand_t *command, float x0, float y0, float *orbit, uint32_t max)
+{
+   return kernel_escape(command, x0, y0, orbit, max, NULL);
+}
+
+void kernel_points_scalar(const spucommand_t *command, const float *x, const float *y, uint32_t n,
+                          uint8_t *count, float *smooth)
+{
+   uint32_t i;
+
+   for (i=0; i<n; i++)
+   {
+      float    zz;
+      uint32_t c = kernel_escape(command, x[i], y[i], NULL, KERNEL_MAX_ITER, &zz);
+
+      count[i] = c;
+      if (smooth) smooth[i] = kernel_smooth(command, c, zz);
+   }
+}
+
+static void kernel_tile_scalar(const spucommand_t *command, uint8_t *out)
+{
+   float    xstep = (command->end - command->start) / command->width;
+   float    y0 = command->yvalue;
+   uint32_t i, j;
+
+   for (j=0; j<command->height; j++)
+   {
+      for (i=0; i<command->width; i++)
+      {
+         *out++ = kernel_point(command, command->start + xstep * i, y0);
+      }
+
+      y0 += command->ystep;
+   }
+}
+
+// -----------------------------------------------------------------------
+// Deep views
+// -----------------------------------------------------------------------
+// kernel_step in double.
+static inline void kernel_step_double(const spucommand_t *command, double *px, double *py, double a, double b)
+{
+   double x = *px;
+   double y = *py;
+   double xtemp;
+   uint32_t k;
+
+   switch (command->formula)
+   {
+   case FORMULA_BURNINGSHIP:
+      x = fabs(x);
+      y = fabs(y);
+      /* fall through */
+   default:
+      xtemp = x*x - y*y + a;
+      y = 2*x*y + b;
+      x = xtemp;
+      break;
+
+   case FORMULA_TRICORN:
+      xtemp = x*x - y*y + a;
+      y = b - 2*x*y;
+      x = xtemp;
+      break;
+
+   case FORMULA_MULTIBROT:
+   {
+      double zx = x;
+      double zy = y;
+
+      for (k=1; k<command->power; k++)
+      {
+         xtemp = zx*x - zy*y;
+         zy = zx*y + zy*x;
+         zx = xtemp;
+      }
+
+      x = zx + a;
+      y = zy + b;
+      break;
+   }
+   }
+
+   *px = x;
+   *py = y;
+}
+
+static uint32_t kernel_point_double(const spucommand_t *command, double x0, double y0)
+{
+   double x=0;
+   double y=0;
+   double a=x0;
+   double b=y0;
+
+   uint32_t iteration = 0;
+
+   if (command->formula == FORMULA_JULIA)
+   {
+      x = x0;
+      y = y0;
+      a = command->cre;
+      b = command->cim;
+   }
+
+   while ( x*x + y*y < 2*2  &&  iteration < KERNEL_MAX_ITER )
+   {
+      kernel_step_double(command, &x, &y, a, b);
+      iteration = iteration + 1;
+   }
+
+   return iteration;
+}
+
+static void kernel_tile_double(const spucommand_t *command, uint8_t *out)
+{
+   double   x0 = command->dstart[0] + command->dstart[1];
+   double   y0 = command->dyvalue[0] + command->dyvalue[1];
+   uint32_t i, j;
+
+   for (j=0; j<command->height; j++)
+   {
+      for (i=0; i<command->width; i++)
+      {
+         *out++ = kernel_point_double(command, x0 + command->dxstep * i, y0 + command->dystep * j);
+      }
+   }
+}
+
+static void kernel_tile_extended(const spucommand_t *command, uint8_t *out)
+{
+   ddouble_t   x0 = dd_make(command->dstart[0], command->dstart[1]);
+   ddouble_t   y0 = dd_make(command->dyvalue[0], command->dyvalue[1]);
+   uint32_t    i, j;
+
+   for (j=0; j<command->height; j++)
+   {
+      ddouble_t y = dd_add_d(y0, command->dystep * j);
+
+      for (i=0; i<command->width; i++)
+      {
+         *out++ = kernel_point_extended(command, dd_add_d(x0, command->dxstep * i), y);
+      }
+   }
+}
+
+// -----------------------------------------------------------------------
+// Instruction set dispatch
+// -----------------------------------------------------------------------
+#if defined(__x86_64__) || defined(__i386__)
+#define KERNEL_X86
+void kernel_tile_sse2(const spucommand_t *command, uint8_t *out);
+void kernel_tile_avx2(const spucommand_t *command, uint8_t *out);
+void kernel_tile_avx512(const spucommand_t *command, uint8_t *out);
+void kernel_points_sse2(const spucommand_t *command, const float *x, const float *y, uint32_t n,
+                        uint8_t *count, float *smooth);
+void kernel_points_avx2(const spucommand_t *command, const float *x, const float *y, uint32_t n,
+                        uint8_t *count, float *smooth);
+void kernel_points_avx512(const spucommand_t *command, const float *x, const float *y, uint32_t n,
+                          uint8_t *count, float *smooth);
+#endif
+
+typedef void (*kernel_tile_f)(const spucommand_t *command, uint8_t *out);
+typedef void (*kernel_points_f)(const spucommand_t *command, const float *x, const float *y, uint32_t n,
+                                uint8_t *count, float *smooth);
+
+static const struct
+{
+   const char       *name;
+   kernel_tile_f     tile;
+   kernel_points_f   points;
+} kernel_isas[KERNEL_ISA_COUNT] =
+{
+   { "scalar",  kernel_tile_scalar,  kernel_points_scalar },
+#ifdef KERNEL_X86
+   { "sse2",    kernel_tile_sse2,    kernel_points_sse2 },
+   { "avx2",    kernel_tile_avx2,    kernel_points_avx2 },
+   { "avx512",  kernel_tile_avx512,  kernel_points_avx512 },
+#else
+   { "sse2",    NULL, NULL },
+   { "avx2",    NULL, NULL },
+   { "avx512",  NULL, NULL },
+#endif
+};
+
+static int kernel_current = -1;
+
+uint32_t kernel_isa_supported(void)
+{
+   uint32_t isas = 1 << KERNEL_ISA_SCALAR;
+
+#ifdef KERNEL_X86
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("sse2")) isas |= 1 << KERNEL_ISA_SSE2;
+   if (__builtin_cpu_supports("avx2")) isas |= 1 << KERNEL_ISA_AVX2;
+   if (__builtin_cpu_supports("avx512f")) isas |= 1 << KERNEL_ISA_AVX512;
+#endif
+
+   return isas;
+}
+
+int kernel_isa_select(int isa)
+{
+   uint32_t isas = kernel_isa_supported();
+
+   if (isa < 0)
+   {
+      for (isa=KERNEL_ISA_COUNT-1; isa>0; isa--)
+      {
+         if (isas & (1 << isa)) break;
+      }
+   }
+   if (isa < KERNEL_ISA_COUNT && (isas & (1 << isa))) kernel_current = isa;
+
+   return kernel_isa();
+}
+
+int kernel_isa(void)
+{
+   if (kernel_current < 0) kernel_isa_select(-1);
+   return kernel_current;
+}
+
+const char* kernel_isa_name(int isa)
+{
+   return isa >= 0 && isa < KERNEL_ISA_COUNT ? kernel_isas[isa].name : "?";
+}
+
+void kernel_points(const spucommand_t *command, const float *x, const float *y, uint32_t n,
+                   uint8_t *count, float *smooth)
+{
+   kernel_isas[kernel_isa()].points(command, x, y, n, count, smooth);
+}
+
+void kernel_tile(const spucommand_t *command, uint8_t *out)
+{
+   uint32_t i;
+
+   if (command->precision == KERNEL_PREC_DOUBLE)
+   {
+      kernel_tile_double(command, out);
+   }
+   else if (command->precision == KERNEL_PREC_EXTENDED)
+   {
+      kernel_tile_extended(command, out);
+   }
+   else
+   {
+      kernel_isas[kernel_isa()].tile(command, out);
+   }
+
+   // A pixel has the count of the step before the one that escaped, as on
+   // the SPU's: 254 is inside the set.
+   for (i=0; i<command->width*command->height; i++)
+   {
+      out[i] = out[i] ? out[i] - 1 : 0;
+   }
+}
+
+void kernel_formula(spucommand_t *command, const spucommand_t *from)
+{
+   command->formula = from ? from->formula : FORMULA_MANDEL;
+   command->power = from ? from->power : 2;
+   command->cre = from ? from->cre : 0;
+   command->cim = from ? from->cim : 0;
+}
+
+void kernel_place(spucommand_t *command, ddouble_t x0, ddouble_t y0, double xstep, double ystep, double step)
+{
+   double x2 = x0.hi + xstep * command->width;
+   double y2 = y0.hi + ystep * command->height;
+
+   command->dstart[0] = x0.hi;
+   command->dstart[1] = x0.lo;
+   command->dyvalue[0] = y0.hi;
+   command->dyvalue[1] = y0.lo;
+   command->dxstep = xstep;
+   command->dystep = ystep;
+   command->precision = kernel_precision(kernel_magnitude(command->formula, x0.hi, y0.hi, x2, y2), step);
+}
+
+void kernel_params(kernelparams_t *params, const spucommand_t *command)
+{
+   memset(params, 0, sizeof(kernelparams_t));
+   params->iter = KERNEL_MAX_ITER;
+   if (command == NULL) return;
+
+   params->formula = command->formula;
+   if (command->formula == FORMULA_MULTIBROT) params->power = command->power;
+   if (command->formula == FORMULA_JULIA)
+   {
+      memcpy(&params->cre, &command->cre, sizeof(params->cre));
+      memcpy(&params->cim, &command->cim, sizeof(params->cim));
+   }
+}
@@ -0,0 +1,555 @@
+/*
+ * The kernel of kernel.c in x86 vectors: 4 points at a time with SSE2, 8
+ * with AVX2 and 16 with AVX-512, where a point that escaped retires in a
+ * mask register. Every function is compiled for its own instruction set,
+ * so one binary has all of them and kernel.c picks the widest the CPU
+ * has. The results are those of kernel_point to the bit: the same
+ * operations in the same order, and no fused multiply-adds.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <string.h>
+#include <immintrin.h>
+
+#include "kernel.h"
+
+#pragma GCC optimize ("fp-contract=off")
+
+#define KERNEL_SSE2     __attribute__((target("sse2")))
+#define KERNEL_AVX2     __attribute__((target("avx2")))
+#define KERNEL_AVX512   __attribute__((target("avx512f")))
+#define KERNEL_INLINE   static inline __attribute__((always_inline))
+
+// -----------------------------------------------------------------------
+// SSE2, 4 points
+// -----------------------------------------------------------------------
+KERNEL_INLINE KERNEL_SSE2
+void step_sse2(const spucommand_t *command, __m128 *px, __m128 *py, __m128 a, __m128 b, const uint32_t formula)
+{
+   __m128   x = *px;
+   __m128   y = *py;
+   __m128   two = _mm_set1_ps(2.0f);
+   __m128   xtemp;
+   uint32_t k;
+
+   switch (formula)
+   {
+   case FORMULA_BURNINGSHIP:
+      x = _mm_andnot_ps(_mm_set1_ps(-0.0f), x);
+      y = _mm_andnot_ps(_mm_set1_ps(-0.0f), y);
+      /* fall through */
+   default:
+      xtemp = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), a);
+      y = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(two, x), y), b);
+      x = xtemp;
+      break;
+
+   case FORMULA_TRICORN:
+      xtemp = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), a);
+      y = _mm_sub_ps(b, _mm_mul_ps(_mm_mul_ps(two, x), y));
+      x = xtemp;
+      break;
+
+   case FORMULA_MULTIBROT:
+   {
+      __m128 zx = x;
+      __m128 zy = y;
+
+      for (k=1; k<command->power; k++)
+      {
+         xtemp = _mm_sub_ps(_mm_mul_ps(zx, x), _mm_mul_ps(zy, y));
+         zy = _mm_add_ps(_mm_mul_ps(zx, y), _mm_mul_ps(zy, x));
+         zx = xtemp;
+      }
+
+      x = _mm_add_ps(zx, a);
+      y = _mm_add_ps(zy, b);
+      break;
+   }
+   }
+
+   *px = x;
+   *py = y;
+}
+
+// Escape counts of 4 points, and |z|^2 where they escaped in @zz with @smooth.
+KERNEL_INLINE KERNEL_SSE2
+__m128i escape_sse2(const spucommand_t *command, __m128 a, __m128 b, __m128 *zz,
+                    const uint32_t formula, const int smooth)
+{
+   __m128   x = _mm_setzero_ps();
+   __m128   y = _mm_setzero_ps();
+   __m128   four = _mm_set1_ps(4.0f);
+   __m128   live = _mm_castsi128_ps(_mm_set1_epi32(-1));
+   __m128   last = _mm_setzero_ps();
+   __m128i  count = _mm_setzero_si128();
+   uint32_t i;
+
+   if (formula == FORMULA_JULIA)
+   {
+      x = a;
+      y = b;
+      a = _mm_set1_ps(command->cre);
+      b = _mm_set1_ps(command->cim);
+   }
+
+   for (i=0; i<KERNEL_MAX_ITER; i++)
+   {
+      __m128 d = _mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y));
+      __m128 active = _mm_and_ps(_mm_cmplt_ps(d, four), live);
+
+      if (smooth)
+      {
+         __m128 retired = _mm_andnot_ps(active, live);
+         last = _mm_or_ps(_mm_and_ps(retired, d), _mm_andnot_ps(retired, last));
+      }
+      live = active;
+      if (_mm_movemask_ps(active) == 0) break;
+
+      count = _mm_sub_epi32(count, _mm_castps_si128(active));
+      step_sse2(command, &x, &y, a, b, formula);
+   }
+
+   if (smooth)
+   {
+      __m128 d = _mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y));
+      *zz = _mm_or_ps(_mm_and_ps(live, d), _mm_andnot_ps(live, last));
+   }
+   return count;
+}
+
+KERNEL_INLINE KERNEL_SSE2
+void tile_sse2_f(const spucommand_t *command, uint8_t *out, const uint32_t formula)
+{
+   float    xstep = (command->end - command->start) / command->width;
+   float    y0 = command->yvalue;
+   uint32_t c[4] __attribute__((aligned(16)));
+   uint32_t i, j, k;
+
+   for (j=0; j<command->height; j++)
+   {
+      __m128 b = _mm_set1_ps(y0);
+
+      for (i=0; i+4<=command->width; i+=4)
+      {
+         __m128 n = _mm_cvtepi32_ps(_mm_add_epi32(_mm_set1_epi32(i), _mm_set_epi32(3, 2, 1, 0)));
+         __m128 a = _mm_add_ps(_mm_set1_ps(command->start), _mm_mul_ps(_mm_set1_ps(xstep), n));
+
+         _mm_store_si128((__m128i*)c, escape_sse2(command, a, b, NULL, formula, 0));
+         for (k=0; k<4; k++) *out++ = c[k];
+      }
+      for (; i<command->width; i++)
+      {
+         *out++ = kernel_point(command, command->start + xstep * i, y0);
+      }
+
+      y0 += command->ystep;
+   }
+}
+
+KERNEL_INLINE KERNEL_SSE2
+void points_sse2_f(const spucommand_t *command, const float *x, const float *y, uint32_t n,
+                   uint8_t *count, float *smooth, const uint32_t formula)
+{
+   uint32_t c[4] __attribute__((aligned(16)));
+   uint32_t i, k;
+
+   for (i=0; i+4<=n; i+=4)
+   {
+      __m128 zz;
+
+      if (smooth)
+      {
+         _mm_store_si128((__m128i*)c, escape_sse2(command, _mm_loadu_ps(&x[i]), _mm_loadu_ps(&y[i]), &zz, formula, 1));
+         for (k=0; k<4; k++) count[i + k] = c[k];
+         _mm_storeu_ps(&smooth[i], zz);
+         for (k=0; k<4; k++) smooth[i + k] = kernel_smooth(command, c[k], smooth[i + k]);
+      }
+      else
+      {
+         _mm_store_si128((__m128i*)c, escape_sse2(command, _mm_loadu_ps(&x[i]), _mm_loadu_ps(&y[i]), NULL, formula, 0));
+         for (k=0; k<4; k++) count[i + k] = c[k];
+      }
+   }
+
+   kernel_points_scalar(command, &x[i], &y[i], n - i, &count[i], smooth ? &smooth[i] : NULL);
+}
+
+KERNEL_SSE2 void kernel_tile_sse2(const spucommand_t *command, uint8_t *out)
+{
+   switch (command->formula)
+   {
+   case FORMULA_JULIA:        tile_sse2_f(command, out, FORMULA_JULIA); break;
+   case FORMULA_MULTIBROT:    tile_sse2_f(command, out, FORMULA_MULTIBROT); break;
+   case FORMULA_BURNINGSHIP:  tile_sse2_f(command, out, FORMULA_BURNINGSHIP); break;
+   case FORMULA_TRICORN:      tile_sse2_f(command, out, FORMULA_TRICORN); break;
+   default:                   tile_sse2_f(command, out, FORMULA_MANDEL); break;
+   }
+}
+
+KERNEL_SSE2 void kernel_points_sse2(const spucommand_t *command, const float *x, const float *y, uint32_t n,
+                                    uint8_t *count, float *smooth)
+{
+   switch (command->formula)
+   {
+   case FORMULA_JULIA:        points_sse2_f(command, x, y, n, count, smooth, FORMULA_JULIA); break;
+   case FORMULA_MULTIBROT:    points_sse2_f(command, x, y, n, count, smooth, FORMULA_MULTIBROT); break;
+   case FORMULA_BURNINGSHIP:  points_sse2_f(command, x, y, n, count, smooth, FORMULA_BURNINGSHIP); break;
+   case FORMULA_TRICORN:      points_sse2_f(command, x, y, n, count, smooth, FORMULA_TRICORN); break;
+   default:                   points_sse2_f(command, x, y, n, count, smooth, FORMULA_MANDEL); break;
+   }
+}
+
+// -----------------------------------------------------------------------
+// AVX2, 8 points
+// -----------------------------------------------------------------------
+KERNEL_INLINE KERNEL_AVX2
+void step_avx2(const spucommand_t *command, __m256 *px, __m256 *py, __m256 a, __m256 b, const uint32_t formula)
+{
+   __m256   x = *px;
+   __m256   y = *py;
+   __m256   two = _mm256_set1_ps(2.0f);
+   __m256   xtemp;
+   uint32_t k;
+
+   switch (formula)
+   {
+   case FORMULA_BURNINGSHIP:
+      x = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), x);
+      y = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), y);
+      /* fall through */
+   default:
+      xtemp = _mm256_add_ps(_mm256_sub_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)), a);
+      y = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(two, x), y), b);
+      x = xtemp;
+      break;
+
+   case FORMULA_TRICORN:
+      xtemp = _mm256_add_ps(_mm256_sub_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)), a);
+      y = _mm256_sub_ps(b, _mm256_mul_ps(_mm256_mul_ps(two, x), y));
+      x = xtemp;
+      break;
+
+   case FORMULA_MULTIBROT:
+   {
+      __m256 zx = x;
+      __m256 zy = y;
+
+      for (k=1; k<command->power; k++)
+      {
+         xtemp = _mm256_sub_ps(_mm256_mul_ps(zx, x), _mm256_mul_ps(zy, y));
+         zy = _mm256_add_ps(_mm256_mul_ps(zx, y), _mm256_mul_ps(zy, x));
+         zx = xtemp;
+      }
+
+      x = _mm256_add_ps(zx, a);
+      y = _mm256_add_ps(zy, b);
+      break;
+   }
+   }
+
+   *px = x;
+   *py = y;
+}
+
+KERNEL_INLINE KERNEL_AVX2
+__m256i escape_avx2(const spucommand_t *command, __m256 a, __m256 b, __m256 *zz,
+                    const uint32_t formula, const int smooth)
+{
+   __m256   x = _mm256_setzero_ps();
+   __m256   y = _mm256_setzero_ps();
+   __m256   four = _mm256_set1_ps(4.0f);
+   __m256   live = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+   __m256   last = _mm256_setzero_ps();
+   __m256i  count = _mm256_setzero_si256();
+   uint32_t i;
+
+   if (formula == FORMULA_JULIA)
+   {
+      x = a;
+      y = b;
+      a = _mm256_set1_ps(command->cre);
+      b = _mm256_set1_ps(command->cim);
+   }
+
+   for (i=0; i<KERNEL_MAX_ITER; i++)
+   {
+      __m256 d = _mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y));
+      __m256 active = _mm256_and_ps(_mm256_cmp_ps(d, four, _CMP_LT_OQ), live);
+
+      if (smooth) last = _mm256_blendv_ps(last, d, _mm256_andnot_ps(active, live));
+      live = active;
+      if (_mm256_movemask_ps(active) == 0) break;
+
+      count = _mm256_sub_epi32(count, _mm256_castps_si256(active));
+      step_avx2(command, &x, &y, a, b, formula);
+   }
+
+   if (smooth)
+   {
+      __m256 d = _mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y));
+      *zz = _mm256_blendv_ps(last, d, live);
+   }
+   return count;
+}
+
+KERNEL_INLINE KERNEL_AVX2
+void tile_avx2_f(const spucommand_t *command, uint8_t *out, const uint32_t formula)
+{
+   float    xstep = (command->end - command->start) / command->width;
+   float    y0 = command->yvalue;
+   uint32_t c[8] __attribute__((aligned(32)));
+   uint32_t i, j, k;
+
+   for (j=0; j<command->height; j++)
+   {
+      __m256 b = _mm256_set1_ps(y0);
+
+      for (i=0; i+8<=command->width; i+=8)
+      {
+         __m256 n = _mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_set1_epi32(i), _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0)));
+         __m256 a = _mm256_add_ps(_mm256_set1_ps(command->start), _mm256_mul_ps(_mm256_set1_ps(xstep), n));
+
+         _mm256_store_si256((__m256i*)c, escape_avx2(command, a, b, NULL, formula, 0));
+         for (k=0; k<8; k++) *out++ = c[k];
+      }
+      for (; i<command->width; i++)
+      {
+         *out++ = kernel_point(command, command->start + xstep * i, y0);
+      }
+
+      y0 += command->ystep;
+   }
+}
+
+KERNEL_INLINE KERNEL_AVX2
+void points_avx2_f(const spucommand_t *command, const float *x, const float *y, uint32_t n,
+                   uint8_t *count, float *smooth, const uint32_t formula)
+{
+   uint32_t c[8] __attribute__((aligned(32)));
+   uint32_t i, k;
+
+   for (i=0; i+8<=n; i+=8)
+   {
+      __m256 zz;
+
+      if (smooth)
+      {
+         _mm256_store_si256((__m256i*)c, escape_avx2(command, _mm256_loadu_ps(&x[i]), _mm256_loadu_ps(&y[i]), &zz, formula, 1));
+         for (k=0; k<8; k++) count[i + k] = c[k];
+         _mm256_storeu_ps(&smooth[i], zz);
+         for (k=0; k<8; k++) smooth[i + k] = kernel_smooth(command, c[k], smooth[i + k]);
+      }
+      else
+      {
+         _mm256_store_si256((__m256i*)c, escape_avx2(command, _mm256_loadu_ps(&x[i]), _mm256_loadu_ps(&y[i]), NULL, formula, 0));
+         for (k=0; k<8; k++) count[i + k] = c[k];
+      }
+   }
+
+   kernel_points_scalar(command, &x[i], &y[i], n - i, &count[i], smooth ? &smooth[i] : NULL);
+}
+
+KERNEL_AVX2 void kernel_tile_avx2(const spucommand_t *command, uint8_t *out)
+{
+   switch (command->formula)
+   {
+   case FORMULA_JULIA:        tile_avx2_f(command, out, FORMULA_JULIA); break;
+   case FORMULA_MULTIBROT:    tile_avx2_f(command, out, FORMULA_MULTIBROT); break;
+   case FORMULA_BURNINGSHIP:  tile_avx2_f(command, out, FORMULA_BURNINGSHIP); break;
+   case FORMULA_TRICORN:      tile_avx2_f(command, out, FORMULA_TRICORN); break;
+   default:                   tile_avx2_f(command, out, FORMULA_MANDEL); break;
+   }
+}
+
+KERNEL_AVX2 void kernel_points_avx2(const spucommand_t *command, const float *x, const float *y, uint32_t n,
+                                    uint8_t *count, float *smooth)
+{
+   switch (command->formula)
+   {
+   case FORMULA_JULIA:        points_avx2_f(command, x, y, n, count, smooth, FORMULA_JULIA); break;
+   case FORMULA_MULTIBROT:    points_avx2_f(command, x, y, n, count, smooth, FORMULA_MULTIBROT); break;
+   case FORMULA_BURNINGSHIP:  points_avx2_f(command, x, y, n, count, smooth, FORMULA_BURNINGSHIP); break;
+   case FORMULA_TRICORN:      points_avx2_f(command, x, y, n, count, smooth, FORMULA_TRICORN); break;
+   default:                   points_avx2_f(command, x, y, n, count, smooth, FORMULA_MANDEL); break;
+   }
+}
+
+// -----------------------------------------------------------------------
+// AVX-512, 16 points; the points still going are a mask register.
+// -----------------------------------------------------------------------
+KERNEL_INLINE KERNEL_AVX512
+void step_avx512(const spucommand_t *command, __m512 *px, __m512 *py, __m512 a, __m512 b, const uint32_t formula)
+{
+   __m512   x = *px;
+   __m512   y = *py;
+   __m512   two = _mm512_set1_ps(2.0f);
+   __m512   xtemp;
+   uint32_t k;
+
+   switch (formula)
+   {
+   case FORMULA_BURNINGSHIP:
+      x = _mm512_abs_ps(x);
+      y = _mm512_abs_ps(y);
+      /* fall through */
+   default:
+      xtemp = _mm512_add_ps(_mm512_sub_ps(_mm512_mul_ps(x, x), _mm512_mul_ps(y, y)), a);
+      y = _mm512_add_ps(_mm512_mul_ps(_mm512_mul_ps(two, x), y), b);
+      x = xtemp;
+      break;
+
+   case FORMULA_TRICORN:
+      xtemp = _mm512_add_ps(_mm512_sub_ps(_mm512_mul_ps(x, x), _mm512_mul_ps(y, y)), a);
+      y = _mm512_sub_ps(b, _mm512_mul_ps(_mm512_mul_ps(two, x), y));
+      x = xtemp;
+      break;
+
+   case FORMULA_MULTIBROT:
+   {
+      __m512 zx = x;
+      __m512 zy = y;
+
+      for (k=1; k<command->power; k++)
+      {
+         xtemp = _mm512_sub_ps(_mm512_mul_ps(zx, x), _mm512_mul_ps(zy, y));
+         zy = _mm512_add_ps(_mm512_mul_ps(zx, y), _mm512_mul_ps(zy, x));
+         zx = xtemp;
+      }
+
+      x = _mm512_add_ps(zx, a);
+      y = _mm512_add_ps(zy, b);
+      break;
+   }
+   }
+
+   *px = x;
+   *py = y;
+}
+
+KERNEL_INLINE KERNEL_AVX512
+__m512i escape_avx512(const spucommand_t *command, __m512 a, __m512 b, __m512 *zz,
+                      const uint32_t formula, const int smooth)
+{
+   __m512   x = _mm512_setzero_ps();
+   __m512   y = _mm512_setzero_ps();
+   __m512   four = _mm512_set1_ps(4.0f);
+   __m512   last = _mm512_setzero_ps();
+   __m512i  one = _mm512_set1_epi32(1);
+   __m512i  count = _mm512_setzero_si512();
+   __mmask16 live = 0xffff;
+   uint32_t i;
+
+   if (formula == FORMULA_JULIA)
+   {
+      x = a;
+      y = b;
+      a = _mm512_set1_ps(command->cre);
+      b = _mm512_set1_ps(command->cim);
+   }
+
+   for (i=0; i<KERNEL_MAX_ITER; i++)
+   {
+      __m512    d = _mm512_add_ps(_mm512_mul_ps(x, x), _mm512_mul_ps(y, y));
+      __mmask16 active = _mm512_mask_cmp_ps_mask(live, d, four, _CMP_LT_OQ);
+
+      if (smooth) last = _mm512_mask_mov_ps(last, live & ~active, d);
+      live = active;
+      if (active == 0) break;
+
+      count = _mm512_mask_add_epi32(count, active, count, one);
+      step_avx512(command, &x, &y, a, b, formula);
+   }
+
+   if (smooth)
+   {
+      __m512 d = _mm512_add_ps(_mm512_mul_ps(x, x), _mm512_mul_ps(y, y));
+      *zz = _mm512_mask_mov_ps(last, live, d);
+   }
+   return count;
+}
+
+KERNEL_INLINE KERNEL_AVX512
+void tile_avx512_f(const spucommand_t *command, uint8_t *out, const uint32_t formula)
+{
+   float    xstep = (command->end - command->start) / command->width;
+   float    y0 = command->yvalue;
+   __m512i  lanes = _mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+   uint32_t i, j;
+
+   for (j=0; j<command->height; j++)
+   {
+      __m512 b = _mm512_set1_ps(y0);
+
+      for (i=0; i+16<=command->width; i+=16)
+      {
+         __m512 n = _mm512_cvtepi32_ps(_mm512_add_epi32(_mm512_set1_epi32(i), lanes));
+         __m512 a = _mm512_add_ps(_mm512_set1_ps(command->start), _mm512_mul_ps(_mm512_set1_ps(xstep), n));
+
+         _mm_storeu_si128((__m128i*)out, _mm512_cvtepi32_epi8(escape_avx512(command, a, b, NULL, formula, 0)));
+         out += 16;
+      }
+      for (; i<command->width; i++)
+      {
+         *out++ = kernel_point(command, command->start + xstep * i, y0);
+      }
+
+      y0 += command->ystep;
+   }
+}
+
+KERNEL_INLINE KERNEL_AVX512
+void points_avx512_f(const spucommand_t *command, const float *x, const float *y, uint32_t n,
+                     uint8_t *count, float *smooth, const uint32_t formula)
+{
+   uint32_t i, k;
+
+   for (i=0; i+16<=n; i+=16)
+   {
+      __m512  zz;
+      __m512i c;
+
+      if (smooth)
+      {
+         c = escape_avx512(command, _mm512_loadu_ps(&x[i]), _mm512_loadu_ps(&y[i]), &zz, formula, 1);
+         _mm_storeu_si128((__m128i*)&count[i], _mm512_cvtepi32_epi8(c));
+         _mm512_storeu_ps(&smooth[i], zz);
+         for (k=0; k<16; k++) smooth[i + k] = kernel_smooth(command, count[i + k], smooth[i + k]);
+      }
+      else
+      {
+         c = escape_avx512(command, _mm512_loadu_ps(&x[i]), _mm512_loadu_ps(&y[i]), NULL, formula, 0);
+         _mm_storeu_si128((__m128i*)&count[i], _mm512_cvtepi32_epi8(c));
+      }
+   }
+
+   kernel_points_scalar(command, &x[i], &y[i], n - i, &count[i], smooth ? &smooth[i] : NULL);
+}
+
+KERNEL_AVX512 void kernel_tile_avx512(const spucommand_t *command, uint8_t *out)
+{
+   switch (command->formula)
+   {
+   case FORMULA_JULIA:        tile_avx512_f(command, out, FORMULA_JULIA); break;
+   case FORMULA_MULTIBROT:    tile_avx512_f(command, out, FORMULA_MULTIBROT); break;
+   case FORMULA_BURNINGSHIP:  tile_avx512_f(command, out, FORMULA_BURNINGSHIP); break;
+   case FORMULA_TRICORN:      tile_avx512_f(command, out, FORMULA_TRICORN); break;
+   default:                   tile_avx512_f(command, out, FORMULA_MANDEL); break;
+   }
+}
+
+KERNEL_AVX512 void kernel_points_avx512(const spucommand_t *command, const float *x, const float *y, uint32_t n,
+                                        uint8_t *count, float *smooth)
+{
+   switch (command->formula)
+   {
+   case FORMULA_JULIA:        points_avx512_f(command, x, y, n, count, smooth, FORMULA_JULIA); break;
+   case FORMULA_MULTIBROT:    points_avx512_f(command, x, y, n, count, smooth, FORMULA_MULTIBROT); break;
+   case FORMULA_BURNINGSHIP:  points_avx512_f(command, x, y, n, count, smooth, FORMULA_BURNINGSHIP); break;
+   case FORMULA_TRICORN:      points_avx512_f(command, x, y, n, count, smooth, FORMULA_TRICORN); break;
+   default:                   points_avx512_f(command, x, y, n, count, smooth, FORMULA_MANDEL); break;
+   }
+}
+
+#endif
@@ -1,10 +1,22 @@
 #include <ppu-lv2.h>
 #include <io/pad.h>
 #include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <sys/spu.h>
+#include <sys/event_queue.h>
+#include <ppu_intrinsics.h>
 
 #include "rsxutil.h"
+#include "kernel.h"
+#include "tilecache.h"
+#include "palette.h"
+#include "replay.h"
+#include "profile.h"
+#include "tune.h"
+#include "arena.h"
 
 #include <cmath>
 
@@ -12,6 +24,40 @@
 #include "debug.hpp"
 
 #define MAX_BUFFERS (2)
+#define TILECACHE_PATH  "/dev_hdd0/tmp/mandelbrot.tiles"
+#define TILECACHE_SLOTS (4096)     // 16Mb of tiles
+#define REPLAY_PATH     "/dev_hdd0/tmp/mandelbrot.replay"
+#define TUNE_PATH       "/dev_hdd0/tmp/mandelbrot.tune"
+#define TUNE_FRAMES     (3)        // Frames per view for every configuration that is tried
+#define SPU_ARENA       (1024*1024)   // Rings and buffers of the SPU's; the accumulation buffer gets its own region
+#define AA_SAMPLES      (4)        // 4x4 samples for the pixels on an edge
+#define AA_THRESHOLD    (4)        // Iterations difference with a neighbour that makes an edge
+#define STICK_DEADZONE  (0.08)     // Sticks closer to the middle count as centred
+#define FRAME_US        (1000000/30)   // A view that moves is shown at a steady 30 Hz
+#define VSYNC_US        (1000000/60)
+#define FRAME_MARGIN    (3000)     // us of a frame kept for the flip
+#define SPEC_VIEWS      (2)        // Views to come that a quick frame calculates tiles of while it waits
+#define STICK_HISTORY   (4)        // Frames of stick input the views after the next one are guessed from
+#define VIEW_MIN_ULPS   (1 << 19)  // Narrowest view, in steps of a double-double at its coordinates
+
+// -----------------------------------------------------------------------
+// A view of the plane. The corners are double-doubles, a deep view needs
+// more bits than a double has to tell them apart; its width and height
+// are differences of the corners, and those are doubles at any depth.
+struct View
+{
+   ddouble_t x1;
+   ddouble_t x2;
+   ddouble_t y1;
+   ddouble_t y2;
+
+   double Width(void) const { return dd_sub(x2, x1).hi; }
+   double Height(void) const { return dd_sub(y2, y1).hi; }
+   double Magnitude(void) const
+   {
+      return fmax(fmax(fabs(x1.hi), fabs(x2.hi)), fmax(fabs(y1.hi), fabs(y2.hi)));
+   }
+};
 
 // -----------------------------------------------------------------------
 class MandelBrot
@@ -19,11 +65,12 @@ class MandelBrot
 public:
    // --------------------------------------------------------------------
    MandelBrot()
-   : m_x1(-2.0),
-     m_x2( 1.0),
-     m_y1(-1.5),
-     m_y2( 1.5)
    {
+      m_view.x1 = dd_make(-2.0, 0);
+      m_view.x2 = dd_make( 1.0, 0);
+      m_view.y1 = dd_make(-1.5, 0);
+      m_view.y2 = dd_make( 1.5, 0);
+      kernel_formula(&m_formula, NULL);
    }
 
    // --------------------------------------------------------------------
@@ -36,16 +83,16 @@ public:
    {
       s32 i, j;
 
-      float xstep = (m_x2 - m_x1) / buffer->width;
-      float ystep = (m_y2 - m_y1) / buffer->height;
+      float xstep = m_view.Width() / buffer->width;
+      float ystep = m_view.Height() / buffer->height;
       
 
       for(i = 0; i < buffer->height; i+=4)
       {
          for(j = 0; j < buffer->width; j+=4)
          {
-            float x = m_x1 + xstep * j;
-            float y = m_y1 + ystep * i;
+            float x = m_view.x1.hi + xstep * j;
+            float y = m_view.y1.hi + ystep * i;
             s32 color = mandelb(x, y);
             buffer->ptr[i * buffer->width + j] = iter2color(color);
          }
@@ -55,32 +102,126 @@ public:
    // --------------------------------------------------------------------
    void Zoom(float p)
    {
-      float delta = (m_x2 - m_x1) * (1.0 - p) * 0.5;
-      m_x1 += delta;
-      m_x2 -= delta;
+      // Any deeper and the pixels of a full HD screen are closer together
+      // than the extended kernel can tell apart with its guard bits.
+      double narrow = fmin(m_view.Width(), m_view.Height());
 
+      if (p < 1.0 && narrow * p < m_view.Magnitude() * DD_EPSILON * VIEW_MIN_ULPS) return;
 
-      delta = (m_y2 - m_y1) * (1.0 - p) * 0.5;
-      m_y1 += delta;
-      m_y2 -= delta;
+      double delta = m_view.Width() * (1.0 - p) * 0.5;
+      m_view.x1 = dd_add_d(m_view.x1, delta);
+      m_view.x2 = dd_add_d(m_view.x2, -delta);
+
+      delta = m_view.Height() * (1.0 - p) * 0.5;
+      m_view.y1 = dd_add_d(m_view.y1, delta);
+      m_view.y2 = dd_add_d(m_view.y2, -delta);
    }
 
    // --------------------------------------------------------------------
    void Move(float xmove, float ymove)
    {
-      float delta = (m_x2 - m_x1) * xmove;
-      m_x1 += delta;
-      m_x2 += delta;
+      double delta = m_view.Width() * xmove;
+      m_view.x1 = dd_add_d(m_view.x1, delta);
+      m_view.x2 = dd_add_d(m_view.x2, delta);
+
+      delta = m_view.Height() * ymove;
+      m_view.y1 = dd_add_d(m_view.y1, delta);
+      m_view.y2 = dd_add_d(m_view.y2, delta);
+   }
+
+   // --------------------------------------------------------------------
+   // Where the sticks take the view in one frame.
+   void Step(float lh, float lv, float rv)
+   {
+      Move(lh*0.1, lv*0.1);
+      Zoom(1.0 + rv*0.05);
+   }
+
+   // --------------------------------------------------------------------
+   // Cycle through the FORMULA_*'s, each one starts with its own defaults.
+   void NextFormula(int dir)
+   {
+      m_formula.formula = (m_formula.formula + FORMULA_COUNT + dir) % FORMULA_COUNT;
+      m_formula.power = 3;
+      m_formula.cre = -0.8;
+      m_formula.cim = 0.156;
+      debugPrintf("formula %d\n", m_formula.formula);
+   }
+
+   // --------------------------------------------------------------------
+   // The d-pad moves the Julia constant, or changes the Multibrot power.
+   void AdjustFormula(int dx, int dy)
+   {
+      if (m_formula.formula == FORMULA_JULIA)
+      {
+         m_formula.cre += dx * 0.01;
+         m_formula.cim += dy * 0.01;
+      }
+      else if (m_formula.formula == FORMULA_MULTIBROT)
+      {
+         int power = m_formula.power + dy;
+         m_formula.power = power < FORMULA_POWER_MIN ? FORMULA_POWER_MIN :
+                           (power > FORMULA_POWER_MAX ? FORMULA_POWER_MAX : power);
+      }
+   }
+
+   // --------------------------------------------------------------------
+   // The view and formula go in every frame of a recording.
+   void Save(replayframe_t *frame)
+   {
+      frame->formula = m_formula.formula;
+      frame->power = m_formula.power;
+      frame->cre = m_formula.cre;
+      frame->cim = m_formula.cim;
+      frame->x1 = m_view.x1.hi;
+      frame->x2 = m_view.x2.hi;
+      frame->y1 = m_view.y1.hi;
+      frame->y2 = m_view.y2.hi;
+      frame->x1lo = m_view.x1.lo;
+      frame->x2lo = m_view.x2.lo;
+      frame->y1lo = m_view.y1.lo;
+      frame->y2lo = m_view.y2.lo;
+   }
+
+   // --------------------------------------------------------------------
+   void Load(const replayframe_t *frame)
+   {
+      m_formula.formula = frame->formula;
+      m_formula.power = frame->power;
+      m_formula.cre = frame->cre;
+      m_formula.cim = frame->cim;
+      m_view.x1 = dd_two_sum(frame->x1, frame->x1lo);
+      m_view.x2 = dd_two_sum(frame->x2, frame->x2lo);
+      m_view.y1 = dd_two_sum(frame->y1, frame->y1lo);
+      m_view.y2 = dd_two_sum(frame->y2, frame->y2lo);
+   }
 
-      delta = (m_y2 - m_y1) * ymove;
-      m_y1 += delta;
-      m_y2 += delta;
+   // --------------------------------------------------------------------
+   // True when the view and formula are those of @frame: a replayed frame
+   // ends up where the recorded one was, or the view stood still.
+   bool Same(const replayframe_t *frame)
+   {
+      return m_view.x1.hi == frame->x1 && m_view.x2.hi == frame->x2 &&
+             m_view.y1.hi == frame->y1 && m_view.y2.hi == frame->y2 &&
+             m_view.x1.lo == frame->x1lo && m_view.x2.lo == frame->x2lo &&
+             m_view.y1.lo == frame->y1lo && m_view.y2.lo == frame->y2lo &&
+             m_formula.formula == frame->formula && m_formula.power == frame->power &&
+             m_formula.cre == frame->cre && m_formula.cim == frame->cim;
    }
 
-   float get_x1(void) { return m_x1; }
-   float get_x2(void) { return m_x2; }
-   float get_y1(void) { return m_y1; }
-   float get_y2(void) { return m_y2; }
+   const spucommand_t* get_formula(void) { return &m_formula; }
+
+   const View& get_view(void) { return m_view; }
+
+   // --------------------------------------------------------------------
+   // The precision the view needs on @buffer, that of its tile that needs
+   // the most.
+   int Precision(rsxBuffer *buffer)
+   {
+      double step = fmin(m_view.Width() / buffer->width, m_view.Height() / buffer->height);
+
+      return kernel_precision(m_view.Magnitude(), step);
+   }
 
 private:
    // --------------------------------------------------------------------
@@ -125,10 +266,67 @@ private:
      return iteration;
    }
 
-   float m_x1;
-   float m_x2;
-   float m_y1;
-   float m_y2;
+   View   m_view;             // The SPU's get the precision each tile needs
+
+   spucommand_t m_formula;    // Only the formula fields are used
+};
+
+// -----------------------------------------------------------------------
+// --------------- Predictor ---------------------------------------------
+// -----------------------------------------------------------------------
+// The views of the frames to come. The sticks of this frame make the next
+// view, that one is exact. After it the sticks go on along the line
+// through the last STICK_HISTORY frames; a hand that holds a stick still
+// gives the same value every frame, and then those views are exact too.
+class Predictor
+{
+public:
+   Predictor() : m_count(0) {}
+
+   // --------------------------------------------------------------------
+   // The sticks of this frame.
+   void Add(float lh, float lv, float rv)
+   {
+      if (m_count == STICK_HISTORY)
+      {
+         memmove(&m_stick[0], &m_stick[1], (STICK_HISTORY - 1) * sizeof(m_stick[0]));
+         m_count--;
+      }
+      m_stick[m_count][0] = lh;
+      m_stick[m_count][1] = lv;
+      m_stick[m_count][2] = rv;
+      m_count++;
+   }
+
+   // --------------------------------------------------------------------
+   // Take @view, the one on the screen, @ahead frames past the next one.
+   void View(MandelBrot *view, int ahead)
+   {
+      for (int k = 0; k <= ahead; k++)
+      {
+         view->Step(Stick(0, k), Stick(1, k), Stick(2, k));
+      }
+   }
+
+private:
+   // --------------------------------------------------------------------
+   // Stick @axis @k frames after this one. A stick that is let go, or
+   // that is on its way back, is centred.
+   float Stick(int axis, int k)
+   {
+      if (m_count == 0) return 0.0;
+
+      float last = m_stick[m_count - 1][axis];
+      if (k == 0 || m_count == 1 || last == 0.0) return last;
+
+      float v = last + (last - m_stick[0][axis]) * k / (m_count - 1);
+      if ((v > 0.0) != (last > 0.0)) return 0.0;
+
+      return v > 1.0 ? 1.0 : (v < -1.0 ? -1.0 : v);
+   }
+
+   float m_stick[STICK_HISTORY][3];   // lh, lv, rv; the oldest first
+   int   m_count;
 };
 
 // -----------------------------------------------------------------------
@@ -139,15 +337,30 @@ class RSXClass
 public:
    // --------------------------------------------------------------------
    RSXClass()
-   : m_host_addr(NULL),
+   : m_context(NULL),
+     m_host_addr(NULL),
      m_currentBuffer(0)
    {
       /* 
        * Allocate a 32Mb buffer, alligned to a 1Mb boundary                          
-       * to be our shared IO memory with the RSX. 
+       * to be our shared IO memory with the RSX. In 1Mb pages, the same
+       * size as the RSX maps it in.
        */
-      m_host_addr = memalign (1024*1024, HOST_SIZE);
+      if (arena_create(&m_arena, HOST_SIZE) == 0)
+      {
+         m_host_addr = arena_alloc(&m_arena, HOST_SIZE, 1024*1024);
+      }
+      if (m_host_addr == NULL)
+      {
+         debugPrintf("No memory for the RSX\n");
+         return;
+      }
       m_context = initScreen (m_host_addr, HOST_SIZE); // rsxutil.c
+      if (m_context == NULL)
+      {
+         debugPrintf("initScreen failed\n");
+         return;
+      }
 
       getResolution(&m_width, &m_height); // rsxutil.c
 
@@ -164,14 +377,24 @@ public:
    // --------------------------------------------------------------------
    ~RSXClass()
    {
-      gcmSetWaitFlip(m_context);
-      for (int i=0; i < MAX_BUFFERS; i++)
+      if (m_context != NULL)
       {
-         rsxFree(m_buffers[i].ptr);
+         gcmSetWaitFlip(m_context);
+         for (int i=0; i < MAX_BUFFERS; i++)
+         {
+            rsxFree(m_buffers[i].ptr);
+         }
+
+         rsxFinish(m_context, 1);
       }
+      arena_destroy(&m_arena);
+   }
 
-      rsxFinish(m_context, 1);
-      free(m_host_addr);
+   // --------------------------------------------------------------------
+   // False when the screen could not be set up.
+   bool Ready(void)
+   {
+      return m_context != NULL;
    }
 
    // --------------------------------------------------------------------
@@ -195,6 +418,7 @@ public:
 
 private:
    gcmContextData*   m_context;
+   arena_t           m_arena;
    void*             m_host_addr;
    rsxBuffer         m_buffers[MAX_BUFFERS];
    u16               m_width;
@@ -209,12 +433,40 @@ private:
 class PadClass
 {
 public:
+   // --------------------------------------------------------------------
+   // Buttons that act once per press.
+   enum Button
+   {
+      SELECT,
+      TRIANGLE,
+      CIRCLE,
+      SQUARE,
+      CROSS,
+      L1,
+      R1,
+      UP,
+      DOWN,
+      LEFT,
+      RIGHT,
+      L3,
+      R3,
+      R2,
+      L2,
+      BUTTONS
+   };
+
    // --------------------------------------------------------------------
    PadClass()
    : m_startPressed(false)
    {
       ioPadInit(1);  // Waarom niet MAX_PADS??
 
+      for (int i=0; i < BUTTONS; i++)
+      {
+         m_pressed[i] = false;
+         m_down[i] = false;
+      }
+
       m_paddata.ANA_L_H = 128;
       m_paddata.ANA_L_V = 128;
       m_paddata.ANA_R_V = 128;
@@ -242,41 +494,129 @@ public:
                {
                   m_startPressed = true;
                }
+
+               bool down[BUTTONS] =
+               {
+                  m_paddata.BTN_SELECT != 0,
+                  m_paddata.BTN_TRIANGLE != 0,
+                  m_paddata.BTN_CIRCLE != 0,
+                  m_paddata.BTN_SQUARE != 0,
+                  m_paddata.BTN_CROSS != 0,
+                  m_paddata.BTN_L1 != 0,
+                  m_paddata.BTN_R1 != 0,
+                  m_paddata.BTN_UP != 0,
+                  m_paddata.BTN_DOWN != 0,
+                  m_paddata.BTN_LEFT != 0,
+                  m_paddata.BTN_RIGHT != 0,
+                  m_paddata.BTN_L3 != 0,
+                  m_paddata.BTN_R3 != 0,
+                  m_paddata.BTN_R2 != 0,
+                  m_paddata.BTN_L2 != 0,
+               };
+
+               press(down);
             }
          }
       }
    }
 
+   // --------------------------------------------------------------------
+   // The pad of this frame, for a recording.
+   void Save(replayframe_t *frame)
+   {
+      frame->lh = m_paddata.ANA_L_H;
+      frame->lv = m_paddata.ANA_L_V;
+      frame->rv = m_paddata.ANA_R_V;
+      frame->buttons = 0;
+      for (int b=0; b < BUTTONS; b++)
+      {
+         if (m_down[b]) frame->buttons |= 1 << b;
+      }
+   }
+
+   // --------------------------------------------------------------------
+   // Take the pad from a recording instead of reading it. On the first
+   // frame the buttons that are down were already down, as they were
+   // when the recording started.
+   void Load(const replayframe_t *frame, bool first)
+   {
+      bool down[BUTTONS];
+
+      for (int b=0; b < BUTTONS; b++)
+      {
+         down[b] = (frame->buttons >> b) & 1;
+         if (first) m_down[b] = down[b];
+      }
+
+      m_paddata.ANA_L_H = frame->lh;
+      m_paddata.ANA_L_V = frame->lv;
+      m_paddata.ANA_R_V = frame->rv;
+      press(down);
+   }
+
    // --------------------------------------------------------------------
    bool startPressed()
    {
       return m_startPressed;
    }
 
+   // --------------------------------------------------------------------
+   // True once for every press of the button.
+   bool pressed(Button b)
+   {
+      bool r = m_pressed[b];
+      m_pressed[b] = false;
+      return r;
+   }
+
    // --------------------------------------------------------------------
    float stickLH(void)
    {
-      return ((m_paddata.ANA_L_H & 0xff) / 128.0 - 1.0);
+      return stick(m_paddata.ANA_L_H);
    }
 
    // --------------------------------------------------------------------
    float stickLV(void)
    {
-      return ((m_paddata.ANA_L_V & 0xff) / 128.0 - 1.0);
+      return stick(m_paddata.ANA_L_V);
    }
 
    // --------------------------------------------------------------------
    float stickRV(void)
    {
-      return ((m_paddata.ANA_R_V & 0xff) / 128.0 - 1.0);
+      return stick(m_paddata.ANA_R_V);
    }
 
 private:
+   // --------------------------------------------------------------------
+   // -1.0 .. 1.0, and 0 for a stick that is let go: those never come back
+   // to exactly 128, and the view would never stand still.
+   float stick(u16 value)
+   {
+      float v = (value & 0xff) / 128.0 - 1.0;
+
+      return (v > -STICK_DEADZONE && v < STICK_DEADZONE) ? 0.0 : v;
+   }
+
+   // --------------------------------------------------------------------
+   void press(const bool *down)
+   {
+      for (int b=0; b < BUTTONS; b++)
+      {
+         if (down[b] && !m_down[b])
+         {
+            m_pressed[b] = true;
+         }
+         m_down[b] = down[b];
+      }
+   }
 
    padInfo     m_padinfo;
    padData     m_paddata;
 
    bool        m_startPressed;
+   bool        m_pressed[BUTTONS];
+   bool        m_down[BUTTONS];
 };
 
 // -----------------------------------------------------------------------
@@ -286,15 +626,41 @@ extern const u8 spu_bin_end[];
 extern const u8 spu_bin[];
 extern const u32 spu_bin_size;
 #define ptr2ea(x) ((u64)(void *)(x))
+#define SPU_USAGE (6)
+#define COMPUTE_BATCH (4)   // Tile cache tiles per SPU that are queued at once
+#define MAX_TILES ((1920 + DE_TILE - 1) / DE_TILE * ((1080 + DE_TILE - 1) / DE_TILE))
+#define DEADLINE_DEPTH (2)   // Tiles queued per SPU by CalcDeadline, the rest waits for the deadline check
+#define DEADLINE_AGE (8)     // Frames a tile can wait before it is as near as the middle
+#define PREVIEW_COST (8)     // A CMD_PREVIEW tile costs this part of a whole one, or less
 #include "spustr.h"
 class SpuClass
 {
 public:
    // --------------------------------------------------------------------
    SpuClass()
+   : m_histogram(false),
+     m_palcur(0),
+     m_profiling(false),
+     m_accum(NULL),
+     m_pass(0),
+     m_tileCost(0),
+     m_ready(false)
    {
+      memset(m_precision, 0, sizeof(m_precision));
+      memset(m_spec, 0, sizeof(m_spec));
+      memset(m_specTiles, 0, sizeof(m_specTiles));
+
       s32   r;
 
+      // Everything the SPU's DMA to and from comes from 1Mb pages, a DMA
+      // then seldom misses in the TLB of the MFC. All that is allocated
+      // below fits in the first region.
+      if (arena_create(&m_arena, SPU_ARENA) != 0)
+      {
+         debugPrintf("No memory for the SPU's\n");
+         return;
+      }
+
       // Utilize all 6 SPUs
       debugPrintf("Initializing 6 SPU's\n");
       r = sysSpuInitialize(6, 0);
@@ -314,13 +680,62 @@ public:
       debugPrintf("Return value: %d\n", r);
       debugPrintf("Group Id: %d\n", m_group_id);
 
-
       // To be calculated array...
-      m_array = (uint32_t*)memalign(16, 24*sizeof(uint32_t));
-      m_command = (spucommand_t*)memalign(16, 6*sizeof(spucommand_t));
+      m_array = (uint32_t*)arena_alloc(&m_arena, 24*sizeof(uint32_t), 16);
+
+      // A ring of commands per SPU, a whole frame fits in them.
+      for (int i=0; i<6; i++)
+      {
+         m_ring[i] = (spuring_t*)arena_alloc(&m_arena, sizeof(spuring_t), 128);
+         memset(m_ring[i], 0, sizeof(spuring_t));
+         m_seen[i] = 0;
+      }
+
+      // Every SPU counts its own iterations, the PPU adds them up.
+      for (int i=0; i<6; i++)
+      {
+         m_hist[i] = (uint32_t*)arena_alloc(&m_arena, PALETTE_SIZE*sizeof(uint32_t), 128);
+      }
+      for (int i=0; i<2; i++)
+      {
+         m_palette[i] = (uint32_t*)arena_alloc(&m_arena, PALETTE_SIZE*sizeof(uint32_t), 128);
+      }
+
+      // Until there is a profile file.
+      tune_default(&m_tune, SPU_USAGE);
+
+      // What every tile of a frame cost, when profiling.
+      m_cost = (spucost_t*)arena_alloc(&m_arena, MAX_TILES*sizeof(spucost_t), 128);
+      profile_init(&m_profile, MAX_TILES);
+
+      // The order of the tiles of CalcDeadline, and the frames every tile
+      // waited for its full quality.
+      m_order = (u32*)arena_alloc(&m_arena, MAX_TILES*sizeof(u32), 128);
+      m_age = (u8*)arena_alloc(&m_arena, MAX_TILES, 128);
+      memset(m_age, 0, MAX_TILES);
+
+      // Which tiles of the views to come Speculate has; their pixels get
+      // a region of their own on first use.
+      for (int i=0; i<SPEC_VIEWS; i++)
+      {
+         m_specDone[i] = (u8*)arena_alloc(&m_arena, MAX_TILES, 128);
+         memset(m_specDone[i], 0, MAX_TILES);
+      }
+
+      // Tiles for the tile cache are calculated here first.
+      for (int i=0; i<SPU_USAGE*COMPUTE_BATCH; i++)
+      {
+         m_tile[i] = (uint32_t*)arena_alloc(&m_arena, TILECACHE_BYTES*sizeof(uint32_t), 128);
+      }
+
+      // The SPU's report an empty ring on this queue, so the PPU can sleep
+      // while they work.
+      sys_event_queue_attr_t queueattr = { SYS_EVENT_QUEUE_PRIO, SYS_EVENT_QUEUE_PPU, "spudone" };
+      r = sysEventQueueCreate(&m_queue, &queueattr, SYS_EVENT_QUEUE_KEY_LOCAL, 127);
+      debugPrintf("Event queue: %d\n", r);
 
       // Create all 6 SPU's
-      m_spu = (spustr_t *)memalign(16, 6*sizeof(spustr_t));
+      m_spu = (spustr_t *)arena_alloc(&m_arena, 6*sizeof(spustr_t), 16);
       sysSpuThreadAttribute attr = { ptr2ea("mythread"), 8+1, SPU_THREAD_ATTR_NONE };
       sysSpuThreadArgument arg[6];
       for (int i=0; i<6; i++)
@@ -328,17 +743,17 @@ public:
          m_spu[i].id = -1;
          m_spu[i].rank = i;
          m_spu[i].count = 6;
-         m_spu[i].sync = 0;
          m_spu[i].array_ea = ptr2ea(m_array);
-         m_spu[i].command_ea = ptr2ea(&m_command[i]);
+         m_spu[i].ring_ea = ptr2ea(m_ring[i]);
          arg[i].arg0 = ptr2ea(&m_spu[i]);
 
          sysSpuThreadInitialize(&m_spu[i].id, m_group_id, i, &m_image, &attr, &arg[i]);
          sysSpuThreadSetConfiguration(m_spu[i].id, SPU_SIGNAL1_OVERWRITE|SPU_SIGNAL2_OVERWRITE);
+         sysSpuThreadConnectEvent(m_spu[i].id, m_queue, SPU_THREAD_EVENT_USER, SPU_EVENT_PORT);
       }
 
       sysSpuThreadGroupStart(m_group_id);
-
+      m_ready = true;
    }
 
 
@@ -346,20 +761,16 @@ public:
    ~SpuClass()
    {
       s32 r;
+
+      if (!m_ready) return;
+
       // Send Quit Command to All SPUs
       debugPrintf("Sending QUIT command...\n");
-      m_command[0].cmd = CMD_QUIT;
-      m_command[1].cmd = CMD_QUIT;
-      m_command[2].cmd = CMD_QUIT;
-      m_command[3].cmd = CMD_QUIT;
-      m_command[4].cmd = CMD_QUIT;
-      m_command[5].cmd = CMD_QUIT;
-
-      /* Send signal notification to waiting spus */
+      /* Queued behind whatever they still have to do */
       for (int i = 0; i < 6; i++)
       {
-         r = sysSpuThreadWriteSignal(m_spu[i].id, 0, 1);
-//         debugPrintf("Sending signal... %08x\n", r);
+         Queue(i)->cmd = CMD_QUIT;
+         Push(i);
       }
 
 
@@ -373,55 +784,72 @@ public:
       r = sysSpuImageClose(&m_image);
       debugPrintf("Closing image... %08x\n", r);
 
-      free(m_array);
-      free(m_spu);
+      sysEventQueueDestroy(m_queue, SYS_EVENT_QUEUE_DESTROY_FORCE);
+
+      arenastats_t stats;
+      arena_stats(&m_arena, &stats);
+      debugPrintf("arena: %d kb in %d regions, %d kb used, %d kb in 1Mb pages, %d pages\n",
+                  (int)(stats.reserved / 1024), stats.regions, (int)(stats.used / 1024),
+                  (int)(stats.hugebytes / 1024), stats.pages);
+
+      arena_destroy(&m_arena);
+      profile_free(&m_profile);
 
    }
 
+   // --------------------------------------------------------------------
+   // False when there was no memory to start the SPU's with.
+   bool Ready(void)
+   {
+      return m_ready;
+   }
+
 // 1 SPU = 210ms
 // 2 SPU = 104ms
 // 3 SPU =  70ms
 // 4 SPU =  51ms
 // 5 SPU =  42ms
 // 6 SPU =  35ms
-#define SPU_USAGE (6)
-   void Calc2(rsxBuffer *buffer, float x1, float x2, float y1, float y2)
+   void Calc2(rsxBuffer *buffer, const spucommand_t *formula, const View &view)
    {
       unsigned long long   t = __mftb();
       int sput = 0;
 
-      int next_spu = 0;
+      u32 ticks[SPU_USAGE];
+      int rows = m_tune.rows;
       for (int i = 0; i < SPU_USAGE; i++)
       {
-         m_spu[i].sync = 1;
-         m_spu[i].response = 0;
+         ticks[i] = m_ring[i]->ticks;
       }
 
-      for (int j = 0; j < buffer->height;)
+      // The whole frame is queued up front, m_tune.rows lines a command,
+      // and they go round the SPU's.
+      for (int j = 0, c = 0; j < buffer->height; j += rows, c++)
       {
-         if (m_spu[next_spu].sync != 0)
-         {
-            sput += m_spu[next_spu].response;
-            m_spu[next_spu].sync = 0;
-            m_command[next_spu].start = x1;
-            m_command[next_spu].end = x2;
-            m_command[next_spu].yvalue = y1 + ((y2-y1) / buffer->height) * j;
-            m_command[next_spu].cmd = CMD_CALC;
-            m_command[next_spu].width = buffer->width;
-            m_command[next_spu].dest_ea = ptr2ea(&(buffer->ptr[j*buffer->width]));
-
-            (void)sysSpuThreadWriteSignal(m_spu[next_spu].id, 0, 1);
-
-            j++;
-         }
-         next_spu = (next_spu+1)%SPU_USAGE;
+         int            s = c % m_tune.spus;
+         spucommand_t  *command = Queue(s);
+
+         command->start = view.x1.hi;
+         command->end = view.x2.hi;
+         command->yvalue = view.y1.hi + (view.Height() / buffer->height) * j;
+         command->cmd = CMD_CALC;
+         command->width = buffer->width;
+         command->height = (buffer->height - j < rows) ? buffer->height - j : rows;
+         command->ystep = view.Height() / buffer->height;
+         Place(command, formula, view.x1, view.y1, view.Width() / buffer->width, view.Height() / buffer->height, 0, j);
+         command->stride = buffer->width;
+         command->flags = (m_histogram ? CMDF_HISTOGRAM : 0) | Unroll();
+         command->palette_ea = m_histogram ? ptr2ea(m_palette[m_palcur]) : 0;
+         command->dest_ea = ptr2ea(&(buffer->ptr[j*buffer->width]));
+
+         Push(s);
       }
 
       // Wait for all spus to finish.
+      WaitAll();
       for (int i = 0; i < SPU_USAGE; i++)
       {
-         while (m_spu[i].sync == 0);
-         sput += m_spu[next_spu].response;
+         sput += m_ring[i]->ticks - ticks[i];
       }
 
       t = __mftb() - t;
@@ -438,47 +866,1257 @@ public:
       // Ook 80MHz?
       sput = sput / 80;
       debugPrintf("sputijd: %d.%06d\n", sput / 1000000, sput % 1000000);
+
+      if (m_histogram)
+      {
+         Histogram();
+      }
    }
-private:
 
+   // --------------------------------------------------------------------
+   // Histogram colouring on or off. The palette of a frame comes from
+   // the histogram of the one before, so there is no extra pass over
+   // the pixels; the first frame starts from an even spread.
+   void SetHistogram(bool on)
+   {
+      if (on && !m_histogram)
+      {
+         uint32_t flat[PALETTE_SIZE];
 
-   u32            m_group_id;
-   sysSpuImage    m_image;
-   uint32_t      *m_array;
-   spucommand_t  *m_command;
-   spustr_t      *volatile m_spu;
+         for (int i = 0; i < PALETTE_SIZE; i++) flat[i] = 1;
+         palette_equalise(flat, m_palette[m_palcur]);
+      }
+      m_histogram = on;
+   }
 
-};
+   bool getHistogram(void) { return m_histogram; }
 
+   // --------------------------------------------------------------------
+   // Collect the histograms of all SPU's, add them in a tree and make the
+   // palette for the next frame.
+   void Histogram(void)
+   {
+      unsigned long long t = __mftb();
 
-// -----------------------------------------------------------------------
-// --------------- main ----------------------------------------------
-// -----------------------------------------------------------------------
-int main(s32 argc, const char* argv[])
-{
-   debugInit();
+      for (int i = 0; i < SPU_USAGE; i++)
+      {
+         spucommand_t *command = Queue(i);
 
-   MandelBrot         mandel;
-   RSXClass          *rsx = new RSXClass();
-   PadClass          *pad = new PadClass();
+         command->cmd = CMD_HISTOGRAM;
+         command->dest_ea = ptr2ea(m_hist[i]);
+         Push(i);
+      }
+      WaitAll();
 
-   SpuClass          *spu = new SpuClass();
+      palette_reduce(m_hist, SPU_USAGE);
 
+      m_palcur ^= 1;
+      palette_equalise(m_hist[0], m_palette[m_palcur]);
 
-   // Ok, everything is setup. Now for the main loop.
-   while(!pad->startPressed())
+      t = (__mftb() - t) / 80;
+      debugPrintf("histogram: %d us\n", (int)t);
+   }
+
+   // --------------------------------------------------------------------
+   // Distance estimate rendering, in tiles of DE_TILE x DE_TILE so the
+   // SPU's can skip whole disks of pixels outside the set. Returns the
+   // percentage of pixels that were skipped.
+   int CalcDE(rsxBuffer *buffer, const spucommand_t *formula, const View &view)
    {
-      pad->check();
+      u32 skipped = CalcTiles(buffer, CMD_CALC_DE, formula, view);
 
-      rsx->WaitFlip();
+      return (int)((100ULL * skipped) / (buffer->width * buffer->height));
+   }
 
-      //mandel.Render(rsx->getCurrentBuffer());
+   // --------------------------------------------------------------------
+   // Anti-aliased rendering: every tile is calculated at 1 sample per
+   // pixel, and only the pixels on an edge get AA_SAMPLES x AA_SAMPLES.
+   // Returns the percentage of pixels that were supersampled.
+   int CalcAA(rsxBuffer *buffer, const spucommand_t *formula, const View &view)
+   {
+      u32 edges = CalcTiles(buffer, CMD_CALC_AA, formula, view);
+
+      if (m_histogram)
+      {
+         Histogram();
+      }
+
+      return (int)((100ULL * edges) / (buffer->width * buffer->height));
+   }
+
+   // --------------------------------------------------------------------
+   // Plain rendering, but in tiles so every tile's cost can be measured.
+   void CalcProfile(rsxBuffer *buffer, const spucommand_t *formula, const View &view)
+   {
+      CalcTiles(buffer, CMD_CALC, formula, view);
+
+      if (m_histogram)
+      {
+         Histogram();
+      }
+   }
+
+   // --------------------------------------------------------------------
+   // Progressive rendering of a view that stands still. Pass @pass adds
+   // one sample per pixel to m_accum, at its own place in the pixel, and
+   // shows the average of all passes so far. The places follow the Halton
+   // sequence in base 2 and 3 from its second point on, away from the
+   // corner. Pass 0 starts the sums over and replaces the frame on the
+   // screen, which can still have previews from when the view moved.
+   // Returns false when there is no memory for the sums, nothing is drawn
+   // then.
+   bool Accumulate(rsxBuffer *buffer, const spucommand_t *formula, const View &view, u32 pass)
+   {
+      double dx = Halton(pass + 1, 2) * view.Width() / buffer->width;
+      double dy = Halton(pass + 1, 3) * view.Height() / buffer->height;
+      View   shifted;
+
+      if (m_accum == NULL)
+      {
+         m_accum = (uint16_t*)arena_alloc(&m_arena, buffer->width * buffer->height * 4 * sizeof(uint16_t), 128);
+      }
+      if (m_accum == NULL)
+      {
+         return false;
+      }
+
+      m_pass = pass;
+      shifted.x1 = dd_add_d(view.x1, dx);
+      shifted.x2 = dd_add_d(view.x2, dx);
+      shifted.y1 = dd_add_d(view.y1, dy);
+      shifted.y2 = dd_add_d(view.y2, dy);
+      CalcTiles(buffer, CMD_ACCUMULATE, formula, shifted);
+      return true;
+   }
+
+   // --------------------------------------------------------------------
+   // Plain rendering that has to be done in @us. The tiles go out from
+   // the middle of the screen, where the eye is, to the edges, a few at a
+   // time per SPU; once the time left is only enough for the rest as
+   // coarse previews, they get those. A tile that only got a preview is
+   // nearer the front the next frame, for every frame it waited, so the
+   // edges catch up when the view slows down. The tiles that Speculate
+   // put in @reuse (-1 for none) for this view are only copied. Returns
+   // the number of tiles that got a preview.
+   u32 CalcDeadline(rsxBuffer *buffer, const spucommand_t *formula, const View &view, u32 us, int reuse)
+   {
+      unsigned long long   start = __mftb();
+      unsigned long long   deadline = (unsigned long long)us * 80;   // 80 ticks per us
+      int                  tilesx = (buffer->width + DE_TILE - 1) / DE_TILE;
+      const u8            *done = NULL;
+      u32                  before[SPU_USAGE];
+      u32                  ticks = 0;
+      int                  tiles;
+      int                  full;
+
+      if (reuse >= 0 && m_spec[reuse].ptr != NULL &&
+          m_spec[reuse].width == buffer->width && m_spec[reuse].height == buffer->height)
+      {
+         done = m_specDone[reuse];
+      }
 
-      spu->Calc2(rsx->getCurrentBuffer(), mandel.get_x1(), mandel.get_x2(), mandel.get_y1(), mandel.get_y2());
-      rsx->Flip();
+      for (int i = 0; i < SPU_USAGE; i++)
+      {
+         before[i] = m_ring[i]->ticks;
+      }
+
+      tiles = OrderTiles(buffer, done, true);
+
+      for (full = 0; full < tiles; full++)
+      {
+         int t = m_order[full] & 0xffff;
+         int s = Shortest();
+
+         while (m_ring[s]->head - m_ring[s]->tail >= DEADLINE_DEPTH)
+         {
+            for (u32 i = 0; i < m_tune.spus; i++)
+            {
+               Wake(i, DEADLINE_DEPTH - 1);
+            }
+            Harvest();
+            s = Shortest();
+         }
+
+         // This tile behind what its SPU still has, then the rest as
+         // previews on all of them.
+         unsigned long long queued = m_ring[s]->head - m_ring[s]->tail;
+         unsigned long long rest = (unsigned long long)(tiles - full - 1) * m_tileCost / PREVIEW_COST / m_tune.spus;
+
+         if (__mftb() - start + (queued + 1) * m_tileCost + rest > deadline) break;
+
+         TileCommand(s, buffer, CMD_CALC, formula, view, t);
+         Push(s);
+         m_age[t] = 0;
+      }
+
+      for (int k = full; k < tiles; k++)
+      {
+         int t = m_order[k] & 0xffff;
+         int s = k % m_tune.spus;
+
+         TileCommand(s, buffer, CMD_PREVIEW, formula, view, t);
+         Push(s);
+         if (m_age[t] < DEADLINE_AGE) m_age[t]++;
+      }
+
+      // The copies last, they are only DMA and don't change the deadline.
+      for (int t = 0, k = 0; done != NULL && t < MaxTiles(buffer); t++)
+      {
+         if (!done[t]) continue;
+
+         int            s = k++ % m_tune.spus;
+         spucommand_t  *command = TileCommand(s, buffer, CMD_COPY, formula, view, t);
+
+         command->src_ea = ptr2ea(&m_spec[reuse].ptr[(t / tilesx) * DE_TILE * buffer->width + (t % tilesx) * DE_TILE]);
+         Push(s);
+         m_age[t] = 0;
+      }
+
+      WaitAll();
+      for (int i = 0; i < SPU_USAGE; i++)
+      {
+         ticks += m_ring[i]->ticks - before[i];
+      }
+
+      // What a whole tile costs an SPU, a preview counts for a part of one.
+      u32 units = full * PREVIEW_COST + (tiles - full);
+      u32 cost = units ? (u32)(((unsigned long long)ticks * PREVIEW_COST) / units) : 0;
+      m_tileCost = m_tileCost ? (3 * m_tileCost + cost) / 4 : cost;
+
+      if (m_histogram)
+      {
+         Histogram();
+      }
 
-      mandel.Move(pad->stickLH()*0.1, pad->stickLV()*0.1);
-      mandel.Zoom(1.0 + pad->stickRV()*0.05);
+      return tiles - full;
+   }
+
+   // --------------------------------------------------------------------
+   // The spare time of a quick frame, @us, goes to tiles of a view to
+   // come: into reuse buffer @slot, from the middle out, after the ones
+   // it has already. CalcDeadline copies them once that view is there.
+   // Nothing is done before a frame measured the cost of a tile, or with
+   // the histogram colouring, whose palette changes every frame, or when
+   // there is no memory for the pixels. Returns the number of tiles the
+   // slot has.
+   u32 Speculate(int slot, rsxBuffer *buffer, const spucommand_t *formula, const View &view, u32 us)
+   {
+      unsigned long long   start = __mftb();
+      unsigned long long   deadline = (unsigned long long)us * 80;
+      rsxBuffer           *spec = &m_spec[slot];
+      u32                  counted[KERNEL_PREC_COUNT];
+      int                  tiles;
+
+      if (m_tileCost == 0 || m_histogram) return m_specTiles[slot];
+
+      if (spec->ptr == NULL)
+      {
+         spec->ptr = (uint32_t*)arena_alloc(&m_arena, buffer->width * buffer->height * sizeof(uint32_t), 128);
+         spec->width = buffer->width;
+         spec->height = buffer->height;
+      }
+      if (spec->ptr == NULL)
+      {
+         return m_specTiles[slot];
+      }
+
+      // Precisions only counts the tiles of frames that are shown.
+      memcpy(counted, m_precision, sizeof(counted));
+
+      tiles = OrderTiles(spec, m_specDone[slot], false);
+
+      for (int k = 0; k < tiles; k++)
+      {
+         int t = m_order[k] & 0xffff;
+         int s = Shortest();
+
+         while (m_ring[s]->head - m_ring[s]->tail >= DEADLINE_DEPTH)
+         {
+            for (u32 i = 0; i < m_tune.spus; i++)
+            {
+               Wake(i, DEADLINE_DEPTH - 1);
+            }
+            Harvest();
+            s = Shortest();
+         }
+
+         unsigned long long queued = m_ring[s]->head - m_ring[s]->tail;
+         if (__mftb() - start + (queued + 1) * m_tileCost > deadline) break;
+
+         TileCommand(s, spec, CMD_CALC, formula, view, t);
+         Push(s);
+         m_specDone[slot][t] = 1;
+         m_specTiles[slot]++;
+      }
+
+      WaitAll();
+      memcpy(m_precision, counted, sizeof(counted));
+      return m_specTiles[slot];
+   }
+
+   // --------------------------------------------------------------------
+   // Reuse buffer @slot is for another view from now on.
+   void Forget(int slot)
+   {
+      memset(m_specDone[slot], 0, MAX_TILES);
+      m_specTiles[slot] = 0;
+   }
+
+   u32 Speculated(int slot) { return m_specTiles[slot]; }
+
+   // --------------------------------------------------------------------
+   // Commands of every KERNEL_PREC_* since the last call, into @counts.
+   // Tiles of views to come are left out, they are not on the screen.
+   void Precisions(u32 *counts)
+   {
+      for (int i = 0; i < KERNEL_PREC_COUNT; i++)
+      {
+         counts[i] = m_precision[i];
+         m_precision[i] = 0;
+      }
+   }
+
+   // --------------------------------------------------------------------
+   // With profiling on the tiled modes measure every tile, draw the heat
+   // over the frame and print the most expensive tiles.
+   void SetProfiling(bool on) { m_profiling = on; }
+   bool getProfiling(void) { return m_profiling; }
+
+   // --------------------------------------------------------------------
+   // Time every formula on the same view, so a change to one of the
+   // kernels shows up as a change in its pixel rate.
+   void Benchmark(rsxBuffer *buffer, const View &view)
+   {
+      static const char *name[FORMULA_COUNT] = { "mandel", "julia", "multibrot", "burningship", "tricorn" };
+      const int          frames = 10;
+      spucommand_t       formula;
+
+      for (int f = 0; f < FORMULA_COUNT; f++)
+      {
+         kernel_formula(&formula, NULL);
+         formula.formula = f;
+         formula.power = 3;
+         formula.cre = -0.8;
+         formula.cim = 0.156;
+
+         unsigned long long t = __mftb();
+         for (int i = 0; i < frames; i++)
+         {
+            Calc2(buffer, &formula, view);
+         }
+         t = (__mftb() - t) / 80;   // 80 ticks per us
+
+         unsigned long long pixels = (unsigned long long)buffer->width * buffer->height * frames;
+         debugPrintf("bench %-12s %6d us/frame %6d Mpixel/s\n", name[f],
+                     (int)(t / frames), (int)(t ? pixels / t : 0));
+      }
+
+      // The pixels of the view once more as loose points, in a scrambled
+      // order, through Points: the same work without the grid.
+      u32      n = buffer->width * buffer->height;
+      float   *px = (float*)memalign(128, n * sizeof(float));
+      float   *py = (float*)memalign(128, n * sizeof(float));
+      uint8_t *count = (uint8_t*)memalign(128, n);
+
+      if (px && py && count)
+      {
+         for (u32 i = 0; i < n; i++)
+         {
+            u32 p = (u32)(((unsigned long long)i * 7919) % n);
+
+            px[i] = view.x1.hi + view.Width() * (p % buffer->width) / buffer->width;
+            py[i] = view.y1.hi + view.Height() * (p / buffer->width) / buffer->height;
+         }
+
+         unsigned long long t = __mftb();
+         for (int i = 0; i < frames; i++)
+         {
+            Points(NULL, px, py, n, count, NULL);
+         }
+         t = (__mftb() - t) / 80;
+
+         debugPrintf("bench %-12s %6d us/frame %6d Mpoint/s\n", "points",
+                     (int)(t / frames), (int)(t ? (unsigned long long)n * frames / t : 0));
+      }
+      free(px);
+      free(py);
+      free(count);
+   }
+
+   // --------------------------------------------------------------------
+   // Escape counts of @n points anywhere, at x[i], y[i], with the formula
+   // of @formula (NULL is the Mandelbrot): the same as kernel_points, in
+   // the vector kernels of the SPU's. The points go round the SPU's in
+   // chunks of POINTS_CHUNK. The DMA wants the arrays 16 byte aligned;
+   // the last n % 16 points, or all of them when an array is not, are
+   // done here on the PPU.
+   void Points(const spucommand_t *formula, const float *x, const float *y, u32 n,
+               uint8_t *count, float *smooth)
+   {
+      u32 aligned = ((ptr2ea(x) | ptr2ea(y) | ptr2ea(count) | ptr2ea(smooth)) & 15) ? 0 : n & ~15;
+      u32 c = 0;
+
+      for (u32 first = 0; first < aligned; first += POINTS_CHUNK, c++)
+      {
+         int            s = c % m_tune.spus;
+         spucommand_t  *command = Queue(s);
+
+         command->cmd = CMD_POINTS;
+         command->width = (aligned - first < POINTS_CHUNK) ? aligned - first : POINTS_CHUNK;
+         command->flags = Unroll();
+         command->x_ea = ptr2ea(&x[first]);
+         command->y_ea = ptr2ea(&y[first]);
+         command->dest_ea = ptr2ea(&count[first]);
+         command->smooth_ea = smooth ? ptr2ea(&smooth[first]) : 0;
+         kernel_formula(command, formula);
+
+         Push(s);
+      }
+
+      // The rest while the SPU's work.
+      spucommand_t rest;
+      kernel_formula(&rest, formula);
+      kernel_points(&rest, &x[aligned], &y[aligned], n - aligned, &count[aligned], smooth ? &smooth[aligned] : NULL);
+
+      WaitAll();
+   }
+
+   // --------------------------------------------------------------------
+   // The configuration of the last tuning, from @path. Returns false when
+   // there is none yet.
+   bool LoadTune(const char *path)
+   {
+      if (tune_load(&m_tune, path, SPU_USAGE) != 0) return false;
+
+      debugPrintf("tune: %d spus, %d rows, unroll %d\n", m_tune.spus, m_tune.rows, m_tune.unroll);
+      return true;
+   }
+
+   // --------------------------------------------------------------------
+   // Measure the configurations on a few views of the Mandelbrot set, keep
+   // the fastest and write it to @path. Takes a few seconds.
+   void Tune(rsxBuffer *buffer, const char *path)
+   {
+      tune_t tune = m_tune;
+
+      m_tuneBuffer = buffer;
+      tune_search(&tune, SPU_USAGE, Measure, this);
+      m_tune = tune;
+
+      debugPrintf("tune: %d spus, %d rows, unroll %d\n", m_tune.spus, m_tune.rows, m_tune.unroll);
+      if (tune_save(&m_tune, path) != 0)
+      {
+         debugPrintf("tune: %s not written\n", path);
+      }
+   }
+
+   // --------------------------------------------------------------------
+   // Calculate a list of tiles, each one into its own buffer of iteration
+   // counts. Fits the tilecache_compute_t of the tile cache.
+   static int Compute(void *ctx, const spucommand_t *commands, uint8_t *const *out, uint32_t count)
+   {
+      SpuClass *self = (SpuClass*)ctx;
+      uint32_t  batch = self->m_tune.spus*COMPUTE_BATCH;
+
+      // As many as there are buffers for at a time.
+      for (uint32_t first = 0; first < count; first += batch)
+      {
+         uint32_t n = (count - first < batch) ? count - first : batch;
+
+         for (uint32_t t = 0; t < n; t++)
+         {
+            int            s = t % self->m_tune.spus;
+            spucommand_t  *command = self->Queue(s);
+
+            *command = commands[first + t];
+            command->flags |= self->Unroll();
+            command->stride = TILECACHE_TILE;
+            command->dest_ea = ptr2ea(self->m_tile[t]);
+            self->Push(s);
+         }
+
+         self->WaitAll();
+         for (uint32_t t = 0; t < n; t++)
+         {
+            self->StoreTile(t, out[first + t]);
+         }
+      }
+
+      return 0;
+   }
+
+private:
+   // --------------------------------------------------------------------
+   // The next free place in the ring of @spu, cleared. When the ring is
+   // full the PPU sleeps until the SPU has done half of it.
+   spucommand_t* Queue(int spu)
+   {
+      volatile spuring_t *ring = m_ring[spu];
+
+      while (ring->head - ring->tail >= SPU_RING)
+      {
+         Wake(spu, SPU_RING / 2);
+         Harvest();
+      }
+
+      spucommand_t *command = &m_ring[spu]->command[ring->head % SPU_RING];
+      memset(command, 0, sizeof(spucommand_t));
+      return command;
+   }
+
+   // --------------------------------------------------------------------
+   // Hand the command of the last Queue() to the SPU. It is only signalled
+   // when it had finished everything before, so it may be asleep; the SPU
+   // writes its tail before it reads the head, the PPU the other way round,
+   // so one of the two always sees the other.
+   void Push(int spu)
+   {
+      volatile spuring_t *ring = m_ring[spu];
+      u32                 head = ring->head;
+
+      __lwsync();             // The command before the head
+      ring->head = head + 1;
+      __sync();               // The head before the tail is read
+
+      if (ring->tail == head)
+      {
+         (void)sysSpuThreadWriteSignal(m_spu[spu].id, 0, 1);
+      }
+   }
+
+   // --------------------------------------------------------------------
+   // Sleep until every ring is empty.
+   void WaitAll(void)
+   {
+      for (int i = 0; i < SPU_USAGE; i++)
+      {
+         volatile spuring_t *ring = m_ring[i];
+
+         while (ring->tail != ring->head)
+         {
+            Harvest();
+         }
+      }
+   }
+
+   // --------------------------------------------------------------------
+   // Ask the SPU for an event as soon as its ring is down to @depth
+   // commands. Harvest() reads the tails after the wake is written, the
+   // SPU reads the wake after its tail, so one of the two sees the other.
+   void Wake(int spu, u32 depth)
+   {
+      volatile spuring_t *ring = m_ring[spu];
+
+      ring->wake = ring->head - depth;
+   }
+
+   // --------------------------------------------------------------------
+   // Back at once when a tail has moved since the last look, otherwise
+   // sleep in the event queue until an SPU has emptied its ring or got to
+   // its wake. The other events that are there are taken as well. They
+   // only say something changed, the rings themselves tell what.
+   void Harvest(void)
+   {
+      sys_event_t    event[16];
+      s32            n = 0;
+      bool           moved = false;
+
+      __sync();               // The wakes before the tails are read
+
+      for (int i = 0; i < SPU_USAGE; i++)
+      {
+         u32 tail = ((volatile spuring_t*)m_ring[i])->tail;
+
+         if (tail != m_seen[i])
+         {
+            m_seen[i] = tail;
+            moved = true;
+         }
+      }
+
+      if (moved)
+      {
+         (void)sysEventQueueTryReceive(m_queue, &event[0], 16, &n);
+         return;
+      }
+
+      if (sysEventQueueReceive(m_queue, &event[0], 0) != 0) return;
+      (void)sysEventQueueTryReceive(m_queue, &event[1], 15, &n);
+   }
+
+   // --------------------------------------------------------------------
+   // Hand out the screen in tiles of DE_TILE x DE_TILE with command @cmd,
+   // and add up what the SPU's report in spustr_t.skipped.
+   u32 CalcTiles(rsxBuffer *buffer, u32 cmd, const spucommand_t *formula, const View &view)
+   {
+      int      tilesx = (buffer->width + DE_TILE - 1) / DE_TILE;
+      int      tiles = tilesx * ((buffer->height + DE_TILE - 1) / DE_TILE);
+      u32      skipped = 0;
+      u32      before[SPU_USAGE];
+
+      for (int i = 0; i < SPU_USAGE; i++)
+      {
+         before[i] = m_ring[i]->skipped;
+      }
+
+      for (int t = 0; t < tiles; t++)
+      {
+         int            s = t % m_tune.spus;
+         spucommand_t  *command = TileCommand(s, buffer, cmd, formula, view, t);
+
+         if (cmd == CMD_ACCUMULATE)
+         {
+            int x = (t % tilesx) * DE_TILE;
+            int y = (t / tilesx) * DE_TILE;
+
+            command->accum_ea = ptr2ea(&m_accum[(y*buffer->width + x) * 4]);
+            command->pass = m_pass;
+         }
+
+         if (m_profiling && t < MAX_TILES)
+         {
+            command->flags |= CMDF_PROFILE;
+            command->cost_ea = ptr2ea(&m_cost[t]);
+         }
+
+         Push(s);
+      }
+
+      WaitAll();
+      for (int i = 0; i < SPU_USAGE; i++)
+      {
+         skipped += m_ring[i]->skipped - before[i];
+      }
+
+      if (m_profiling)
+      {
+         Profile(buffer, tiles < MAX_TILES ? tiles : MAX_TILES, tilesx);
+      }
+
+      return skipped;
+   }
+
+   // --------------------------------------------------------------------
+   // Queue tile @t of the screen, in tiles of DE_TILE x DE_TILE, for SPU
+   // @spu with command @cmd. The caller adds what else the command needs
+   // and pushes it.
+   spucommand_t* TileCommand(int spu, rsxBuffer *buffer, u32 cmd, const spucommand_t *formula,
+                             const View &view, int t)
+   {
+      double         xstep = view.Width() / buffer->width;
+      double         ystep = view.Height() / buffer->height;
+      int            tilesx = (buffer->width + DE_TILE - 1) / DE_TILE;
+      int            x = (t % tilesx) * DE_TILE;
+      int            y = (t / tilesx) * DE_TILE;
+      spucommand_t  *command = Queue(spu);
+
+      command->cmd = cmd;
+      command->width = (buffer->width - x < DE_TILE) ? buffer->width - x : DE_TILE;
+      command->height = (buffer->height - y < DE_TILE) ? buffer->height - y : DE_TILE;
+      if (cmd != CMD_COPY)
+      {
+         Place(command, formula, view.x1, view.y1, xstep, ystep, x, y);
+      }
+
+      // Distance estimation only has a float kernel. The main loop turns
+      // it off for views that need more, this only keeps a tile of one
+      // from going to the wrong kernel.
+      if (cmd == CMD_CALC_DE && command->precision != KERNEL_PREC_FLOAT)
+      {
+         cmd = command->cmd = CMD_CALC;
+      }
+
+      command->start = view.x1.hi + xstep * x;
+      command->end = command->start + xstep * command->width;
+      command->yvalue = view.y1.hi + ystep * y;
+      command->ystep = ystep;
+      command->stride = buffer->width;
+      command->dest_ea = ptr2ea(&(buffer->ptr[y*buffer->width + x]));
+      command->flags = (((cmd == CMD_CALC || cmd == CMD_CALC_AA) && m_histogram) ? CMDF_HISTOGRAM : 0) | Unroll();
+      command->palette_ea = (cmd != CMD_CALC_DE && m_histogram) ? ptr2ea(m_palette[m_palcur]) : 0;
+      command->samples = AA_SAMPLES;
+      command->threshold = AA_THRESHOLD;
+
+      return command;
+   }
+
+   // --------------------------------------------------------------------
+   // The formula and the double fields of @command, whose first pixel is
+   // @x, @y pixels from the corner @x1, @y1 of the view, and the cheapest
+   // precision its pixels can have with that formula. The AA kernel
+   // samples a fraction of a pixel apart.
+   void Place(spucommand_t *command, const spucommand_t *formula, ddouble_t x1, ddouble_t y1,
+              double xstep, double ystep, int x, int y)
+   {
+      double      step = fmin(fabs(xstep), fabs(ystep));
+
+      if (command->cmd == CMD_CALC_AA) step /= AA_SAMPLES;
+
+      kernel_formula(command, formula);
+      kernel_place(command, dd_add_d(x1, xstep * x), dd_add_d(y1, ystep * y), xstep, ystep, step);
+      m_precision[command->precision]++;
+   }
+
+   // --------------------------------------------------------------------
+   // The ring of the SPU's in use with the fewest commands in it.
+   int Shortest(void)
+   {
+      int best = 0;
+
+      for (u32 i = 1; i < m_tune.spus; i++)
+      {
+         if (m_ring[i]->head - m_ring[i]->tail < m_ring[best]->head - m_ring[best]->tail) best = i;
+      }
+
+      return best;
+   }
+
+   // --------------------------------------------------------------------
+   // Tiles of DE_TILE x DE_TILE of @buffer, at most MAX_TILES.
+   int MaxTiles(rsxBuffer *buffer)
+   {
+      int tiles = ((buffer->width + DE_TILE - 1) / DE_TILE) * ((buffer->height + DE_TILE - 1) / DE_TILE);
+
+      return tiles > MAX_TILES ? MAX_TILES : tiles;
+   }
+
+   // --------------------------------------------------------------------
+   // The tiles of @buffer in m_order, the middle first, without the ones
+   // marked in @skip (NULL for none). Squared distance to the middle in
+   // half tiles, halved for every frame the tile waited when @aged; the
+   // tile number in the low bits. Returns how many there are.
+   int OrderTiles(rsxBuffer *buffer, const u8 *skip, bool aged)
+   {
+      int tilesx = (buffer->width + DE_TILE - 1) / DE_TILE;
+      int tilesy = (buffer->height + DE_TILE - 1) / DE_TILE;
+      int tiles = MaxTiles(buffer);
+      int n = 0;
+
+      for (int t = 0; t < tiles; t++)
+      {
+         int dx = 2 * (t % tilesx) + 1 - tilesx;
+         int dy = 2 * (t / tilesx) + 1 - tilesy;
+
+         if (skip != NULL && skip[t]) continue;
+         m_order[n++] = ((u32)(dx*dx + dy*dy) >> (aged ? m_age[t] : 0)) << 16 | t;
+      }
+      qsort(m_order, n, sizeof(u32), CompareOrder);
+
+      return n;
+   }
+
+   // --------------------------------------------------------------------
+   static int CompareOrder(const void *a, const void *b)
+   {
+      u32 ua = *(const u32*)a;
+      u32 ub = *(const u32*)b;
+
+      return ua < ub ? -1 : ua > ub;
+   }
+
+   // --------------------------------------------------------------------
+   // The costs of the tiles of the last CalcTiles. Only the outlines of the
+   // tiles are drawn, the PPU reads from RSX memory very slowly.
+   void Profile(rsxBuffer *buffer, int tiles, int tilesx)
+   {
+      profiletile_t top[PROFILE_TOP];
+
+      profile_reset(&m_profile);
+      for (int t = 0; t < tiles; t++)
+      {
+         int x = (t % tilesx) * DE_TILE;
+         int y = (t / tilesx) * DE_TILE;
+
+         profile_add(&m_profile, x, y, DE_TILE, DE_TILE, m_cost[t].ticks, m_cost[t].iterations);
+      }
+
+      profile_heatmap(&m_profile, buffer->ptr, buffer->width, buffer->height, PROFILE_OUTLINE);
+
+      u32 n = profile_top(&m_profile, top, 5);
+      debugPrintf("profile: %d us in the SPU's, %d Miterations, worst tiles:",
+                  (int)(m_profile.ticks / 80), (int)(m_profile.iterations / 1000000));
+      for (u32 i = 0; i < n; i++)
+      {
+         debugPrintf(" %d,%d %dus/%dk", top[i].x, top[i].y, top[i].ticks / 80, top[i].iterations / 1000);
+      }
+      debugPrintf("\n");
+   }
+
+   // --------------------------------------------------------------------
+   // The time of TUNE_FRAMES frames of every view with @tune, in ticks.
+   // The whole set is mostly cheap pixels, the seahorse valley expensive
+   // ones in long thin filaments.
+   static uint64_t Measure(void *ctx, const tune_t *tune)
+   {
+      static const View  view[2] =
+      {
+         { { -2.0,  0 }, {  1.0,  0 }, { -1.5,  0 }, { 1.5,  0 } },
+         { { -0.80, 0 }, { -0.70, 0 }, {  0.05, 0 }, { 0.15, 0 } },
+      };
+      SpuClass          *self = (SpuClass*)ctx;
+      spucommand_t       formula;
+      unsigned long long t = __mftb();
+
+      kernel_formula(&formula, NULL);
+      self->m_tune = *tune;
+
+      for (int v = 0; v < 2; v++)
+      {
+         for (int i = 0; i < TUNE_FRAMES; i++)
+         {
+            self->Calc2(self->m_tuneBuffer, &formula, view[v]);
+         }
+      }
+
+      t = __mftb() - t;
+      debugPrintf("tune: %d spus, %d rows, unroll %d: %d us\n", tune->spus, tune->rows, tune->unroll, (int)(t / 80));
+      return t;
+   }
+
+   // --------------------------------------------------------------------
+   // The kernel flag of the tuned unroll.
+   u32 Unroll(void)
+   {
+      return m_tune.unroll == 2 ? CMDF_UNROLL : 0;
+   }
+
+   // --------------------------------------------------------------------
+   // Point @i of the van der Corput sequence in @base, in [0, 1).
+   static float Halton(u32 i, u32 base)
+   {
+      float f = 1.0f;
+      float r = 0.0f;
+
+      while (i > 0)
+      {
+         f /= base;
+         r += f * (i % base);
+         i /= base;
+      }
+
+      return r;
+   }
+
+   // --------------------------------------------------------------------
+   // The SPU writes pixels, the cache keeps the iteration count only.
+   void StoreTile(int tile, uint8_t *out)
+   {
+      for (int i = 0; i < TILECACHE_BYTES; i++)
+      {
+         out[i] = m_tile[tile][i] & 0xff;
+      }
+   }
+
+   u32            m_group_id;
+   sysSpuImage    m_image;
+   arena_t        m_arena;
+   uint32_t      *m_array;
+   spuring_t     *m_ring[6];
+   u32            m_seen[6];         // Harvest: the tails as they were last looked at
+   spustr_t      *volatile m_spu;
+   uint32_t      *m_tile[SPU_USAGE*COMPUTE_BATCH];
+   uint32_t      *m_hist[6];
+   uint32_t      *m_palette[2];      // The one in use, and the next one
+   bool           m_histogram;
+   int            m_palcur;
+   sys_event_queue_t m_queue;
+   spucost_t     *m_cost;
+   profile_t      m_profile;
+   bool           m_profiling;
+   uint16_t      *m_accum;           // Sums of the passes of Accumulate, 4 per pixel
+   u32            m_pass;
+   tune_t         m_tune;
+   rsxBuffer     *m_tuneBuffer;      // Where Measure renders
+   u32           *m_order;           // CalcDeadline: priority << 16 | tile
+   u8            *m_age;             // CalcDeadline: frames since the tile had its full quality
+   u32            m_tileCost;        // CalcDeadline: ticks of a whole tile on one SPU, a running average
+   bool           m_ready;           // The SPU's run
+   rsxBuffer      m_spec[SPEC_VIEWS];       // Speculate: pixels of the views to come
+   u8            *m_specDone[SPEC_VIEWS];   // Speculate: which tiles of them are there
+   u32            m_specTiles[SPEC_VIEWS];
+   u32            m_precision[KERNEL_PREC_COUNT];   // Commands of every precision since Precisions
+
+};
+
+
+// -----------------------------------------------------------------------
+// The REPLAY_MODE_* bits of how the frames are rendered.
+static u8 RenderMode(bool cached, bool de, bool aa, SpuClass *spu)
+{
+   return (cached ? REPLAY_MODE_CACHED : 0) | (de ? REPLAY_MODE_DE : 0) |
+          (aa ? REPLAY_MODE_AA : 0) | (spu->getHistogram() ? REPLAY_MODE_HISTOGRAM : 0) |
+          (spu->getProfiling() ? REPLAY_MODE_PROFILE : 0);
+}
+
+// -----------------------------------------------------------------------
+// --------------- main ----------------------------------------------
+// -----------------------------------------------------------------------
+int main(s32 argc, const char* argv[])
+{
+   debugInit();
+
+   MandelBrot         mandel;
+   RSXClass          *rsx = new RSXClass();
+   PadClass          *pad = new PadClass();
+
+   SpuClass          *spu = new SpuClass();
+
+   if (!rsx->Ready() || !spu->Ready())
+   {
+      delete spu;
+      delete rsx;
+      delete pad;
+      debugStop();
+      return 1;
+   }
+
+   // The fastest configuration for this machine, measured the first time.
+   // L2 measures it again.
+   if (!spu->LoadTune(TUNE_PATH))
+   {
+      spu->Tune(rsx->getCurrentBuffer(), TUNE_PATH);
+   }
+
+   // Select switches to rendering from the tile cache on the harddisk.
+   tilecache_t        cache;
+   bool               haveCache = tilecache_open(&cache, TILECACHE_PATH, TILECACHE_SLOTS) == 0;
+   bool               cached = false;
+
+   // Circle switches to distance estimation, for the formulas that have it.
+   bool               de = false;
+
+   // Cross switches to anti-aliasing of the edges.
+   bool               aa = false;
+
+   // L3 records the pad to REPLAY_PATH, R3 plays the recording back as
+   // fast as the SPU's go, without showing it, and prints the frame times.
+   replay_t           rec;
+   bool               recording = false;
+   replay_t           play;
+   bool               playing = false;
+   u32               *times = NULL;
+   u32                played = 0;
+   u32                drift = 0;
+
+   // A view that stands still is not calculated again. In the plain mode
+   // the SPU's add passes to it instead, until ACCUM_PASSES are in; the
+   // other modes keep the frame that is on the screen.
+   replayframe_t      last;
+   bool               haveLast = false;
+   u32                pass = 0;
+   bool               flipping = true;     // RSXClass flipped once already
+
+   // While a moving view waits for its vsync the SPU's calculate tiles of
+   // the views to come, the next one first. spec[] is the view every
+   // reuse buffer of SpuClass::Speculate is for.
+   Predictor          predictor;
+   replayframe_t      spec[SPEC_VIEWS];
+   bool               specValid[SPEC_VIEWS] = { false };
+
+   // Ok, everything is setup. Now for the main loop.
+   while(!pad->startPressed())
+   {
+      replayframe_t        frame;
+      bool                 replayed = false;
+      bool                 paced = false;
+      unsigned long long   t = __mftb();
+      unsigned long long   shown = t;           // When the frame before went on the screen
+
+      if (playing && (played >= play.frames || !replay_read(&play, &frame)))
+      {
+         replaysummary_t sum;
+
+         replay_summary(times, played, &sum);
+         debugPrintf("replay: %u frames, mean %u us, median %u us, 95%% %u us, max %u us, %u frames off the recorded view\n",
+                     sum.frames, sum.mean, sum.median, sum.p95, sum.max, drift);
+
+         replay_close(&play);
+         free(times);
+         times = NULL;
+         playing = false;
+      }
+
+      if (playing)
+      {
+         // The first frame puts everything back the way it was.
+         if (played == 0)
+         {
+            mandel.Load(&frame);
+            cached = (frame.mode & REPLAY_MODE_CACHED) && haveCache;
+            de = (frame.mode & REPLAY_MODE_DE) != 0;
+            aa = (frame.mode & REPLAY_MODE_AA) != 0;
+            spu->SetHistogram((frame.mode & REPLAY_MODE_HISTOGRAM) != 0);
+            spu->SetProfiling((frame.mode & REPLAY_MODE_PROFILE) != 0);
+         }
+         else if (!mandel.Same(&frame))
+         {
+            drift++;
+         }
+
+         pad->Load(&frame, played == 0);
+         replayed = true;
+      }
+      else
+      {
+         pad->check();
+
+         // Every flip is waited for once, a frame that stayed had none.
+         if (flipping)
+         {
+            rsx->WaitFlip();
+            flipping = false;
+            shown = __mftb();
+         }
+      }
+
+      if (recording)
+      {
+         pad->Save(&frame);
+         mandel.Save(&frame);
+         frame.mode = RenderMode(cached, de, aa, spu);
+         replay_write(&rec, &frame);
+      }
+
+      //mandel.Render(rsx->getCurrentBuffer());
+
+      if (pad->pressed(PadClass::L3) && !playing)
+      {
+         if (recording)
+         {
+            debugPrintf("recorded %u frames\n", rec.frames);
+            replay_close(&rec);
+            recording = false;
+         }
+         else
+         {
+            recording = replay_create(&rec, REPLAY_PATH) == 0;
+         }
+      }
+      if (pad->pressed(PadClass::R3) && !playing)
+      {
+         if (recording)
+         {
+            replay_close(&rec);
+            recording = false;
+         }
+         if (replay_open(&play, REPLAY_PATH) == 0)
+         {
+            times = (u32*)malloc((play.frames + 1) * sizeof(u32));
+            played = 0;
+            drift = 0;
+            playing = true;
+         }
+      }
+      if (pad->pressed(PadClass::SELECT))
+      {
+         cached = !cached && haveCache;
+      }
+      if (pad->pressed(PadClass::CIRCLE)) de = !de;
+      if (pad->pressed(PadClass::CROSS)) aa = !aa;
+      if (pad->pressed(PadClass::R2)) spu->SetProfiling(!spu->getProfiling());
+      if (pad->pressed(PadClass::SQUARE)) spu->SetHistogram(!spu->getHistogram());
+      if (pad->pressed(PadClass::L1)) mandel.NextFormula(-1);
+      if (pad->pressed(PadClass::R1)) mandel.NextFormula(1);
+      if (pad->pressed(PadClass::LEFT)) mandel.AdjustFormula(-1, 0);
+      if (pad->pressed(PadClass::RIGHT)) mandel.AdjustFormula(1, 0);
+      if (pad->pressed(PadClass::UP)) mandel.AdjustFormula(0, 1);
+      if (pad->pressed(PadClass::DOWN)) mandel.AdjustFormula(0, -1);
+      if (pad->pressed(PadClass::L2)) spu->Tune(rsx->getCurrentBuffer(), TUNE_PATH);
+      if (pad->pressed(PadClass::TRIANGLE))
+      {
+         spu->Benchmark(rsx->getCurrentBuffer(), mandel.get_view());
+      }
+
+      predictor.Add(pad->stickLH(), pad->stickLV(), pad->stickRV());
+
+      replayframe_t  view;
+      // Distance estimation only has the float kernel. A view that needs
+      // more is plain escape time as a whole, not tile by tile.
+      bool           deOn = de && (mandel.get_formula()->formula == FORMULA_MANDEL ||
+                                   mandel.get_formula()->formula == FORMULA_JULIA) &&
+                            mandel.Precision(rsx->getCurrentBuffer()) == KERNEL_PREC_FLOAT;
+      bool           still;
+      bool           drawn = true;
+
+      // Replays are timed, every frame of them is calculated.
+      mandel.Save(&view);
+      view.mode = RenderMode(cached, de, aa, spu);
+      still = !replayed && haveLast && mandel.Same(&last) && view.mode == last.mode;
+      last = view;
+      haveLast = true;
+      if (!still) pass = 0;
+
+      if (still && !cached && !deOn && !aa && pass < ACCUM_PASSES &&
+          spu->Accumulate(rsx->getCurrentBuffer(), mandel.get_formula(), mandel.get_view(), pass))
+      {
+         pass++;
+      }
+      else if (still)
+      {
+         drawn = false;
+      }
+      else if (cached)
+      {
+         rsxBuffer  *buffer = rsx->getCurrentBuffer();
+         const View &v = mandel.get_view();
+         int r = tilecache_render(&cache, mandel.get_formula(), buffer->ptr, buffer->width, buffer->height,
+                                  v.x1.hi, v.x2.hi, v.y1.hi, v.y2.hi, SpuClass::Compute, spu);
+         debugPrintf("tiles: %d calculated, %u hits total\n", r, cache.hits);
+      }
+      else if (deOn)
+      {
+         int skipped = spu->CalcDE(rsx->getCurrentBuffer(), mandel.get_formula(),
+                                   mandel.get_view());
+         debugPrintf("de: %d%% of the pixels skipped\n", skipped);
+      }
+      else if (aa)
+      {
+         int edges = spu->CalcAA(rsx->getCurrentBuffer(), mandel.get_formula(),
+                                 mandel.get_view());
+         debugPrintf("aa: %d%% of the pixels supersampled\n", edges);
+      }
+      else if (spu->getProfiling())
+      {
+         spu->CalcProfile(rsx->getCurrentBuffer(), mandel.get_formula(), mandel.get_view());
+      }
+      else if (!replayed)
+      {
+         // The view moves: whatever is not done in time is a preview,
+         // at the edges first.
+         unsigned long long used = (__mftb() - shown) / 80;
+         u32                budget = used < FRAME_US - FRAME_MARGIN ? FRAME_US - FRAME_MARGIN - used : 0;
+         int                reuse = -1;
+
+         for (int i = 0; i < SPEC_VIEWS; i++)
+         {
+            if (specValid[i] && mandel.Same(&spec[i]) && spec[i].mode == view.mode) reuse = i;
+         }
+
+         u32                previews = spu->CalcDeadline(rsx->getCurrentBuffer(), mandel.get_formula(),
+                                                         mandel.get_view(),
+                                                         budget, reuse);
+         if (previews)
+         {
+            debugPrintf("deadline: %u tiles previewed\n", previews);
+         }
+         if (reuse >= 0)
+         {
+            debugPrintf("speculation: %u tiles reused\n", spu->Speculated(reuse));
+            spu->Forget(reuse);
+            specValid[reuse] = false;
+         }
+         paced = true;
+      }
+      else
+      {
+         spu->Calc2(rsx->getCurrentBuffer(), mandel.get_formula(), mandel.get_view());
+      }
+
+      // Which kernels the frame needed, once the view is deep enough for
+      // more than floats.
+      u32 precisions[KERNEL_PREC_COUNT];
+
+      spu->Precisions(precisions);
+      if (precisions[KERNEL_PREC_DOUBLE] || precisions[KERNEL_PREC_EXTENDED])
+      {
+         debugPrintf("precision: %u float, %u double, %u extended commands\n",
+                     precisions[KERNEL_PREC_FLOAT], precisions[KERNEL_PREC_DOUBLE], precisions[KERNEL_PREC_EXTENDED]);
+      }
+
+      if (replayed)
+      {
+         times[played] = (__mftb() - t) / 80;   // 80 ticks per us
+         debugPrintf("replay frame %u: %u us\n", played, times[played]);
+         played++;
+      }
+      else if (drawn)
+      {
+         // A frame that was quick waits for the second vsync all the same,
+         // so a moving view doesn't jump between 60 and 30 Hz.
+         unsigned long long early = (__mftb() - shown) / 80;
+
+         if (paced && early < VSYNC_US + 1000)
+         {
+            MandelBrot     ahead[SPEC_VIEWS];
+            replayframe_t  key[SPEC_VIEWS];
+            int            slot[SPEC_VIEWS];
+            bool           taken[SPEC_VIEWS] = { false };
+            int            views;
+
+            // The views to come. One that has a reuse buffer already goes
+            // on in it, a new one gets a free buffer or that of a guess
+            // that was wrong.
+            for (views = 0; views < SPEC_VIEWS; views++)
+            {
+               ahead[views] = mandel;
+               predictor.View(&ahead[views], views);
+               ahead[views].Save(&key[views]);
+               key[views].mode = view.mode;
+               if (mandel.Same(&key[views])) break;   // The sticks are let go
+
+               slot[views] = -1;
+               for (int i = 0; i < SPEC_VIEWS; i++)
+               {
+                  if (!taken[i] && specValid[i] && ahead[views].Same(&spec[i]) && spec[i].mode == view.mode)
+                  {
+                     slot[views] = i;
+                     taken[i] = true;
+                  }
+               }
+            }
+            for (int k = 0; k < views; k++)
+            {
+               for (int i = 0; i < SPEC_VIEWS && slot[k] < 0; i++)
+               {
+                  if (!taken[i]) slot[k] = i;
+               }
+               if (!specValid[slot[k]] || !ahead[k].Same(&spec[slot[k]]) || spec[slot[k]].mode != view.mode)
+               {
+                  spu->Forget(slot[k]);
+                  spec[slot[k]] = key[k];
+                  specValid[slot[k]] = true;
+               }
+               taken[slot[k]] = true;
+            }
+
+            // Until the vsync is near, the next view first.
+            for (int k = 0; k < views && early < VSYNC_US; k++)
+            {
+               spu->Speculate(slot[k], rsx->getCurrentBuffer(), ahead[k].get_formula(),
+                              ahead[k].get_view(),
+                              VSYNC_US - early);
+               early = (__mftb() - shown) / 80;
+            }
+
+            if (early < VSYNC_US + 1000)
+            {
+               usleep(VSYNC_US + 1000 - early);
+            }
+         }
+         rsx->Flip();
+         flipping = true;
+      }
+      else
+      {
+         usleep(1000000 / 60);   // Nothing to do until the pad moves, look again next frame
+      }
+
+      mandel.Step(pad->stickLH(), pad->stickLV(), pad->stickRV());
+   }
+
+   if (recording)
+   {
+      replay_close(&rec);
+   }
+   if (playing)
+   {
+      replay_close(&play);
+      free(times);
+   }
+
+   if (haveCache)
+   {
+      tilecache_close(&cache);
    }
 
    delete spu;
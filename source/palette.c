@@ -0,0 +1,126 @@
+/*
+ * Histogram equalised colouring. The workers each count the iterations of
+ * their own tiles, the counts are added in a tree (every step only reads
+ * histograms nobody writes to anymore), and the cumulative distribution
+ * picks the colour of every iteration count.
+ */
+
+#include <string.h>
+
+#include "palette.h"
+
+/* The colours the distribution runs through, from escaping at once to
+   almost in the set. */
+static const uint8_t ramp[][3] =
+{
+   {   0,   7, 100 },
+   {  32, 107, 203 },
+   { 237, 255, 255 },
+   { 255, 170,   0 },
+   {  80,   2,   0 },
+};
+
+#define RAMP_STEPS (sizeof(ramp) / sizeof(ramp[0]) - 1)
+
+// -----------------------------------------------------------------------
+void palette_count(uint32_t *hist, const uint32_t *pixels, uint32_t n)
+{
+   uint32_t i;
+
+   for (i=0; i<n; i++)
+   {
+      hist[pixels[i] & 0xff]++;
+   }
+}
+
+// -----------------------------------------------------------------------
+// Neighbours mostly have the same count, in four histograms the increments
+// don't wait for each other.
+void palette_count_iter(uint32_t *hist, const uint8_t *iter, uint32_t n)
+{
+   uint32_t part[4][PALETTE_SIZE];
+   uint32_t i;
+
+   memset(part, 0, sizeof(part));
+
+   for (i=0; i+4<=n; i+=4)
+   {
+      part[0][iter[i]]++;
+      part[1][iter[i+1]]++;
+      part[2][iter[i+2]]++;
+      part[3][iter[i+3]]++;
+   }
+   for (; i<n; i++) part[0][iter[i]]++;
+
+   for (i=0; i<PALETTE_SIZE; i++)
+   {
+      hist[i] += part[0][i] + part[1][i] + part[2][i] + part[3][i];
+   }
+}
+
+// -----------------------------------------------------------------------
+void palette_reduce(uint32_t *const *hist, int count)
+{
+   int step, i, j;
+
+   for (step=1; step<count; step*=2)
+   {
+      for (i=0; i+step<count; i+=2*step)
+      {
+         uint32_t       *dst = hist[i];
+         const uint32_t *src = hist[i+step];
+
+         for (j=0; j<PALETTE_SIZE; j++)
+         {
+            dst[j] += src[j];
+         }
+      }
+   }
+}
+
+// -----------------------------------------------------------------------
+void palette_equalise(const uint32_t *hist, uint32_t *palette)
+{
+   uint32_t total = 0;
+   uint32_t sum = 0;
+   int      i;
+
+   for (i=0; i<PALETTE_INSIDE; i++) total += hist[i];
+
+   for (i=0; i<PALETTE_INSIDE; i++)
+   {
+      // Position in the ramp, 16.16 fixed point.
+      uint32_t pos = total ? (uint32_t)(((uint64_t)sum * RAMP_STEPS << 16) / total) : 0;
+      uint32_t step = pos >> 16;
+      uint32_t frac = pos & 0xffff;
+      uint32_t c, rgb = 0;
+
+      if (step >= RAMP_STEPS)
+      {
+         step = RAMP_STEPS - 1;
+         frac = 0xffff;
+      }
+
+      for (c=0; c<3; c++)
+      {
+         uint32_t v = (ramp[step][c] * (0x10000 - frac) + ramp[step+1][c] * frac) >> 16;
+         rgb = (rgb << 8) | v;
+      }
+
+      palette[i] = rgb;
+      sum += hist[i];
+   }
+
+   for (; i<PALETTE_SIZE; i++) palette[i] = 0;
+}
+
+// -----------------------------------------------------------------------
+void palette_apply(const uint32_t *palette, const uint32_t *in, uint32_t *out, uint32_t n)
+{
+   uint32_t i;
+
+   for (i=0; i<n; i++)
+   {
+      out[i] = palette[in[i] & 0xff];
+   }
+}
@@ -0,0 +1,142 @@
+/*
+ * Where the time of a frame goes. The workers report the ticks and the
+ * iterations of every tile they calculated; from that come a heatmap over
+ * the frame and the list of the most expensive tiles. Many ticks for few
+ * iterations is overhead, many iterations is a place where interior
+ * checks or distance estimation would pay off.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "profile.h"
+
+// -----------------------------------------------------------------------
+int profile_init(profile_t *profile, uint32_t max)
+{
+   memset(profile, 0, sizeof(profile_t));
+
+   profile->tile = (profiletile_t*)malloc(max * sizeof(profiletile_t));
+   if (profile->tile == NULL) return -1;
+
+   profile->max = max;
+   return 0;
+}
+
+// -----------------------------------------------------------------------
+void profile_free(profile_t *profile)
+{
+   free(profile->tile);
+   memset(profile, 0, sizeof(profile_t));
+}
+
+// -----------------------------------------------------------------------
+void profile_reset(profile_t *profile)
+{
+   profile->count = 0;
+   profile->ticks = 0;
+   profile->iterations = 0;
+   profile->worst = 0;
+}
+
+// -----------------------------------------------------------------------
+void profile_add(profile_t *profile, uint32_t x, uint32_t y, uint32_t w, uint32_t h,
+                 uint32_t ticks, uint32_t iterations)
+{
+   profiletile_t *t;
+
+   if (profile->count >= profile->max) return;
+
+   t = &profile->tile[profile->count++];
+   t->x = x;
+   t->y = y;
+   t->w = w;
+   t->h = h;
+   t->ticks = ticks;
+   t->iterations = iterations;
+
+   profile->ticks += ticks;
+   profile->iterations += iterations;
+   if (ticks > profile->worst) profile->worst = ticks;
+}
+
+// -----------------------------------------------------------------------
+// Insertion into a short sorted list, n is small.
+uint32_t profile_top(const profile_t *profile, profiletile_t *top, uint32_t n)
+{
+   uint32_t found = 0;
+   uint32_t i, j;
+
+   if (n == 0) return 0;
+
+   for (i=0; i<profile->count; i++)
+   {
+      const profiletile_t *t = &profile->tile[i];
+
+      if (found == n && t->ticks <= top[n-1].ticks) continue;
+
+      j = found < n ? found++ : n - 1;
+      while (j > 0 && top[j-1].ticks < t->ticks)
+      {
+         top[j] = top[j-1];
+         j--;
+      }
+      top[j] = *t;
+   }
+
+   return found;
+}
+
+// -----------------------------------------------------------------------
+uint32_t profile_heat(uint32_t ticks, uint32_t max)
+{
+   uint32_t v = max ? (uint32_t)(((uint64_t)ticks * 767) / max) : 0;
+
+   if (v > 767) v = 767;
+
+   if (v < 256) return v << 16;                       // black to red
+   if (v < 512) return 0xff0000 | ((v - 256) << 8);   // red to yellow
+   return 0xffff00 | (v - 512);                        // yellow to white
+}
+
+// -----------------------------------------------------------------------
+static uint32_t blend(uint32_t a, uint32_t b)
+{
+   return ((a >> 1) & 0x7f7f7f) + ((b >> 1) & 0x7f7f7f);
+}
+
+// -----------------------------------------------------------------------
+void profile_heatmap(const profile_t *profile, uint32_t *pixels, uint32_t width, uint32_t height, int mode)
+{
+   uint32_t i, x, y;
+
+   for (i=0; i<profile->count; i++)
+   {
+      const profiletile_t *t = &profile->tile[i];
+      uint32_t             heat = profile_heat(t->ticks, profile->worst);
+      uint32_t             x1 = t->x + t->w > width ? width : t->x + t->w;
+      uint32_t             y1 = t->y + t->h > height ? height : t->y + t->h;
+
+      // Tiles of a bigger frame, and empty ones, have nothing on this one.
+      if (t->x >= x1 || t->y >= y1) continue;
+
+      for (y=t->y; y<y1; y++)
+      {
+         uint32_t *line = &pixels[y * width];
+
+         if (mode == PROFILE_BLEND)
+         {
+            for (x=t->x; x<x1; x++) line[x] = blend(line[x], heat);
+         }
+         else if (y == t->y || y == y1 - 1)
+         {
+            for (x=t->x; x<x1; x++) line[x] = heat;
+         }
+         else
+         {
+            line[t->x] = heat;
+            line[x1 - 1] = heat;
+         }
+      }
+   }
+}
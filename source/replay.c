@@ -0,0 +1,240 @@
+/*
+ * Recording of the pad, frame by frame, so the same flight through the set
+ * can be rendered again and timed. The file is big endian whatever writes
+ * it, so a recording made on the PS3 plays back on a Linux host as well.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "replay.h"
+
+// -----------------------------------------------------------------------
+static void put32(uint8_t *p, uint32_t v)
+{
+   p[0] = v >> 24;
+   p[1] = v >> 16;
+   p[2] = v >> 8;
+   p[3] = v;
+}
+
+// -----------------------------------------------------------------------
+static uint32_t get32(const uint8_t *p)
+{
+   return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// -----------------------------------------------------------------------
+static void putf(uint8_t *p, float f)
+{
+   uint32_t v;
+
+   memcpy(&v, &f, sizeof(v));
+   put32(p, v);
+}
+
+// -----------------------------------------------------------------------
+static float getf(const uint8_t *p)
+{
+   uint32_t v = get32(p);
+   float    f;
+
+   memcpy(&f, &v, sizeof(f));
+   return f;
+}
+
+// -----------------------------------------------------------------------
+static void putd(uint8_t *p, double d)
+{
+   uint64_t v;
+
+   memcpy(&v, &d, sizeof(v));
+   put32(p, v >> 32);
+   put32(p + 4, v);
+}
+
+// -----------------------------------------------------------------------
+static double getd(const uint8_t *p)
+{
+   uint64_t v = ((uint64_t)get32(p) << 32) | get32(p + 4);
+   double   d;
+
+   memcpy(&d, &v, sizeof(d));
+   return d;
+}
+
+// -----------------------------------------------------------------------
+static int write_header(replay_t *replay)
+{
+   uint8_t header[16];
+
+   memset(header, 0, sizeof(header));
+   put32(&header[0], REPLAY_MAGIC);
+   put32(&header[4], REPLAY_VERSION);
+   put32(&header[8], replay->frames);
+
+   if (fseek(replay->f, 0, SEEK_SET) != 0) return -1;
+   return fwrite(header, sizeof(header), 1, replay->f) == 1 ? 0 : -1;
+}
+
+// -----------------------------------------------------------------------
+int replay_create(replay_t *replay, const char *path)
+{
+   memset(replay, 0, sizeof(replay_t));
+
+   replay->f = fopen(path, "wb");
+   if (replay->f == NULL) return -1;
+
+   replay->writing = 1;
+   replay->version = REPLAY_VERSION;
+
+   // The frame count is filled in at the end.
+   if (write_header(replay) < 0)
+   {
+      fclose(replay->f);
+      replay->f = NULL;
+      return -1;
+   }
+
+   return 0;
+}
+
+// -----------------------------------------------------------------------
+int replay_write(replay_t *replay, const replayframe_t *frame)
+{
+   uint8_t p[REPLAY_FRAME];
+
+   memset(p, 0, sizeof(p));
+   p[0] = frame->lh;
+   p[1] = frame->lv;
+   p[2] = frame->rv;
+   p[3] = frame->formula;
+   p[4] = frame->buttons >> 8;
+   p[5] = frame->buttons;
+   p[6] = frame->power;
+   p[7] = frame->mode;
+   putf(&p[8], frame->cre);
+   putf(&p[12], frame->cim);
+   putd(&p[16], frame->x1);
+   putd(&p[24], frame->x2);
+   putd(&p[32], frame->y1);
+   putd(&p[40], frame->y2);
+   putd(&p[48], frame->x1lo);
+   putd(&p[56], frame->x2lo);
+   putd(&p[64], frame->y1lo);
+   putd(&p[72], frame->y2lo);
+
+   if (fwrite(p, sizeof(p), 1, replay->f) != 1) return -1;
+
+   replay->frames++;
+   return 0;
+}
+
+// -----------------------------------------------------------------------
+int replay_open(replay_t *replay, const char *path)
+{
+   uint8_t header[16];
+
+   memset(replay, 0, sizeof(replay_t));
+
+   replay->f = fopen(path, "rb");
+   if (replay->f == NULL) return -1;
+
+   if (fread(header, sizeof(header), 1, replay->f) != 1 ||
+       get32(&header[0]) != REPLAY_MAGIC || get32(&header[4]) < 1 || get32(&header[4]) > REPLAY_VERSION)
+   {
+      fclose(replay->f);
+      replay->f = NULL;
+      return -1;
+   }
+
+   replay->frames = get32(&header[8]);
+   replay->version = get32(&header[4]);
+   return 0;
+}
+
+// -----------------------------------------------------------------------
+int replay_read(replay_t *replay, replayframe_t *frame)
+{
+   uint8_t  p[REPLAY_FRAME];
+   uint32_t size = replay->version == 1 ? REPLAY_FRAME_V1 : (replay->version == 2 ? REPLAY_FRAME_V2 : REPLAY_FRAME);
+
+   // What an older version doesn't have is 0.
+   memset(p, 0, sizeof(p));
+   if (fread(p, size, 1, replay->f) != 1) return 0;
+
+   frame->lh = p[0];
+   frame->lv = p[1];
+   frame->rv = p[2];
+   frame->formula = p[3];
+   frame->buttons = (p[4] << 8) | p[5];
+   frame->power = p[6];
+   frame->mode = p[7];
+   frame->cre = getf(&p[8]);
+   frame->cim = getf(&p[12]);
+   if (replay->version == 1)
+   {
+      frame->x1 = getf(&p[16]);
+      frame->x2 = getf(&p[20]);
+      frame->y1 = getf(&p[24]);
+      frame->y2 = getf(&p[28]);
+   }
+   else
+   {
+      frame->x1 = getd(&p[16]);
+      frame->x2 = getd(&p[24]);
+      frame->y1 = getd(&p[32]);
+      frame->y2 = getd(&p[40]);
+   }
+   frame->x1lo = getd(&p[48]);
+   frame->x2lo = getd(&p[56]);
+   frame->y1lo = getd(&p[64]);
+   frame->y2lo = getd(&p[72]);
+
+   return 1;
+}
+
+// -----------------------------------------------------------------------
+int replay_close(replay_t *replay)
+{
+   int r = 0;
+
+   if (replay->f == NULL) return -1;
+
+   if (replay->writing)
+   {
+      r = write_header(replay);
+   }
+   if (fclose(replay->f) != 0) r = -1;
+
+   replay->f = NULL;
+   return r;
+}
+
+// -----------------------------------------------------------------------
+static int compare_us(const void *a, const void *b)
+{
+   uint32_t ua = *(const uint32_t*)a;
+   uint32_t ub = *(const uint32_t*)b;
+
+   return ua < ub ? -1 : ua > ub;
+}
+
+// -----------------------------------------------------------------------
+void replay_summary(uint32_t *us, uint32_t n, replaysummary_t *summary)
+{
+   uint32_t i;
+
+   memset(summary, 0, sizeof(replaysummary_t));
+   if (n == 0) return;
+
+   qsort(us, n, sizeof(uint32_t), compare_us);
+
+   for (i=0; i<n; i++) summary->total += us[i];
+
+   summary->frames = n;
+   summary->mean = summary->total / n;
+   summary->median = us[n / 2];
+   summary->p95 = us[(n * 95) / 100];
+   summary->max = us[n - 1];
+}
@@ -0,0 +1,184 @@
+/*
+ * Ring of frames in POSIX shared memory, for viewers and encoders in other
+ * processes on a Linux host. The producer renders straight into a slot and
+ * publishes it; a consumer maps the same memory and reads the newest frame
+ * where it is. Every slot has a sequence number that is odd while it is
+ * written, so a consumer can tell when a slow read was overtaken by the
+ * producer, which never waits for anybody. There is no lv2 equivalent,
+ * on the PS3 the SPU's write into the RSX buffers, so the file is empty
+ * there.
+ */
+
+#ifndef __PPU__
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shmframe.h"
+
+// -----------------------------------------------------------------------
+static size_t header_bytes(void)
+{
+   return (sizeof(shmframe_header_t) + SHMFRAME_ALIGN - 1) & ~(size_t)(SHMFRAME_ALIGN - 1);
+}
+
+// -----------------------------------------------------------------------
+static uint32_t* slot_pixels(shmframe_t *ring, uint32_t slot)
+{
+   return (uint32_t*)(ring->base + header_bytes() + (size_t)slot * ring->header->slotbytes);
+}
+
+// -----------------------------------------------------------------------
+static int map(shmframe_t *ring, const char *name, int fd, size_t size, int prot)
+{
+   ring->base = (uint8_t*)mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+   close(fd);
+
+   if (ring->base == MAP_FAILED)
+   {
+      ring->base = NULL;
+      return -1;
+   }
+
+   ring->size = size;
+   ring->header = (shmframe_header_t*)ring->base;
+   snprintf(ring->name, sizeof(ring->name), "%s", name);
+
+   return 0;
+}
+
+// -----------------------------------------------------------------------
+int shmframe_create(shmframe_t *ring, const char *name, uint32_t width, uint32_t height, uint32_t slots)
+{
+   size_t   slotbytes = ((size_t)width * height * sizeof(uint32_t) + SHMFRAME_ALIGN - 1) & ~(size_t)(SHMFRAME_ALIGN - 1);
+   size_t   size = header_bytes() + slots * slotbytes;
+   int      fd;
+
+   memset(ring, 0, sizeof(shmframe_t));
+
+   if (slots < 2 || slots > SHMFRAME_MAX_SLOTS || slotbytes > 0xffffffffu) return -1;
+
+   fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+   if (fd < 0) return -1;
+
+   if (ftruncate(fd, size) < 0 || map(ring, name, fd, size, PROT_READ | PROT_WRITE) < 0)
+   {
+      shm_unlink(name);
+      return -1;
+   }
+
+   ring->owner = 1;
+   ring->current = slots - 1;
+   ring->header->slots = slots;
+   ring->header->width = width;
+   ring->header->height = height;
+   ring->header->stride = width;
+   ring->header->slotbytes = slotbytes;
+   ring->header->version = SHMFRAME_VERSION;
+
+   // The magic goes last, a consumer that sees it sees the rest as well.
+   __atomic_store_n(&ring->header->magic, SHMFRAME_MAGIC, __ATOMIC_RELEASE);
+
+   return 0;
+}
+
+// -----------------------------------------------------------------------
+uint32_t* shmframe_begin(shmframe_t *ring)
+{
+   shmframe_header_t *h = ring->header;
+   uint64_t           frame = h->frames;
+
+   ring->current = frame % h->slots;
+
+   // Readers of the frame that was here see an odd number from now on.
+   __atomic_store_n(&h->slot[ring->current].seq, 2*frame + 1, __ATOMIC_RELAXED);
+   __atomic_thread_fence(__ATOMIC_RELEASE);
+
+   return slot_pixels(ring, ring->current);
+}
+
+// -----------------------------------------------------------------------
+void shmframe_publish(shmframe_t *ring)
+{
+   shmframe_header_t *h = ring->header;
+   uint64_t           frame = h->frames;
+
+   __atomic_store_n(&h->slot[ring->current].seq, 2*frame + 2, __ATOMIC_RELEASE);
+   __atomic_store_n(&h->frames, frame + 1, __ATOMIC_RELEASE);
+}
+
+// -----------------------------------------------------------------------
+int shmframe_open(shmframe_t *ring, const char *name)
+{
+   struct stat st;
+   int         fd;
+
+   memset(ring, 0, sizeof(shmframe_t));
+
+   fd = shm_open(name, O_RDONLY, 0);
+   if (fd < 0) return -1;
+
+   if (fstat(fd, &st) < 0 || (size_t)st.st_size < header_bytes())
+   {
+      close(fd);
+      return -1;
+   }
+
+   if (map(ring, name, fd, st.st_size, PROT_READ) < 0) return -1;
+
+   if (__atomic_load_n(&ring->header->magic, __ATOMIC_ACQUIRE) != SHMFRAME_MAGIC ||
+       ring->header->version != SHMFRAME_VERSION ||
+       header_bytes() + (size_t)ring->header->slots * ring->header->slotbytes > ring->size)
+   {
+      shmframe_close(ring);
+      return -1;
+   }
+
+   return 0;
+}
+
+// -----------------------------------------------------------------------
+const uint32_t* shmframe_latest(shmframe_t *ring, uint64_t *seen)
+{
+   shmframe_header_t *h = ring->header;
+   uint64_t           frames = __atomic_load_n(&h->frames, __ATOMIC_ACQUIRE);
+
+   if (frames == *seen || !shmframe_valid(ring, frames - 1)) return NULL;
+
+   *seen = frames;
+   return slot_pixels(ring, (frames - 1) % h->slots);
+}
+
+// -----------------------------------------------------------------------
+int shmframe_valid(shmframe_t *ring, uint64_t frame)
+{
+   shmframe_header_t *h = ring->header;
+
+   // The reads of the pixels have to be done before the check.
+   __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+   return __atomic_load_n(&h->slot[frame % h->slots].seq, __ATOMIC_ACQUIRE) == 2*frame + 2;
+}
+
+// -----------------------------------------------------------------------
+void shmframe_close(shmframe_t *ring)
+{
+   if (ring->base != NULL)
+   {
+      munmap(ring->base, ring->size);
+   }
+
+   if (ring->owner)
+   {
+      shm_unlink(ring->name);
+   }
+
+   memset(ring, 0, sizeof(shmframe_t));
+}
+
+#endif /* __PPU__ */
@@ -0,0 +1,538 @@
+/*
+ * Persistent cache of rendered tiles. The tiles form a quadtree over the
+ * root square, so a tile calculated once is found again when the same
+ * place is visited at about the same zoom. The store is one file: a header,
+ * an index entry per slot and the slots themselves. On a Linux host it is
+ * mapped into memory; lv2 can't map files, so on the PS3 it is read in at
+ * open and written back at close.
+ */
+
+#ifndef __PPU__
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "tilecache.h"
+#include "kernel.h"
+
+#ifndef __PPU__
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define TILECACHE_ALIGN (4096)
+
+// -----------------------------------------------------------------------
+static uint32_t key_hash(const tilekey_t *key)
+{
+   uint32_t h = key->level * 0x9e3779b1u;
+
+   h ^= key->tx * 0x85ebca6bu;
+   h ^= key->ty * 0xc2b2ae35u;
+   h ^= key->params.formula * 0x27d4eb2fu;
+   h ^= key->params.power * 0x165667b1u;
+   h ^= key->params.cre * 0xd3a2646cu;
+   h ^= key->params.cim * 0xfd7046c5u;
+   h ^= key->params.iter;
+   h ^= h >> 15;
+   h *= 0x2c1b3c6du;
+   h ^= h >> 12;
+
+   return h;
+}
+
+// -----------------------------------------------------------------------
+static int key_equal(const tilekey_t *a, const tilekey_t *b)
+{
+   return a->level == b->level && a->tx == b->tx && a->ty == b->ty &&
+          memcmp(&a->params, &b->params, sizeof(kernelparams_t)) == 0;
+}
+
+// -----------------------------------------------------------------------
+// Returns the hash position of the key, or of the empty place it would go.
+static uint32_t hash_lookup(tilecache_t *cache, const tilekey_t *key)
+{
+   uint32_t i = key_hash(key) & cache->hashmask;
+
+   while (cache->hash[i] >= 0 && !key_equal(&cache->entry[cache->hash[i]].key, key))
+   {
+      i = (i + 1) & cache->hashmask;
+   }
+
+   return i;
+}
+
+// -----------------------------------------------------------------------
+// Linear probing can't just empty a place, the ones after it that were
+// pushed past it have to move back.
+static void hash_remove(tilecache_t *cache, uint32_t i)
+{
+   uint32_t j = i;
+
+   cache->hash[i] = -1;
+
+   while (1)
+   {
+      j = (j + 1) & cache->hashmask;
+      if (cache->hash[j] < 0) break;
+
+      uint32_t k = key_hash(&cache->entry[cache->hash[j]].key) & cache->hashmask;
+
+      if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j)))
+      {
+         cache->hash[i] = cache->hash[j];
+         cache->hash[j] = -1;
+         i = j;
+      }
+   }
+}
+
+// -----------------------------------------------------------------------
+static void lru_unlink(tilecache_t *cache, int32_t s)
+{
+   if (cache->prev[s] >= 0) cache->next[cache->prev[s]] = cache->next[s];
+   else cache->head = cache->next[s];
+
+   if (cache->next[s] >= 0) cache->prev[cache->next[s]] = cache->prev[s];
+   else cache->tail = cache->prev[s];
+}
+
+// -----------------------------------------------------------------------
+static void lru_push_front(tilecache_t *cache, int32_t s)
+{
+   cache->prev[s] = -1;
+   cache->next[s] = cache->head;
+
+   if (cache->head >= 0) cache->prev[cache->head] = s;
+   else cache->tail = s;
+
+   cache->head = s;
+}
+
+// -----------------------------------------------------------------------
+static void touch(tilecache_t *cache, int32_t s)
+{
+   cache->entry[s].used = ++cache->header->clock;
+   lru_unlink(cache, s);
+   lru_push_front(cache, s);
+}
+
+// -----------------------------------------------------------------------
+static const tilecache_entry_t *sort_entry;
+
+static int sort_recent_first(const void *a, const void *b)
+{
+   const tilecache_entry_t *ea = &sort_entry[*(const int32_t*)a];
+   const tilecache_entry_t *eb = &sort_entry[*(const int32_t*)b];
+
+   if (ea->valid != eb->valid) return ea->valid ? -1 : 1;
+   if (ea->used != eb->used) return ea->used > eb->used ? -1 : 1;
+   return 0;
+}
+
+// -----------------------------------------------------------------------
+// Rebuild the hash and the LRU list from the index. Empty slots end up at
+// the tail, so they are used before anything gets evicted.
+static int build_index(tilecache_t *cache)
+{
+   uint32_t slots = cache->header->slots;
+   uint32_t size = 1;
+   int32_t *order;
+   uint32_t i;
+
+   while (size < 2 * slots) size <<= 1;
+
+   cache->hash = (int32_t*)malloc(size * sizeof(int32_t));
+   cache->prev = (int32_t*)malloc(slots * sizeof(int32_t));
+   cache->next = (int32_t*)malloc(slots * sizeof(int32_t));
+   order = (int32_t*)malloc(slots * sizeof(int32_t));
+   if (!cache->hash || !cache->prev || !cache->next || !order)
+   {
+      free(order);
+      return -1;
+   }
+
+   cache->hashmask = size - 1;
+   memset(cache->hash, 0xff, size * sizeof(int32_t));
+
+   for (i=0; i<slots; i++) order[i] = i;
+   sort_entry = cache->entry;
+   qsort(order, slots, sizeof(int32_t), sort_recent_first);
+
+   cache->head = -1;
+   cache->tail = -1;
+   for (i=slots; i>0; i--)
+   {
+      int32_t s = order[i-1];
+
+      lru_push_front(cache, s);
+      if (cache->entry[s].valid)
+      {
+         cache->hash[hash_lookup(cache, &cache->entry[s].key)] = s;
+      }
+   }
+
+   free(order);
+   return 0;
+}
+
+// -----------------------------------------------------------------------
+static int header_valid(const tilecache_header_t *header, uint32_t slots)
+{
+   return header->magic == TILECACHE_MAGIC && header->version == TILECACHE_VERSION &&
+          header->slots == slots && header->tilebytes == TILECACHE_BYTES;
+}
+
+// -----------------------------------------------------------------------
+int tilecache_open(tilecache_t *cache, const char *path, uint32_t slots)
+{
+   size_t index = sizeof(tilecache_header_t) + slots * sizeof(tilecache_entry_t);
+
+   memset(cache, 0, sizeof(tilecache_t));
+   index = (index + TILECACHE_ALIGN - 1) & ~(size_t)(TILECACHE_ALIGN - 1);
+   cache->size = index + (size_t)slots * TILECACHE_BYTES;
+   cache->fd = -1;
+   snprintf(cache->path, sizeof(cache->path), "%s", path);
+
+#ifdef __PPU__
+   if (arena_create(&cache->arena, cache->size + TILECACHE_SCRATCH) < 0) return -1;
+
+   cache->base = (uint8_t*)arena_alloc(&cache->arena, cache->size, 128);
+   if (cache->base == NULL)
+   {
+      arena_destroy(&cache->arena);
+      return -1;
+   }
+
+   FILE *f = fopen(path, "rb");
+   if (f == NULL || fread(cache->base, 1, cache->size, f) != cache->size)
+   {
+      memset(cache->base, 0, index);
+   }
+   if (f) fclose(f);
+#else
+   struct stat st;
+
+   cache->fd = open(path, O_RDWR | O_CREAT, 0644);
+   if (cache->fd < 0) return -1;
+
+   if (fstat(cache->fd, &st) < 0 || (size_t)st.st_size != cache->size)
+   {
+      if (ftruncate(cache->fd, 0) < 0 || ftruncate(cache->fd, cache->size) < 0)
+      {
+         close(cache->fd);
+         return -1;
+      }
+   }
+
+   cache->base = (uint8_t*)mmap(NULL, cache->size, PROT_READ | PROT_WRITE, MAP_SHARED, cache->fd, 0);
+   if (cache->base == MAP_FAILED)
+   {
+      close(cache->fd);
+      cache->base = NULL;
+      return -1;
+   }
+
+   if (arena_create(&cache->arena, TILECACHE_SCRATCH) < 0)
+   {
+      munmap(cache->base, cache->size);
+      close(cache->fd);
+      cache->base = NULL;
+      return -1;
+   }
+#endif
+
+   cache->header = (tilecache_header_t*)cache->base;
+   cache->entry = (tilecache_entry_t*)(cache->base + sizeof(tilecache_header_t));
+   cache->data = cache->base + index;
+
+   if (!header_valid(cache->header, slots))
+   {
+      memset(cache->base, 0, index);
+      cache->header->magic = TILECACHE_MAGIC;
+      cache->header->version = TILECACHE_VERSION;
+      cache->header->slots = slots;
+      cache->header->tilebytes = TILECACHE_BYTES;
+   }
+
+   if (build_index(cache) < 0)
+   {
+      tilecache_close(cache);
+      return -1;
+   }
+
+   return 0;
+}
+
+// -----------------------------------------------------------------------
+void tilecache_close(tilecache_t *cache)
+{
+   if (cache->base == NULL) return;
+
+#ifdef __PPU__
+   FILE *f = fopen(cache->path, "wb");
+   if (f)
+   {
+      fwrite(cache->base, 1, cache->size, f);
+      fclose(f);
+   }
+#else
+   msync(cache->base, cache->size, MS_SYNC);
+   munmap(cache->base, cache->size);
+   close(cache->fd);
+#endif
+
+   free(cache->hash);
+   free(cache->prev);
+   free(cache->next);
+   arena_destroy(&cache->arena);
+   cache->base = NULL;
+}
+
+// -----------------------------------------------------------------------
+const uint8_t* tilecache_find(tilecache_t *cache, const tilekey_t *key)
+{
+   int32_t s = cache->hash[hash_lookup(cache, key)];
+
+   if (s < 0)
+   {
+      cache->misses++;
+      return NULL;
+   }
+
+   cache->hits++;
+   touch(cache, s);
+
+   return cache->data + (size_t)s * TILECACHE_BYTES;
+}
+
+// -----------------------------------------------------------------------
+uint8_t* tilecache_insert(tilecache_t *cache, const tilekey_t *key)
+{
+   uint32_t i = hash_lookup(cache, key);
+   int32_t  s = cache->hash[i];
+
+   if (s < 0)
+   {
+      s = cache->tail;
+
+      if (cache->entry[s].valid)
+      {
+         hash_remove(cache, hash_lookup(cache, &cache->entry[s].key));
+         cache->evictions++;
+         i = hash_lookup(cache, key);
+      }
+
+      cache->entry[s].key = *key;
+      cache->entry[s].valid = 1;
+      cache->hash[i] = s;
+   }
+
+   touch(cache, s);
+
+   return cache->data + (size_t)s * TILECACHE_BYTES;
+}
+
+// -----------------------------------------------------------------------
+void tilecache_drop(tilecache_t *cache, const tilekey_t *key)
+{
+   uint32_t i = hash_lookup(cache, key);
+   int32_t  s = cache->hash[i];
+
+   if (s < 0) return;
+
+   hash_remove(cache, i);
+   cache->entry[s].valid = 0;
+
+   // Back to the tail, it's the first one to be used again.
+   lru_unlink(cache, s);
+   cache->prev[s] = cache->tail;
+   cache->next[s] = -1;
+   if (cache->tail >= 0) cache->next[cache->tail] = s;
+   else cache->head = s;
+   cache->tail = s;
+}
+
+// -----------------------------------------------------------------------
+static double tile_side(int32_t level)
+{
+   return ldexp(TILECACHE_ROOT_SIZE, -level);
+}
+
+// -----------------------------------------------------------------------
+void tilecache_command(spucommand_t *command, const spucommand_t *formula, const tilekey_t *key)
+{
+   double side = tile_side(key->level);
+   double step = side / TILECACHE_TILE;
+
+   memset(command, 0, sizeof(spucommand_t));
+   command->cmd = CMD_CALC;
+   command->width = TILECACHE_TILE;
+   command->height = TILECACHE_TILE;
+   command->start = TILECACHE_ROOT_X + key->tx * side;
+   command->end = TILECACHE_ROOT_X + (key->tx + 1) * side;
+   command->yvalue = TILECACHE_ROOT_Y + key->ty * side;
+   command->ystep = step;
+   command->stride = TILECACHE_TILE;
+   kernel_formula(command, formula);
+   kernel_place(command, dd_two_sum(TILECACHE_ROOT_X, key->tx * side), dd_two_sum(TILECACHE_ROOT_Y, key->ty * side),
+                step, step, step);
+}
+
+// -----------------------------------------------------------------------
+// First pixel at or after @edge.
+static int32_t first_pixel(double edge, double start, double step, int32_t count)
+{
+   double p = ceil((edge - start) / step);
+
+   if (p < 0) return 0;
+   if (p > count) return count;
+   return (int32_t)p;
+}
+
+// -----------------------------------------------------------------------
+// Nearest neighbour copy of the part of the tile that is on screen.
+static void blit(const uint8_t *tile, const tilekey_t *key, uint32_t *dest,
+                 uint32_t width, uint32_t height, double x1, double y1,
+                 double xstep, double ystep)
+{
+   double   side = tile_side(key->level);
+   double   tx1 = TILECACHE_ROOT_X + key->tx * side;
+   double   ty1 = TILECACHE_ROOT_Y + key->ty * side;
+   double   scale = TILECACHE_TILE / side;
+   int32_t  i0 = first_pixel(tx1, x1, xstep, width);
+   int32_t  i1 = first_pixel(TILECACHE_ROOT_X + (key->tx + 1) * side, x1, xstep, width);
+   int32_t  j0 = first_pixel(ty1, y1, ystep, height);
+   int32_t  j1 = first_pixel(TILECACHE_ROOT_Y + (key->ty + 1) * side, y1, ystep, height);
+   uint8_t  column[TILECACHE_TILE*32];
+   int32_t  i, j;
+
+   if (i1 - i0 > (int32_t)sizeof(column)) i1 = i0 + sizeof(column);
+
+   for (i=i0; i<i1; i++)
+   {
+      int32_t c = (int32_t)((x1 + xstep * i - tx1) * scale);
+      column[i - i0] = c < 0 ? 0 : (c >= TILECACHE_TILE ? TILECACHE_TILE - 1 : c);
+   }
+
+   for (j=j0; j<j1; j++)
+   {
+      int32_t        r = (int32_t)((y1 + ystep * j - ty1) * scale);
+      const uint8_t *row = tile + (r < 0 ? 0 : (r >= TILECACHE_TILE ? TILECACHE_TILE - 1 : r)) * TILECACHE_TILE;
+      uint32_t      *d = dest + (size_t)j * width;
+
+      for (i=i0; i<i1; i++)
+      {
+         d[i] = row[column[i - i0]] * 0x00010101;
+      }
+   }
+}
+
+// -----------------------------------------------------------------------
+// Calculate @count missing tiles and draw them, or forget them when that
+// failed. Returns 0 on success.
+static int render_missing(tilecache_t *cache, const tilekey_t *keys, const spucommand_t *commands,
+                          uint8_t *const *out, uint32_t count, uint32_t *dest,
+                          uint32_t width, uint32_t height, double x1, double y1,
+                          double xstep, double ystep, tilecache_compute_t compute, void *ctx)
+{
+   int      r = compute(ctx, commands, out, count);
+   uint32_t i;
+
+   for (i=0; i<count; i++)
+   {
+      if (r == 0) blit(out[i], &keys[i], dest, width, height, x1, y1, xstep, ystep);
+      else tilecache_drop(cache, &keys[i]);
+   }
+
+   return r == 0 ? 0 : -1;
+}
+
+// -----------------------------------------------------------------------
+int tilecache_render(tilecache_t *cache, const spucommand_t *formula, uint32_t *dest,
+                     uint32_t width, uint32_t height,
+                     double x1, double x2, double y1, double y2,
+                     tilecache_compute_t compute, void *ctx)
+{
+   double   xstep = (x2 - x1) / width;
+   double   ystep = (y2 - y1) / height;
+   double   pixel = xstep < ystep ? xstep : ystep;
+   int32_t  level = 0;
+   int32_t  tx, ty;
+
+   // The coarsest level that still has a tile pixel per screen pixel.
+   while (level < TILECACHE_MAX_LEVEL && tile_side(level) / TILECACHE_TILE > pixel) level++;
+
+   double   side = tile_side(level);
+   int32_t  tx0 = (int32_t)floor((x1 - TILECACHE_ROOT_X) / side);
+   int32_t  tx1 = (int32_t)floor((x1 + xstep * (width - 1) - TILECACHE_ROOT_X) / side);
+   int32_t  ty0 = (int32_t)floor((y1 - TILECACHE_ROOT_Y) / side);
+   int32_t  ty1 = (int32_t)floor((y1 + ystep * (height - 1) - TILECACHE_ROOT_Y) / side);
+   uint32_t count = (tx1 - tx0 + 1) * (ty1 - ty0 + 1);
+   uint32_t limit = cache->header->slots > 1 ? cache->header->slots / 2 : 1;
+   uint32_t batch = count < limit ? count : limit;
+   uint32_t missing = 0;
+   uint32_t n = 0;
+   int      r = 0;
+
+   // The lists only live for this frame.
+   arenamark_t    mark = arena_mark(&cache->arena);
+   tilekey_t     *keys = (tilekey_t*)arena_alloc(&cache->arena, batch * sizeof(tilekey_t), 0);
+   spucommand_t  *commands = (spucommand_t*)arena_alloc(&cache->arena, batch * sizeof(spucommand_t), 0);
+   uint8_t      **out = (uint8_t**)arena_alloc(&cache->arena, batch * sizeof(uint8_t*), 0);
+
+   if (!keys || !commands || !out)
+   {
+      arena_reset(&cache->arena, mark);
+      return -1;
+   }
+
+   kernelparams_t params;
+   kernel_params(&params, formula);
+
+   for (ty=ty0; ty<=ty1 && r == 0; ty++)
+   {
+      for (tx=tx0; tx<=tx1 && r == 0; tx++)
+      {
+         tilekey_t      key = { level, tx, ty, params };
+         const uint8_t *tile = tilecache_find(cache, &key);
+
+         if (tile)
+         {
+            blit(tile, &key, dest, width, height, x1, y1, xstep, ystep);
+            continue;
+         }
+
+         keys[n] = key;
+         out[n] = tilecache_insert(cache, &key);
+         tilecache_command(&commands[n], formula, &key);
+         n++;
+         missing++;
+
+         // A batch never evicts its own new tiles: at most half the store
+         // is calculated at a time, and drawn before the next batch goes in.
+         if (n == batch)
+         {
+            r = render_missing(cache, keys, commands, out, n, dest, width, height,
+                               x1, y1, xstep, ystep, compute, ctx);
+            n = 0;
+         }
+      }
+   }
+
+   if (r == 0 && n > 0)
+   {
+      r = render_missing(cache, keys, commands, out, n, dest, width, height,
+                         x1, y1, xstep, ystep, compute, ctx);
+   }
+
+   arena_reset(&cache->arena, mark);
+
+   return r == 0 ? (int)missing : -1;
+}
@@ -0,0 +1,222 @@
+/*
+ * Where the host workers run. An SPU has its local store and it doesn't
+ * matter which one gets a tile, but threads on a Linux host that wander
+ * between cores or sockets leave their caches, and their buffers, behind.
+ * This reads which CPUs share a core and a NUMA node, places the workers
+ * on them in a fixed order and pins them there.
+ */
+
+#ifndef __PPU__
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sched.h>
+
+#include "topo.h"
+
+// -----------------------------------------------------------------------
+static int read_int(const char *format, int cpu, int fallback)
+{
+   char  path[128];
+   FILE *f;
+   int   v;
+
+   snprintf(path, sizeof(path), format, cpu);
+   f = fopen(path, "r");
+   if (f == NULL) return fallback;
+   if (fscanf(f, "%d", &v) != 1) v = fallback;
+   fclose(f);
+   return v;
+}
+
+// -----------------------------------------------------------------------
+// The cpuN directory has a link nodeM to its node.
+static int read_node(int cpu)
+{
+   char           path[128];
+   DIR           *dir;
+   struct dirent *e;
+   int            node = 0;
+
+   snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+   dir = opendir(path);
+   if (dir == NULL) return 0;
+
+   while ((e = readdir(dir)) != NULL)
+   {
+      if (strncmp(e->d_name, "node", 4) == 0 && e->d_name[4] >= '0' && e->d_name[4] <= '9')
+      {
+         node = atoi(&e->d_name[4]);
+         break;
+      }
+   }
+
+   closedir(dir);
+   return node;
+}
+
+// -----------------------------------------------------------------------
+int topo_read(topo_t *topo)
+{
+   cpu_set_t set;
+   int       ids[TOPO_MAX_NODES];
+   int       packages[TOPO_MAX_CPUS];
+   uint32_t  i, j;
+   int       cpu;
+
+   memset(topo, 0, sizeof(topo_t));
+   CPU_ZERO(&set);
+
+   if (sched_getaffinity(0, sizeof(set), &set) < 0) return -1;
+
+   for (cpu=0; cpu<CPU_SETSIZE && topo->cpus<TOPO_MAX_CPUS; cpu++)
+   {
+      topocpu_t *c;
+
+      if (!CPU_ISSET(cpu, &set)) continue;
+
+      c = &topo->cpu[topo->cpus++];
+      c->cpu = cpu;
+      c->core = read_int("/sys/devices/system/cpu/cpu%d/topology/core_id", cpu, cpu);
+      c->package = read_int("/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu, 0);
+      c->node = read_node(cpu);
+   }
+
+   // Node numbers can have holes, count them from 0 instead.
+   for (i=0; i<topo->cpus; i++)
+   {
+      topocpu_t *c = &topo->cpu[i];
+
+      for (j=0; j<topo->nodes && ids[j]!=c->node; j++);
+      if (j == topo->nodes && topo->nodes < TOPO_MAX_NODES) ids[topo->nodes++] = c->node;
+      c->node = j < topo->nodes ? (int)j : 0;
+
+      for (j=0; j<topo->packages && packages[j]!=c->package; j++);
+      if (j == topo->packages) packages[topo->packages++] = c->package;
+   }
+
+   // Later threads of a core are its SMT siblings.
+   for (i=0; i<topo->cpus; i++)
+   {
+      topocpu_t *c = &topo->cpu[i];
+
+      for (j=0; j<i; j++)
+      {
+         if (topo->cpu[j].package == c->package && topo->cpu[j].core == c->core) c->smt++;
+      }
+      if (c->smt == 0) topo->cores++;
+   }
+
+   if (topo->nodes == 0) topo->nodes = 1;
+   return 0;
+}
+
+// -----------------------------------------------------------------------
+// Compact: by node, core, then sibling. Spread: by sibling first.
+static int compare_compact(const void *a, const void *b)
+{
+   const topocpu_t *x = (const topocpu_t*)a;
+   const topocpu_t *y = (const topocpu_t*)b;
+
+   if (x->node != y->node) return x->node - y->node;
+   if (x->package != y->package) return x->package - y->package;
+   if (x->core != y->core) return x->core - y->core;
+   return x->smt - y->smt;
+}
+
+static int compare_spread(const void *a, const void *b)
+{
+   const topocpu_t *x = (const topocpu_t*)a;
+   const topocpu_t *y = (const topocpu_t*)b;
+
+   if (x->smt != y->smt) return x->smt - y->smt;
+   return compare_compact(a, b);
+}
+
+// -----------------------------------------------------------------------
+void topo_place(const topo_t *topo, int policy, uint32_t count, int *cpus)
+{
+   topocpu_t order[TOPO_MAX_CPUS];
+   uint32_t  next[TOPO_MAX_NODES];
+   uint32_t  n = topo->cpus;
+   uint32_t  i, k, node;
+
+   if (policy == TOPO_NONE || n == 0)
+   {
+      for (i=0; i<count; i++) cpus[i] = -1;
+      return;
+   }
+
+   memcpy(order, topo->cpu, n * sizeof(topocpu_t));
+   qsort(order, n, sizeof(topocpu_t), policy == TOPO_SPREAD ? compare_spread : compare_compact);
+
+   if (policy == TOPO_COMPACT)
+   {
+      for (i=0; i<count; i++) cpus[i] = order[i % n].cpu;
+      return;
+   }
+
+   // Spread: the nodes take turns, each with its next CPU in sibling order.
+   memset(next, 0, sizeof(next));
+   for (i=0, node=0; i<count; )
+   {
+      for (k=0; k<topo->nodes; k++, node=(node+1)%topo->nodes)
+      {
+         while (next[node] < n && order[next[node]].node != (int)node) next[node]++;
+         if (next[node] < n) break;
+      }
+
+      // Every CPU has one, start over.
+      if (k == topo->nodes)
+      {
+         memset(next, 0, sizeof(next));
+         continue;
+      }
+
+      cpus[i++] = order[next[node]++].cpu;
+      node = (node + 1) % topo->nodes;
+   }
+}
+
+// -----------------------------------------------------------------------
+int topo_node(const topo_t *topo, int cpu)
+{
+   uint32_t i;
+
+   for (i=0; i<topo->cpus; i++)
+   {
+      if (topo->cpu[i].cpu == cpu) return topo->cpu[i].node;
+   }
+   return 0;
+}
+
+// -----------------------------------------------------------------------
+int topo_pin(int pid, int cpu)
+{
+   cpu_set_t set;
+   int       i;
+
+   if (cpu >= CPU_SETSIZE) return -1;
+
+   // -1 lets it run anywhere again.
+   CPU_ZERO(&set);
+   if (cpu >= 0) CPU_SET(cpu, &set);
+   else for (i=0; i<CPU_SETSIZE; i++) CPU_SET(i, &set);
+
+   return sched_setaffinity(pid, sizeof(set), &set) < 0 ? -1 : 0;
+}
+
+// -----------------------------------------------------------------------
+const char* topo_policy_name(int policy)
+{
+   static const char *name[TOPO_POLICIES] = { "none", "compact", "spread" };
+
+   return policy >= 0 && policy < TOPO_POLICIES ? name[policy] : "?";
+}
+
+#endif
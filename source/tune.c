@@ -0,0 +1,121 @@
+/*
+ * Tuning of the renderer to the machine it runs on. Instead of a search
+ * over every combination, the settings are tuned one after the other,
+ * they hardly depend on each other: the unroll is about the pipeline of a
+ * single worker, the rows about the overhead per command, and the number
+ * of workers about what is left after that.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "tune.h"
+
+// -----------------------------------------------------------------------
+void tune_default(tune_t *tune, uint32_t spus)
+{
+   tune->spus = spus;
+   tune->rows = 1;
+   tune->unroll = 1;
+}
+
+// -----------------------------------------------------------------------
+static int tune_valid(const tune_t *tune, uint32_t maxspus)
+{
+   return tune->spus >= 1 && tune->spus <= maxspus &&
+          tune->rows >= 1 && tune->rows <= TUNE_MAX_ROWS &&
+          (tune->unroll == 1 || tune->unroll == 2);
+}
+
+// -----------------------------------------------------------------------
+// A line per setting, "name value"; unknown names are skipped, so newer
+// files still load.
+int tune_load(tune_t *tune, const char *path, uint32_t maxspus)
+{
+   FILE       *f = fopen(path, "r");
+   char        line[80];
+   char        name[32];
+   unsigned    value;
+   tune_t      t = *tune;
+
+   if (f == NULL) return -1;
+
+   if (fgets(line, sizeof(line), f) == NULL || strncmp(line, TUNE_MAGIC, strlen(TUNE_MAGIC)) != 0)
+   {
+      fclose(f);
+      return -1;
+   }
+
+   while (fgets(line, sizeof(line), f) != NULL)
+   {
+      if (sscanf(line, "%31s %u", name, &value) != 2) continue;
+
+      if (strcmp(name, "spus") == 0) t.spus = value;
+      else if (strcmp(name, "rows") == 0) t.rows = value;
+      else if (strcmp(name, "unroll") == 0) t.unroll = value;
+   }
+   fclose(f);
+
+   if (!tune_valid(&t, maxspus)) return -1;
+
+   *tune = t;
+   return 0;
+}
+
+// -----------------------------------------------------------------------
+int tune_save(const tune_t *tune, const char *path)
+{
+   FILE *f = fopen(path, "w");
+   int   r;
+
+   if (f == NULL) return -1;
+
+   fprintf(f, "%s\n", TUNE_MAGIC);
+   fprintf(f, "spus %u\n", (unsigned)tune->spus);
+   fprintf(f, "rows %u\n", (unsigned)tune->rows);
+   fprintf(f, "unroll %u\n", (unsigned)tune->unroll);
+
+   r = ferror(f) ? -1 : 0;
+   if (fclose(f) != 0) r = -1;
+   return r;
+}
+
+// -----------------------------------------------------------------------
+// Try every value of @setting from @first to @last (doubling when @twice),
+// keep the fastest in @tune.
+static void tune_one(tune_t *tune, uint32_t *setting, uint32_t first, uint32_t last, int twice,
+                     tune_measure_t measure, void *ctx)
+{
+   uint32_t best = *setting;
+   uint64_t fastest = 0;
+   uint32_t v;
+
+   for (v=first; v<=last; v = twice ? v * 2 : v + 1)
+   {
+      uint64_t t;
+
+      *setting = v;
+      t = measure(ctx, tune);
+      if (fastest == 0 || t < fastest)
+      {
+         fastest = t;
+         best = v;
+      }
+   }
+
+   *setting = best;
+}
+
+// -----------------------------------------------------------------------
+void tune_search(tune_t *tune, uint32_t maxspus, tune_measure_t measure, void *ctx)
+{
+   tune_t t = *tune;
+
+   if (!tune_valid(&t, maxspus)) tune_default(&t, maxspus);
+
+   tune_one(&t, &t.unroll, 1, 2, 0, measure, ctx);
+   tune_one(&t, &t.rows, 1, TUNE_MAX_ROWS, 1, measure, ctx);
+   tune_one(&t, &t.spus, 1, maxspus, 0, measure, ctx);
+
+   *tune = t;
+}
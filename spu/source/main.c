@@ -1,9 +1,12 @@
 #include <spu_intrinsics.h>
 #include <spu_mfcio.h>
+#include <math.h>
 
 #define TAG 1
+#define TAG_LINE 2   /* 2 and 3, one per line buffer */
 
 #include "spustr.h"
+#include "kernel.h"
 
 extern void spu_thread_exit(uint32_t);
 
@@ -12,21 +15,61 @@ uint64_t spu_ea;
 /* A copy of the structure sent by ppu */
 spustr_t spu __attribute__((aligned(16)));
 
+/* Offsets in the spuring_t of this SPU */
+#define RING_HEAD      (0)
+#define RING_STATUS    (128)
+#define RING_COMMAND   (256)
+
+/* tail, ticks and skipped as they go to the status line of the ring */
+static uint32_t status[4] __attribute__((aligned(16)));
+
+/* Tell the PPU the ring is empty, by a user event on SPU_EVENT_PORT of the
+   event queue it connected to this thread. The first mailbox word goes in
+   data_3 of the event, the 24 bits of data0 in data_2. The answer in the
+   inbound mailbox has to be read before the next event. */
+static void send_event(uint32_t data0, uint32_t data1) {
+	spu_writech(SPU_WrOutMbox, data1);
+	spu_writech(SPU_WrOutIntrMbox, (SPU_EVENT_PORT << 24) | (data0 & 0x00ffffff));
+	(void)spu_readch(SPU_RdInMbox);
+}
+
 /* wait for dma transfer to be finished */
 static void wait_for_completion(void) {
 	mfc_write_tag_mask(1<<TAG);
 	spu_mfcstat(MFC_TAG_UPDATE_ALL);
 }
 
-static void send_response(uint32_t x) {
-	spu.response = x;
-	spu.sync = 1;
-	/* send response to ppu variable */
-	uint64_t ea = spu_ea + ((uint32_t)&spu.response) - ((uint32_t)&spu);
-	mfc_put(&spu.response, ea, 4, TAG, 0, 0);
-	/* send sync to ppu variable with fence (this ensures sync is written AFTER response) */
-	ea = spu_ea + ((uint32_t)&spu.sync) - ((uint32_t)&spu);
-	mfc_putf(&spu.sync, ea, 4, TAG, 0, 0);
+/* The commands the PPU has queued so far, and in @wake the tail it waits for */
+static uint32_t ring_head(uint32_t *wake) {
+	static uint32_t head[4] __attribute__((aligned(16)));
+
+	mfc_get(head, spu.ring_ea + RING_HEAD, sizeof(head), TAG, 0, 0);
+	wait_for_completion();
+	*wake = head[1];
+	return head[0];
+}
+
+/* The cost of a command to its cost_ea. A DMA of 8 bytes has to come from
+   the same place in a quadword as where it goes. */
+static void send_cost(uint32_t ea, uint32_t ticks, uint32_t iterations) {
+	static uint32_t cost[4] __attribute__((aligned(16)));
+	uint32_t i = (ea & 15) >> 2;
+
+	cost[i] = ticks;
+	cost[i+1] = iterations;
+	mfc_put(&cost[i], ea, sizeof(spucost_t), TAG, 0, 0);
+}
+
+/* One more command done. The status has to be in memory before the head
+   is looked at again, or the PPU could miss that this SPU goes to sleep.
+   The fence also keeps it behind the cost. */
+static void send_status(uint32_t ticks, uint32_t skipped) {
+	status[0]++;
+	status[1] += ticks;
+	status[2] += skipped;
+	/* fenced, so it lands after the results of the command */
+	mfc_putf(status, spu.ring_ea + RING_STATUS, sizeof(status), TAG, 0, 0);
+	wait_for_completion();
 }
 
 void calc(spucommand_t *command, uint32_t *data)
@@ -58,13 +101,85 @@ void calc(spucommand_t *command, uint32_t *data)
    }
 }
 
-void calc_vector(spucommand_t *command, uint32_t *data)
+/* One step of the formula for 4 points. Inlined with a constant formula,
+   the switch goes away. */
+static inline __attribute__((always_inline))
+void calc_step(const uint32_t formula, uint32_t power, vector float abs,
+               vector float *px, vector float *py, vector float a, vector float b)
+{
+   vector float   x = *px;
+   vector float   y = *py;
+   vector float   xtemp;
+   uint32_t       k;
+
+   switch (formula)
+   {
+   case FORMULA_BURNINGSHIP:
+      x = spu_and(x, abs);
+      y = spu_and(y, abs);
+      /* fall through */
+   case FORMULA_MANDEL:
+   case FORMULA_JULIA:
+      xtemp = x*x - y*y + a;
+      y = 2*x*y + b;
+      x = xtemp;
+      break;
+
+   case FORMULA_TRICORN:
+      xtemp = x*x - y*y + a;
+      y = b - 2*x*y;
+      x = xtemp;
+      break;
+
+   case FORMULA_MULTIBROT:
+   {
+      vector float zx = x;
+      vector float zy = y;
+
+      for (k=1; k<power; k++)
+      {
+         xtemp = zx*x - zy*y;
+         zy = zx*y + zy*x;
+         zx = xtemp;
+      }
+
+      x = zx + a;
+      y = zy + b;
+      break;
+   }
+   }
+
+   *px = x;
+   *py = y;
+}
+
+/* Coordinates of CMD_POINTS, and |z|^2 where every point escaped. One
+   vector more than a chunk, for an odd vector with unroll 2. */
+static float points_x[POINTS_CHUNK + 4] __attribute__((aligned(128)));
+static float points_y[POINTS_CHUNK + 4] __attribute__((aligned(128)));
+static float points_d[POINTS_CHUNK + 4] __attribute__((aligned(128)));
+
+/* The escape time loop for all formulas. It is always inlined with a
+   constant formula, so every calc_* below gets its own loop without the
+   switch in it. With @unroll 2 two vectors of 4 pixels go through the loop
+   side by side, their instructions fill each other's pipeline stalls. An
+   odd vector at the end is calculated in pair with nothing. With @points
+   the pixels are not a line but points_x and points_y, and |z|^2 at the
+   escape goes to points_d. */
+static inline __attribute__((always_inline))
+void calc_formula(spucommand_t *command, uint32_t *data, const uint32_t formula, const int unroll,
+                  const int points)
 {
    int   i,j;
+   int   vectors = command->width/4;
    vector float   y0;
    vector float   four = spu_splats((float)4.0);
    vector float   x0;
    vector float   x0d;
+   vector float   cx = spu_splats(command->cre);
+   vector float   cy = spu_splats(command->cim);
+   vector float   abs = (vector float)spu_splats((unsigned int)0x7fffffff);
+   uint32_t       power = command->power;
 
    for (j=0; j<4; j++)
    {
@@ -79,23 +194,53 @@ void calc_vector(spucommand_t *command, uint32_t *data)
 
    y0 = spu_splats(command->yvalue);
 
-   // we are going to do 4 calculations at the same time.
-   for (i=0; i<command->width/4; i++)
+   // we are going to do 4 calculations at the same time, or 8.
+   for (i=0; i<vectors; i+=unroll)
    {
       vector unsigned int r = spu_splats((unsigned int)0x0);
 
       vector float x = spu_splats((float)0.0);
       vector float y = spu_splats((float)0.0);
+      vector float a = x0;
+      vector float b = y0;
       vector unsigned int rv = spu_splats((unsigned int)0);
       vector unsigned int use = spu_splats((unsigned int)0xffffffff);
 
+      /* The next 4 pixels, only used with unroll 2 */
+      vector float x2 = x;
+      vector float y2 = y;
+      vector float a2 = x0 + x0d;
+      vector float b2 = y0;
+      vector unsigned int rv2 = rv;
+      vector unsigned int use2 = use;
+      vector float dv = x;
+      vector float dv2 = x;
+
+      if (points)
+      {
+         a = ((vector float*)points_x)[i];
+         b = ((vector float*)points_y)[i];
+         a2 = ((vector float*)points_x)[i + 1];
+         b2 = ((vector float*)points_y)[i + 1];
+      }
+
+      /* Julia starts at the pixel, and adds the same constant everywhere */
+      if (formula == FORMULA_JULIA)
+      {
+         x = a;
+         y = b;
+         a = cx;
+         b = cy;
+         x2 = a2;
+         y2 = b2;
+         a2 = cx;
+         b2 = cy;
+      }
+
       int depth=0;
       while (depth++ < 255)
       {
-         vector float xtemp = x*x - y*y + x0;
-         y = 2*x*y + y0;
-
-         x = xtemp;
+         calc_step(formula, power, abs, &x, &y, a, b);
 
          vector float d = x*x + y*y;
 
@@ -103,21 +248,876 @@ void calc_vector(spucommand_t *command, uint32_t *data)
 
          /* use starts as 0xffff, dus normaal nemen we r altijd */
          rv = spu_sel(rv, r, use);
+         if (points) dv = spu_sel(dv, d, use);
 
          /* pas use aan, afhankelijk van n */
          use = spu_and(n, use);
 
+         if (unroll == 2)
+         {
+            calc_step(formula, power, abs, &x2, &y2, a2, b2);
+
+            vector float d2 = x2*x2 + y2*y2;
+
+            rv2 = spu_sel(rv2, r, use2);
+            if (points) dv2 = spu_sel(dv2, d2, use2);
+            use2 = spu_and(spu_cmpgt(four, d2), use2);
+         }
+
          r += spu_splats((unsigned int)0x00010101);
       }
 
       *(vector unsigned int*)data = rv;
       data+=4;
+      if (points) ((vector float*)points_d)[i] = dv;
+
+      if (unroll == 2 && i + 1 < vectors)
+      {
+         *(vector unsigned int*)data = rv2;
+         data+=4;
+         if (points) ((vector float*)points_d)[i + 1] = dv2;
+      }
 
       x0 += x0d;
+      if (unroll == 2) x0 += x0d;
+
+
+   }
+
+}
+
+void calc_vector(spucommand_t *command, uint32_t *data)
+{
+   calc_formula(command, data, FORMULA_MANDEL, 1, 0);
+}
+
+void calc_julia(spucommand_t *command, uint32_t *data)
+{
+   calc_formula(command, data, FORMULA_JULIA, 1, 0);
+}
+
+void calc_multibrot(spucommand_t *command, uint32_t *data)
+{
+   calc_formula(command, data, FORMULA_MULTIBROT, 1, 0);
+}
+
+void calc_burningship(spucommand_t *command, uint32_t *data)
+{
+   calc_formula(command, data, FORMULA_BURNINGSHIP, 1, 0);
+}
+
+void calc_tricorn(spucommand_t *command, uint32_t *data)
+{
+   calc_formula(command, data, FORMULA_TRICORN, 1, 0);
+}
+
+void calc_vector2(spucommand_t *command, uint32_t *data)
+{
+   calc_formula(command, data, FORMULA_MANDEL, 2, 0);
+}
+
+void calc_julia2(spucommand_t *command, uint32_t *data)
+{
+   calc_formula(command, data, FORMULA_JULIA, 2, 0);
+}
+
+void calc_multibrot2(spucommand_t *command, uint32_t *data)
+{
+   calc_formula(command, data, FORMULA_MULTIBROT, 2, 0);
+}
+
+void calc_burningship2(spucommand_t *command, uint32_t *data)
+{
+   calc_formula(command, data, FORMULA_BURNINGSHIP, 2, 0);
+}
+
+void calc_tricorn2(spucommand_t *command, uint32_t *data)
+{
+   calc_formula(command, data, FORMULA_TRICORN, 2, 0);
+}
+
+/* Indexed by FORMULA_*, one vector at a time and two (CMDF_UNROLL) */
+static void (*const calc_kernel[2][FORMULA_COUNT])(spucommand_t *, uint32_t *) =
+{
+   {
+      calc_vector,
+      calc_julia,
+      calc_multibrot,
+      calc_burningship,
+      calc_tricorn,
+   },
+   {
+      calc_vector2,
+      calc_julia2,
+      calc_multibrot2,
+      calc_burningship2,
+      calc_tricorn2,
+   },
+};
+
+void points_vector(spucommand_t *command, uint32_t *data)
+{
+   calc_formula(command, data, FORMULA_MANDEL, 1, 1);
+}
+
+void points_julia(spucommand_t *command, uint32_t *data)
+{
+   calc_formula(command, data, FORMULA_JULIA, 1, 1);
+}
+
+void points_multibrot(spucommand_t *command, uint32_t *data)
+{
+   calc_formula(command, data, FORMULA_MULTIBROT, 1, 1);
+}
+
+void points_burningship(spucommand_t *command, uint32_t *data)
+{
+   calc_formula(command, data, FORMULA_BURNINGSHIP, 1, 1);
+}
+
+void points_tricorn(spucommand_t *command, uint32_t *data)
+{
+   calc_formula(command, data, FORMULA_TRICORN, 1, 1);
+}
+
+void points_vector2(spucommand_t *command, uint32_t *data)
+{
+   calc_formula(command, data, FORMULA_MANDEL, 2, 1);
+}
+
+void points_julia2(spucommand_t *command, uint32_t *data)
+{
+   calc_formula(command, data, FORMULA_JULIA, 2, 1);
+}
+
+void points_multibrot2(spucommand_t *command, uint32_t *data)
+{
+   calc_formula(command, data, FORMULA_MULTIBROT, 2, 1);
+}
+
+void points_burningship2(spucommand_t *command, uint32_t *data)
+{
+   calc_formula(command, data, FORMULA_BURNINGSHIP, 2, 1);
+}
+
+void points_tricorn2(spucommand_t *command, uint32_t *data)
+{
+   calc_formula(command, data, FORMULA_TRICORN, 2, 1);
+}
+
+/* -------------------------------------------------------------------- */
+/* Deep views                                                            */
+/* -------------------------------------------------------------------- */
+/* calc_step in double, for 2 points. */
+static inline __attribute__((always_inline))
+void calc_step_double(const uint32_t formula, uint32_t power, vector double abs,
+                      vector double *px, vector double *py, vector double a, vector double b)
+{
+   vector double  x = *px;
+   vector double  y = *py;
+   vector double  xtemp;
+   uint32_t       k;
+
+   switch (formula)
+   {
+   case FORMULA_BURNINGSHIP:
+      x = spu_and(x, abs);
+      y = spu_and(y, abs);
+      /* fall through */
+   case FORMULA_MANDEL:
+   case FORMULA_JULIA:
+      xtemp = x*x - y*y + a;
+      y = 2*x*y + b;
+      x = xtemp;
+      break;
+
+   case FORMULA_TRICORN:
+      xtemp = x*x - y*y + a;
+      y = b - 2*x*y;
+      x = xtemp;
+      break;
+
+   case FORMULA_MULTIBROT:
+   {
+      vector double zx = x;
+      vector double zy = y;
+
+      for (k=1; k<power; k++)
+      {
+         xtemp = zx*x - zy*y;
+         zy = zx*y + zy*x;
+         zx = xtemp;
+      }
+
+      x = zx + a;
+      y = zy + b;
+      break;
+   }
+   }
+
+   *px = x;
+   *py = y;
+}
+
+/* The escape time loop of calc_formula in double, from the double fields
+   of the command. A vector holds 2 points, 4 pixels go through the loop
+   as two of them. |z|^2 is only compared with 4, that is done in float
+   for all 4 at once, the counts come out as those of calc_formula. */
+static inline __attribute__((always_inline))
+void calc_formula_double(spucommand_t *command, uint32_t *data, const uint32_t formula)
+{
+   vector float         four = spu_splats((float)4.0);
+   vector double        cx = spu_splats((double)command->cre);
+   vector double        cy = spu_splats((double)command->cim);
+   vector double        abs = (vector double)spu_splats((unsigned long long)0x7fffffffffffffffULL);
+   vector double        y0 = spu_splats(command->dyvalue[0] + command->dyvalue[1]);
+   vector unsigned char even = { 0,1,2,3, 8,9,10,11, 16,17,18,19, 24,25,26,27 };
+   double               x0 = command->dstart[0] + command->dstart[1];
+   uint32_t             power = command->power;
+   uint32_t             i;
+
+   for (i=0; i<command->width; i+=4)
+   {
+      vector unsigned int r = spu_splats((unsigned int)0x0);
+      vector unsigned int rv = spu_splats((unsigned int)0);
+      vector unsigned int use = spu_splats((unsigned int)0xffffffff);
+      vector double  x = spu_splats((double)0.0);
+      vector double  y = x;
+      vector double  x2 = x;
+      vector double  y2 = x;
+      vector double  a = spu_splats(x0);
+      vector double  a2;
+      vector double  b = y0;
+      vector double  b2 = y0;
+
+      a = spu_insert(x0 + command->dxstep * i, a, 0);
+      a = spu_insert(x0 + command->dxstep * (i + 1), a, 1);
+      a2 = spu_insert(x0 + command->dxstep * (i + 2), a, 0);
+      a2 = spu_insert(x0 + command->dxstep * (i + 3), a2, 1);
+
+      if (formula == FORMULA_JULIA)
+      {
+         x = a;
+         y = b;
+         a = cx;
+         b = cy;
+         x2 = a2;
+         y2 = b2;
+         a2 = cx;
+         b2 = cy;
+      }
+
+      int depth=0;
+      while (depth++ < 255)
+      {
+         calc_step_double(formula, power, abs, &x, &y, a, b);
+         calc_step_double(formula, power, abs, &x2, &y2, a2, b2);
+
+         vector float d = spu_shuffle(spu_roundtf(x*x + y*y), spu_roundtf(x2*x2 + y2*y2), even);
+
+         rv = spu_sel(rv, r, use);
+         use = spu_and(spu_cmpgt(four, d), use);
+
+         r += spu_splats((unsigned int)0x00010101);
+      }
+
+      *(vector unsigned int*)data = rv;
+      data+=4;
+   }
+}
+
+void calc_double_mandel(spucommand_t *command, uint32_t *data)
+{
+   calc_formula_double(command, data, FORMULA_MANDEL);
+}
+
+void calc_double_julia(spucommand_t *command, uint32_t *data)
+{
+   calc_formula_double(command, data, FORMULA_JULIA);
+}
+
+void calc_double_multibrot(spucommand_t *command, uint32_t *data)
+{
+   calc_formula_double(command, data, FORMULA_MULTIBROT);
+}
+
+void calc_double_burningship(spucommand_t *command, uint32_t *data)
+{
+   calc_formula_double(command, data, FORMULA_BURNINGSHIP);
+}
+
+void calc_double_tricorn(spucommand_t *command, uint32_t *data)
+{
+   calc_formula_double(command, data, FORMULA_TRICORN);
+}
+
+/* Indexed by FORMULA_* */
+static void (*const calc_kernel_double[FORMULA_COUNT])(spucommand_t *, uint32_t *) =
+{
+   calc_double_mandel,
+   calc_double_julia,
+   calc_double_multibrot,
+   calc_double_burningship,
+   calc_double_tricorn,
+};
+
+/* Double-double, a point at a time with the kernel of the host. The count
+   goes in the pixel the way calc_formula puts it there. */
+void calc_extended(spucommand_t *command, uint32_t *data)
+{
+   ddouble_t   x0 = dd_make(command->dstart[0], command->dstart[1]);
+   ddouble_t   y0 = dd_make(command->dyvalue[0], command->dyvalue[1]);
+   uint32_t    i;
+
+   for (i=0; i<command->width; i++)
+   {
+      uint32_t c = kernel_point_extended(command, dd_add_d(x0, command->dxstep * i), y0);
+
+      *data++ = (c ? c - 1 : 0) * 0x00010101;
+   }
+}
+
+/* The line kernel for the precision and formula of @command. */
+static void (*pick_kernel(spucommand_t *command))(spucommand_t *, uint32_t *)
+{
+   uint32_t formula = command->formula < FORMULA_COUNT ? command->formula : FORMULA_MANDEL;
+
+   if (command->precision == KERNEL_PREC_EXTENDED) return calc_extended;
+   if (command->precision == KERNEL_PREC_DOUBLE) return calc_kernel_double[formula];
+   return calc_kernel[(command->flags & CMDF_UNROLL) != 0][formula];
+}
+
+/* The double fields of @to: the first pixel @dx pixels right and @dy lines
+   down from that of @from, @xscale times its pixel spacing apart. The
+   float fields are the caller's. */
+static void place_double(spucommand_t *to, const spucommand_t *from, float dx, float dy, float xscale)
+{
+   ddouble_t x = dd_add_d(dd_make(from->dstart[0], from->dstart[1]), from->dxstep * dx);
+   ddouble_t y = dd_add_d(dd_make(from->dyvalue[0], from->dyvalue[1]), from->dystep * dy);
+
+   to->dstart[0] = x.hi;
+   to->dstart[1] = x.lo;
+   to->dyvalue[0] = y.hi;
+   to->dyvalue[1] = y.lo;
+   to->dxstep = from->dxstep * xscale;
+}
+
+/* The next line of @command, in float and in double. */
+static void next_line(spucommand_t *command)
+{
+   ddouble_t y = dd_add_d(dd_make(command->dyvalue[0], command->dyvalue[1]), command->dystep);
+
+   command->yvalue += command->ystep;
+   command->dyvalue[0] = y.hi;
+   command->dyvalue[1] = y.lo;
+}
+
+/* The same for CMD_POINTS */
+static void (*const points_kernel[2][FORMULA_COUNT])(spucommand_t *, uint32_t *) =
+{
+   {
+      points_vector,
+      points_julia,
+      points_multibrot,
+      points_burningship,
+      points_tricorn,
+   },
+   {
+      points_vector2,
+      points_julia2,
+      points_multibrot2,
+      points_burningship2,
+      points_tricorn2,
+   },
+};
+
+/* -------------------------------------------------------------------- */
+/* Points                                                                */
+/* -------------------------------------------------------------------- */
+static uint8_t points_count[POINTS_CHUNK] __attribute__((aligned(128)));
+static float points_smooth[POINTS_CHUNK] __attribute__((aligned(128)));
+
+/* Escape counts of command->width points anywhere, their coordinates
+   come from x_ea and y_ea. The counts are those of kernel_point. */
+static void calc_points(spucommand_t *command, void (*kernel)(spucommand_t *, uint32_t *), uint32_t *data)
+{
+   uint32_t n = command->width;
+   uint32_t i;
+
+   mfc_get(points_x, command->x_ea, n*sizeof(float), TAG, 0, 0);
+   mfc_get(points_y, command->y_ea, n*sizeof(float), TAG, 0, 0);
+   wait_for_completion();
+
+   kernel(command, data);
+
+   for (i=0; i<n; i++)
+   {
+      points_count[i] = (data[i] & 0xff) + 1;
+   }
 
+   /* A Julia point that starts outside escapes before the first step,
+      the loop always takes one */
+   if (command->formula == FORMULA_JULIA)
+   {
+      for (i=0; i<n; i++)
+      {
+         float d = points_x[i]*points_x[i] + points_y[i]*points_y[i];
 
+         if (d >= 4.0f)
+         {
+            points_count[i] = 0;
+            points_d[i] = d;
+         }
+      }
    }
+   mfc_put(points_count, command->dest_ea, n, TAG_LINE, 0, 0);
 
+   if (command->smooth_ea)
+   {
+      for (i=0; i<n; i++)
+      {
+         points_smooth[i] = kernel_smooth(command, points_count[i], points_d[i]);
+      }
+      mfc_put(points_smooth, command->smooth_ea, n*sizeof(float), TAG_LINE, 0, 0);
+   }
+}
+
+/* -------------------------------------------------------------------- */
+/* Distance estimation                                                   */
+/* -------------------------------------------------------------------- */
+#define DE_TODO      (0xffffffff)   /* Not a pixel value, those have a 0 top byte */
+#define DE_WHITE     (0x00ffffff)
+#define DE_SATURATE  (4.0f)         /* Pixels from the set where the shade is white */
+#define DE_BAILOUT   (1.0e4f)       /* |z|^2, a big radius makes the estimate good */
+
+/* Distance from 4 points to the set, 0 for points inside. Along with z the
+   derivative dz/dc is tracked (dz/dz0 for the Julia set). The value is
+   0.5 |z| ln|z| / |dz|, a lower bound of the real distance, so a disk of
+   that radius has no members of the set in it. */
+static vector float calc_de4(spucommand_t *command, vector float px, vector float py)
+{
+   vector float   bailout = spu_splats(DE_BAILOUT);
+   vector float   one = spu_splats((float)1.0);
+   vector float   x, y, a, b, dx, dy, dc;
+   vector unsigned int use = spu_splats((unsigned int)0xffffffff);
+   vector float   dist = spu_splats((float)0.0);
+   int            depth = 0;
+   int            j;
+
+   if (command->formula == FORMULA_JULIA)
+   {
+      x = px;
+      y = py;
+      a = spu_splats(command->cre);
+      b = spu_splats(command->cim);
+      dx = one;
+      dy = spu_splats((float)0.0);
+      dc = spu_splats((float)0.0);
+   }
+   else
+   {
+      x = spu_splats((float)0.0);
+      y = spu_splats((float)0.0);
+      a = px;
+      b = py;
+      dx = spu_splats((float)0.0);
+      dy = spu_splats((float)0.0);
+      dc = one;
+   }
+
+   while (depth++ < 255)
+   {
+      /* dz = 2 z dz + 1, before z moves on */
+      vector float dxn = 2*(x*dx - y*dy) + dc;
+      vector float dyn = 2*(x*dy + y*dx);
+      vector float xn = x*x - y*y + a;
+      vector float yn = 2*x*y + b;
+
+      /* Escaped points keep the z and dz they escaped with */
+      x = spu_sel(x, xn, use);
+      y = spu_sel(y, yn, use);
+      dx = spu_sel(dx, dxn, use);
+      dy = spu_sel(dy, dyn, use);
+
+      use = spu_and(use, spu_cmpgt(bailout, x*x + y*y));
+
+      if (spu_extract(spu_gather(use), 0) == 0) break;
+   }
+
+   for (j=0; j<4; j++)
+   {
+      if (spu_extract(use, j)) continue;
+
+      float z = sqrtf(spu_extract(x, j)*spu_extract(x, j) + spu_extract(y, j)*spu_extract(y, j));
+      float dz = sqrtf(spu_extract(dx, j)*spu_extract(dx, j) + spu_extract(dy, j)*spu_extract(dy, j));
+
+      dist = spu_insert(dz > 0 ? 0.5f * z * logf(z) / dz : 0.0f, dist, j);
+   }
+
+   return dist;
+}
+
+/* Grey shade, black on the set up to white DE_SATURATE pixels away. */
+static uint32_t de_shade(float dist, float white)
+{
+   if (dist >= white) return DE_WHITE;
+   if (dist <= 0) return 0;
+
+   return (uint32_t)(255 * sqrtf(dist / white)) * 0x00010101;
+}
+
+/* Everything in the disk further than @white from the set is white. */
+static uint32_t de_fill(uint32_t *out, uint32_t w, uint32_t h, int cx, int cy,
+                        float radius, float xstep, float ystep)
+{
+   int      ry = (int)(radius / ystep);
+   int      dy;
+   uint32_t filled = 0;
+
+   for (dy=-ry; dy<=ry; dy++)
+   {
+      int   y = cy + dy;
+      if (y < 0 || y >= (int)h) continue;
+
+      float ey = dy * ystep;
+      int   rx = (int)(sqrtf(radius*radius - ey*ey) / xstep);
+      int   x0 = cx - rx < 0 ? 0 : cx - rx;
+      int   x1 = cx + rx >= (int)w ? (int)w - 1 : cx + rx;
+      int   x;
+
+      for (x=x0; x<=x1; x++)
+      {
+         if (out[y*w + x] == DE_TODO)
+         {
+            out[y*w + x] = DE_WHITE;
+            filled++;
+         }
+      }
+   }
+
+   return filled;
+}
+
+/* Distance estimate rendering of a tile into @out (no stride). Pixels are
+   taken 4 at a time in scan order, and every one far enough outside the
+   set fills the disk around it that can't hold a member. Returns the
+   number of pixels that were filled instead of calculated. */
+uint32_t calc_de(spucommand_t *command, uint32_t *out)
+{
+   uint32_t w = command->width;
+   uint32_t h = command->height;
+   uint32_t n = w*h;
+   float    xstep = (command->end - command->start) / command->width;
+   float    ystep = command->ystep;
+   float    pixel = xstep < ystep ? xstep : ystep;
+   float    white = DE_SATURATE * pixel;
+   uint32_t skipped = 0;
+   uint32_t next = 0;
+   uint32_t i;
+
+   for (i=0; i<n; i++) out[i] = DE_TODO;
+
+   while (1)
+   {
+      uint32_t       idx[4];
+      int            k = 0;
+      int            j;
+      vector float   px = spu_splats((float)0.0);
+      vector float   py = spu_splats((float)0.0);
+
+      while (k < 4 && next < n)
+      {
+         if (out[next] == DE_TODO) idx[k++] = next;
+         next++;
+      }
+      if (k == 0) break;
+
+      for (j=0; j<4; j++)
+      {
+         uint32_t p = idx[j < k ? j : 0];
+         px = spu_insert(command->start + xstep * (p % w), px, j);
+         py = spu_insert(command->yvalue + ystep * (p / w), py, j);
+      }
+
+      vector float dist = calc_de4(command, px, py);
+
+      for (j=0; j<k; j++)
+      {
+         uint32_t p = idx[j];
+         float    d = spu_extract(dist, j);
+
+         /* An earlier point of these 4 may have filled it already */
+         if (out[p] != DE_TODO) continue;
+
+         out[p] = de_shade(d, white);
+
+         if (d > white + pixel)
+         {
+            skipped += de_fill(out, w, h, p % w, p / w, d - white, xstep, ystep);
+         }
+      }
+   }
+
+   return skipped;
+}
+
+/* -------------------------------------------------------------------- */
+/* Histogram colouring                                                   */
+/* -------------------------------------------------------------------- */
+/* Iteration counts of everything calculated since the last CMD_HISTOGRAM */
+static uint32_t histogram[256] __attribute__((aligned(128)));
+/* The palette of palette_ea, it is only fetched again when that changes */
+static uint32_t palette[256] __attribute__((aligned(128)));
+static uint32_t palette_ea;
+
+static void fetch_palette(spucommand_t *command)
+{
+   if (command->palette_ea && command->palette_ea != palette_ea)
+   {
+      mfc_get(palette, command->palette_ea, sizeof(palette), TAG, 0, 0);
+      wait_for_completion();
+      palette_ea = command->palette_ea;
+   }
+}
+
+/* Sum of the iteration counts of the command, with CMDF_PROFILE */
+static uint32_t iterations;
+
+static void count_iterations(spucommand_t *command, const uint32_t *data, uint32_t n)
+{
+   uint32_t i;
+
+   if (command->flags & CMDF_PROFILE)
+   {
+      for (i=0; i<n; i++) iterations += data[i] & 0xff;
+   }
+}
+
+static void colour_line(spucommand_t *command, uint32_t *data)
+{
+   uint32_t i;
+
+   if (command->flags & CMDF_HISTOGRAM)
+   {
+      for (i=0; i<command->width; i++)
+      {
+         histogram[data[i] & 0xff]++;
+      }
+   }
+
+   if (command->palette_ea)
+   {
+      for (i=0; i<command->width; i++)
+      {
+         data[i] = palette[data[i] & 0xff];
+      }
+   }
+}
+
+/* -------------------------------------------------------------------- */
+/* Adaptive supersampling                                                */
+/* -------------------------------------------------------------------- */
+#define AA_APRON  (4)   /* Extra pixels left and right, keeps the lines vector aligned */
+#define AA_WIDTH  (DE_TILE + 2*AA_APRON)
+
+/* The tile at 1 sample per pixel, with a border of neighbours around it */
+static uint32_t aa[AA_WIDTH*(DE_TILE + 2)] __attribute__((aligned(128)));
+
+static inline uint32_t aa_colour(spucommand_t *command, uint32_t pixel)
+{
+   return command->palette_ea ? palette[pixel & 0xff] : pixel;
+}
+
+/* A pixel is an edge when one of its neighbours differs by more than the
+   threshold, or lies on the other side of the set's border. */
+static int aa_edge(spucommand_t *command, const uint32_t *p)
+{
+   static const int  offset[4] = { -1, 1, -AA_WIDTH, AA_WIDTH };
+   uint32_t          c = p[0] & 0xff;
+   int               k;
+
+   for (k=0; k<4; k++)
+   {
+      uint32_t n = p[offset[k]] & 0xff;
+
+      if ((n >= 254) != (c >= 254)) return 1;
+      if ((n > c ? n - c : c - n) > command->threshold) return 1;
+   }
+
+   return 0;
+}
+
+/* The colour of an edge pixel, the average of n x n samples. Every row of
+   samples is one kernel call, four samples wide, with its own jitter in
+   x and y, so the pattern doesn't line up with the filaments. */
+static uint32_t aa_sample(spucommand_t *command, void (*kernel)(spucommand_t *, uint32_t *),
+                          uint32_t px, uint32_t py, float xstep)
+{
+   spucommand_t   row = *command;
+   uint32_t       n = command->samples;
+   uint32_t       r = 0, g = 0, b = 0;
+   uint32_t       out[4] __attribute__((aligned(16)));
+   uint32_t       i, k;
+
+   row.width = 4;
+
+   for (i=0; i<n; i++)
+   {
+      uint32_t h = (px * 73856093) ^ (py * 19349663) ^ (i * 83492791);
+      float    jx = (h & 0xff) / 256.0f;
+      float    jy = ((h >> 8) & 0xff) / 256.0f;
+
+      row.start = command->start + xstep * (px - 0.5f + jx / n);
+      row.end = row.start + 4 * xstep / n;
+      row.yvalue = command->yvalue + command->ystep * (py - 0.5f + (i + jy) / n);
+      place_double(&row, command, px - 0.5f + jx / n, py - 0.5f + (i + jy) / n, 1.0f / n);
+
+      kernel(&row, out);
+
+      for (k=0; k<n; k++)
+      {
+         uint32_t c = aa_colour(command, out[k]);
+
+         r += (c >> 16) & 0xff;
+         g += (c >> 8) & 0xff;
+         b += c & 0xff;
+      }
+   }
+
+   n *= n;
+   return ((r / n) << 16) | ((g / n) << 8) | (b / n);
+}
+
+/* Render a tile into @out (no stride) at 1 sample per pixel, then go over
+   it again and supersample only the pixels on an edge. Returns the number
+   of pixels that were supersampled. */
+uint32_t calc_aa(spucommand_t *command, void (*kernel)(spucommand_t *, uint32_t *), uint32_t *out)
+{
+   spucommand_t   line = *command;
+   uint32_t       w = command->width;
+   uint32_t       h = command->height;
+   float          xstep = (command->end - command->start) / command->width;
+   uint32_t       edges = 0;
+   uint32_t       x, y;
+
+   if (command->samples < 1) command->samples = 1;
+   if (command->samples > AA_MAX_SAMPLES) command->samples = AA_MAX_SAMPLES;
+
+   /* One line above and below the tile, AA_APRON pixels on either side */
+   line.width = AA_WIDTH;
+   line.start = command->start - AA_APRON * xstep;
+   line.end = line.start + AA_WIDTH * xstep;
+   line.yvalue = command->yvalue - command->ystep;
+   place_double(&line, command, -AA_APRON, -1, 1);
+
+   for (y=0; y<h+2; y++)
+   {
+      kernel(&line, &aa[y*AA_WIDTH]);
+      next_line(&line);
+   }
+
+   for (y=0; y<h; y++)
+   {
+      const uint32_t *p = &aa[(y+1)*AA_WIDTH + AA_APRON];
+
+      count_iterations(command, p, w);
+
+      for (x=0; x<w; x++)
+      {
+         if (command->flags & CMDF_HISTOGRAM)
+         {
+            histogram[p[x] & 0xff]++;
+         }
+
+         if (command->samples > 1 && aa_edge(command, &p[x]))
+         {
+            out[y*w + x] = aa_sample(command, kernel, x, y, xstep);
+            edges++;
+         }
+         else
+         {
+            out[y*w + x] = aa_colour(command, p[x]);
+         }
+      }
+   }
+
+   return edges;
+}
+
+/* -------------------------------------------------------------------- */
+/* Coarse preview                                                        */
+/* -------------------------------------------------------------------- */
+/* The samples of a line of blocks, rounded up to whole vectors */
+static uint32_t preview[DE_TILE/PREVIEW_BLOCK + 4] __attribute__((aligned(16)));
+
+/* One sample in the middle of every PREVIEW_BLOCK x PREVIEW_BLOCK block,
+   and the whole block gets its colour. What a tile that missed the
+   deadline of its frame shows, at a fraction of the cost. */
+static void calc_preview(spucommand_t *command, void (*kernel)(spucommand_t *, uint32_t *), uint32_t *out)
+{
+   spucommand_t   sample = *command;
+   float          xstep = (command->end - command->start) / command->width;
+   uint32_t       blocks = (command->width + PREVIEW_BLOCK - 1) / PREVIEW_BLOCK;
+   uint32_t       x, y, line;
+
+   sample.width = (blocks + 3) & ~3;
+   sample.start = command->start + xstep * (PREVIEW_BLOCK / 2);
+   sample.end = sample.start + xstep * PREVIEW_BLOCK * sample.width;
+
+   for (y=0; y<command->height; y+=PREVIEW_BLOCK)
+   {
+      sample.yvalue = command->yvalue + command->ystep * (y + PREVIEW_BLOCK / 2);
+      place_double(&sample, command, PREVIEW_BLOCK / 2, y + PREVIEW_BLOCK / 2, PREVIEW_BLOCK);
+      kernel(&sample, preview);
+      colour_line(&sample, preview);
+
+      for (line=y; line<y+PREVIEW_BLOCK && line<command->height; line++)
+      {
+         uint32_t *p = &out[line*command->width];
+
+         for (x=0; x<command->width; x++) p[x] = preview[x / PREVIEW_BLOCK];
+      }
+   }
+}
+
+/* -------------------------------------------------------------------- */
+/* Progressive accumulation                                              */
+/* -------------------------------------------------------------------- */
+/* A line of the accumulation buffer, one for each line buffer */
+static uint16_t accum[2][DE_TILE*4] __attribute__((aligned(128)));
+
+/* Add a line of colours to the sums of the earlier passes, and replace
+   them by the average. The sums go back behind the line they belong to. */
+static void accumulate_line(spucommand_t *command, uint32_t *data, uint32_t buf)
+{
+   uint16_t   *sum = accum[buf];
+   uint32_t    n = command->pass + 1;
+   uint32_t    scale = (65536 + n - 1) / n;   /* (s * scale) >> 16 is s / n, at most 255 */
+   uint32_t    i;
+
+   if (command->pass)
+   {
+      mfc_get(sum, command->accum_ea, command->width*4*sizeof(uint16_t), TAG, 0, 0);
+      wait_for_completion();
+   }
+   else
+   {
+      for (i=0; i<command->width*4; i++) sum[i] = 0;
+   }
+
+   for (i=0; i<command->width; i++)
+   {
+      uint16_t *s = &sum[i*4];
+      uint32_t  c = data[i];
+
+      s[0] += (c >> 16) & 0xff;
+      s[1] += (c >> 8) & 0xff;
+      s[2] += c & 0xff;
+
+      data[i] = (((s[0] * scale) >> 16) << 16) | (((s[1] * scale) >> 16) << 8) | ((s[2] * scale) >> 16);
+   }
+
+   mfc_put(sum, command->accum_ea, command->width*4*sizeof(uint16_t), TAG_LINE + buf, 0, 0);
 }
 
 /* -------------------------------------------------------------------- */
@@ -127,15 +1127,35 @@ int main(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4) {
 	mfc_get(&spu, spu_ea, sizeof(spustr_t), TAG, 0, 0);
 	wait_for_completion();
 
-   uint32_t data[1920] __attribute__((aligned(16)));    // Max resolution is supposed to be 1920x1080.
+   uint32_t data[2][1920] __attribute__((aligned(16)));    // Max resolution is supposed to be 1920x1080.
+   static uint32_t tile[DE_TILE*DE_TILE] __attribute__((aligned(128)));
+
+   uint32_t woken = 0;
 
    while (1)
    {
-      /* blocking wait for signal notification */
-      spu_read_signal1();
+      uint32_t tail = status[0];
+      uint32_t wake;
+      uint32_t head = ring_head(&wake);
+
+      /* Nothing queued: tell the PPU, and sleep until it signals more */
+      if (head == tail)
+      {
+         send_event(spu.rank, tail);
+         woken = tail;
+         spu_read_signal1();
+         continue;
+      }
+
+      /* The PPU sleeps until the ring is down to this tail, tell it once */
+      if (tail == wake && tail != woken)
+      {
+         send_event(spu.rank, tail);
+         woken = tail;
+      }
 
       /* Retrieve the command using DMA */
-      uint64_t ea = spu.command_ea;
+      uint64_t ea = spu.ring_ea + RING_COMMAND + (tail % SPU_RING) * sizeof(spucommand_t);
       spucommand_t command;
       mfc_get(&command, ea, sizeof(spucommand_t), TAG, 0, 0);
       wait_for_completion();
@@ -144,20 +1164,111 @@ int main(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4) {
       if (command.cmd == CMD_QUIT) break;
 
       uint32_t t = spu_read_decrementer();
+      uint32_t skipped = 0;
+      uint32_t line;
+      void   (*kernel)(spucommand_t *, uint32_t *) = pick_kernel(&command);
+
+      iterations = 0;
+
+      if (command.cmd == CMD_HISTOGRAM)
+      {
+         /* Hand over this SPU's share, and start counting the next frame */
+         mfc_put(histogram, command.dest_ea, sizeof(histogram), TAG_LINE, 0, 0);
+         mfc_write_tag_mask(1 << TAG_LINE);
+         spu_mfcstat(MFC_TAG_UPDATE_ALL);
+
+         for (line = 0; line < 256; line++) histogram[line] = 0;
+      }
+      else if (command.cmd == CMD_POINTS)
+      {
+         calc_points(&command, points_kernel[(command.flags & CMDF_UNROLL) != 0][command.formula < FORMULA_COUNT ? command.formula : FORMULA_MANDEL],
+                     data[0]);
+      }
+      else if (command.cmd == CMD_COPY)
+      {
+         /* A tile calculated ahead of its frame, through the local store */
+         for (line = 0; line < command.height; line++)
+         {
+            mfc_get(&tile[line*command.width], command.src_ea + line*command.stride*sizeof(uint32_t),
+                    command.width*sizeof(uint32_t), TAG, 0, 0);
+         }
+         wait_for_completion();
+
+         for (line = 0; line < command.height; line++)
+         {
+            mfc_put(&tile[line*command.width], command.dest_ea + line*command.stride*sizeof(uint32_t),
+                    command.width*sizeof(uint32_t), TAG_LINE, 0, 0);
+         }
+      }
+      else if (command.cmd == CMD_CALC_DE || command.cmd == CMD_CALC_AA || command.cmd == CMD_PREVIEW)
+      {
+         /* The whole tile is needed for the disks and the edges, it goes
+            out at the end */
+         if (command.cmd == CMD_CALC_DE)
+         {
+            skipped = calc_de(&command, tile);
+         }
+         else if (command.cmd == CMD_PREVIEW)
+         {
+            fetch_palette(&command);
+            calc_preview(&command, kernel, tile);
+         }
+         else
+         {
+            fetch_palette(&command);
+            skipped = calc_aa(&command, kernel, tile);
+         }
 
-      calc_vector(&command, data);
+         for (line = 0; line < command.height; line++)
+         {
+            mfc_put(&tile[line*command.width], command.dest_ea + line*command.stride*sizeof(uint32_t),
+                    command.width*sizeof(uint32_t), TAG_LINE, 0, 0);
+         }
+      }
+      else
+      {
+         fetch_palette(&command);
+
+         /* A tile is a number of lines, each one ystep further down. Two line
+            buffers are used, so the next line is calculated while the
+            previous one is still being written back. */
+         for (line = 0; line < command.height; line++)
+         {
+            uint32_t buf = line & 1;
+
+            mfc_write_tag_mask(1 << (TAG_LINE + buf));
+            spu_mfcstat(MFC_TAG_UPDATE_ALL);
+
+            kernel(&command, data[buf]);
+            count_iterations(&command, data[buf], command.width);
+            colour_line(&command, data[buf]);
+
+            if (command.cmd == CMD_ACCUMULATE)
+            {
+               accumulate_line(&command, data[buf], buf);
+               command.accum_ea += command.stride*4*sizeof(uint16_t);
+            }
+
+            mfc_put(data[buf], command.dest_ea, command.width*sizeof(uint32_t), TAG_LINE + buf, 0, 0);
+
+            next_line(&command);
+            command.dest_ea += command.stride*sizeof(uint32_t);
+         }
+      }
 
       t = t - spu_read_decrementer();
 
-      /* write the result back */
-      mfc_put(data, command.dest_ea, command.width*sizeof(uint32_t), TAG, 0, 0);
-      /* no wait for completion here, as it's done after response message,
-        and the sync element is send with a fence so we're sure our array
-        share is written back before sync */
+      /* Both line buffers must be written back before the response */
+      mfc_write_tag_mask((1 << TAG_LINE) | (1 << (TAG_LINE + 1)));
+      spu_mfcstat(MFC_TAG_UPDATE_ALL);
 
-      /* send the response message */
-      send_response(t);
-      wait_for_completion();
+      if (command.cost_ea)
+      {
+         send_cost(command.cost_ea, t, iterations);
+      }
+
+      /* on to the next command, without asking the PPU */
+      send_status(t, skipped);
    }
 
 	/* properly exit the thread */